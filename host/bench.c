@@ -0,0 +1,106 @@
+/*
+ * Host build: micro benchmark of the image conversion.
+ * Converts full frames of random data for every input format, color depth and display size and prints the time per frame.
+ * The numbers are only comparable between runs on the same machine, not with the ESP32.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ledmatrix_core.h"
+
+// Minimum time spent on every configuration
+#define BENCH_MIN_NS 200000000ull
+
+static const char *format_names[COLOR_COUNT] = { "RGB565", "GS8", "MONO", "RGB888", "RGB444", "PAL8", "PAL4" };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int setup(matrix_t *m, uint16_t width, uint16_t height, uint8_t depth, uint8_t flags)
+{
+	memset(m, 0, sizeof(*m));
+	m->width = width;
+	m->sample_size = (flags & KERNEL_FLAG_NARROW) ? 1 : sizeof(uint16_t);
+	m->single_chn = flags & KERNEL_FLAG_SINGLE;
+	m->column_swap = flags & KERNEL_FLAG_SWAP;
+	m->rows = m->single_chn ? height : height / 2;
+	m->height = height;
+	m->image_width = m->width;
+	m->image_height = m->height;
+	m->color_depth = depth;
+	m->kernel_flags = flags;
+	m->brightness = width - 1;
+	m->buffer_count = 1;
+	m->mono_color[0] = 0xff;
+	m->mono_color[1] = 0x80;
+	m->mono_color[2] = 0x20;
+	esp_err_t err = matrix_alloc(m);
+	for (size_t i = 0; err == ESP_OK && i < INDEX_LUT_SIZE; i++)
+	{
+		m->palette[i] = rand() & 0xffffff;
+	}
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	// Optional KERNEL_FLAG_* combination, e.g. 1 for column swapping or 8 for the 8 bit bus
+	uint8_t flags = (argc > 1) ? atoi(argv[1]) % KERNEL_FLAG_COUNT : 0;
+
+	static const uint16_t sizes[][2] = { { 64, 32 }, { 128, 64 } };
+	static const uint8_t depths[] = { 4, 6, 8 };
+	matrix_t *m = calloc(1, sizeof(matrix_t));
+
+	printf("kernel flags %u\n", flags);
+	printf("%-8s %-8s %5s %12s %10s\n", "format", "size", "depth", "us/frame", "Mpixel/s");
+
+	for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++)
+	for (size_t di = 0; di < sizeof(depths) / sizeof(depths[0]); di++)
+	for (uint8_t format = 0; format < COLOR_COUNT; format++)
+	{
+		uint16_t width = sizes[si][0];
+		uint16_t height = sizes[si][1];
+		if (setup(m, width, height, depths[di], flags) != ESP_OK || prepare_format(m, format) != ESP_OK)
+		{
+			printf("out of memory\n");
+			return 1;
+		}
+
+		size_t stride = source_line_size(m, format);
+		uint8_t *data = malloc(stride * height);
+		for (size_t i = 0; i < stride * height; i++)
+		{
+			data[i] = rand();
+		}
+
+		dirty_t all;
+		dirty_set_all(m, &all);
+
+		uint64_t start = now_ns();
+		uint64_t elapsed;
+		size_t frames = 0;
+		do
+		{
+			update_framebuffer(m, &m->buffer[0], data, stride, format, &all);
+			frames++;
+			elapsed = now_ns() - start;
+		} while (elapsed < BENCH_MIN_NS);
+
+		double us = elapsed / 1000.0 / frames;
+		char size[16];
+		snprintf(size, sizeof(size), "%ux%u", width, height);
+		printf("%-8s %-8s %5u %12.2f %10.1f\n", format_names[format], size, depths[di], us, width * height / us);
+
+		free(data);
+		matrix_free(m);
+	}
+
+	free(m);
+	return 0;
+}
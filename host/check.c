@@ -0,0 +1,928 @@
+/*
+ * Host build: checks the DMA descriptor chains and control patterns of the driver core.
+ *
+ * For a range of display sizes, color depths, bam_planes settings, both bus widths and with the planes in PSRAM, one refresh cycle is replayed through the mocked I2S backend:
+ * - every plane is output plane_repeats times, subimage_count subimages in total
+ * - the descriptors are valid for the ESP32 DMA and the ring is closed, with eof on the last descriptor (every row for the 8 bit bus)
+ * - in PSRAM, every descriptor starts and ends on a block of the external memory
+ * - the repeats of a plane are spread over the whole refresh cycle
+ * - the output enable time of every plane matches its binary weight
+ * - the row select and latch bits are set where the display expects them
+ * - RLE and delta frames decode to the same planes as the raw frame
+ * - FB_PLANES frames restore the converted planes
+ * - the luminance of a frame and the brightness of the power limit
+ * - DDP and E1.31 packets end up at the right place of the network frame
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ledmatrix_core.h"
+
+// Longest allowed gap between two outputs of a plane, in multiples of the average gap (plus one subimage)
+// The top plane fills what is left after the others, so it gets longer gaps around the bam_planes
+#define SPREAD_SLACK 3
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { if (failures++ < 20) { printf("FAIL: " __VA_ARGS__); printf("\n"); } } } while (0)
+
+typedef struct
+{
+	matrix_t *m;
+	const char *name;
+	size_t subimage_stride;
+	// Subimage in progress, its plane and the bytes seen so far
+	int plane;
+	size_t offset;
+	size_t subimages;
+	size_t seen[COLOR_DEPTH_MAX];
+	// Subimage index of the last and the first output of every plane, for the spread
+	size_t last[COLOR_DEPTH_MAX];
+	size_t first[COLOR_DEPTH_MAX];
+	size_t max_gap[COLOR_DEPTH_MAX];
+} replay_t;
+
+static void replay_chunk(const lldesc_t *desc, size_t index, void *ctx)
+{
+	replay_t *r = ctx;
+	matrix_t *m = r->m;
+	const stream_buffer_t *buf = &m->buffer[0];
+
+	// Plane and position within the plane of the descriptor
+	int plane = -1;
+	size_t pos = 0;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		if (desc->buf >= buf->planes[lvl] && desc->buf < buf->planes[lvl] + r->subimage_stride)
+		{
+			plane = lvl;
+			pos = desc->buf - buf->planes[lvl];
+		}
+	}
+	CHECK(plane >= 0, "%s: desc %zu outside of the buffer", r->name, index);
+	if (plane < 0)
+	{
+		return;
+	}
+
+	CHECK(desc->length == desc->size, "%s: desc %zu length %u != size %u", r->name, index, desc->length, desc->size);
+	CHECK(desc->length > 0 && desc->length <= DMA_MAX_XFER_SIZE, "%s: desc %zu length %u", r->name, index, desc->length);
+	CHECK((desc->length & 3) == 0 && (pos & 3) == 0, "%s: desc %zu not word aligned", r->name, index);
+	CHECK(desc->owner == 1, "%s: desc %zu not owned by the DMA", r->name, index);
+	if (m->ext_mem)
+	{
+		CHECK(((uintptr_t)desc->buf & (DMA_EXT_MEM_ALIGN - 1)) == 0 && (desc->length & (DMA_EXT_MEM_ALIGN - 1)) == 0, "%s: desc %zu not aligned for PSRAM", r->name, index);
+	}
+	if (m->sample_size == 1)
+	{
+		CHECK(desc->eof && desc->length == m->width, "%s: desc %zu is not a row with eof", r->name, index);
+	}
+	else
+	{
+		CHECK(desc->eof == (index == m->dma_desc_count - 1), "%s: eof on desc %zu", r->name, index);
+	}
+	CHECK(pos + desc->length <= r->subimage_stride, "%s: desc %zu crosses the end of plane %d", r->name, index, plane);
+
+	if (r->offset == 0)
+	{
+		r->plane = plane;
+		CHECK(pos == 0, "%s: desc %zu starts inside of a subimage", r->name, index);
+	}
+	else
+	{
+		CHECK(plane == r->plane && pos == r->offset, "%s: desc %zu doesn't continue subimage", r->name, index);
+	}
+
+	r->offset += desc->length;
+	if (r->offset >= r->subimage_stride)
+	{
+		CHECK(r->offset == r->subimage_stride, "%s: subimage %zu too long", r->name, r->subimages);
+		int p = r->plane;
+		if (r->seen[p])
+		{
+			size_t gap = r->subimages - r->last[p];
+			if (gap > r->max_gap[p]) r->max_gap[p] = gap;
+		}
+		else
+		{
+			r->first[p] = r->subimages;
+		}
+		r->last[p] = r->subimages;
+		r->seen[p]++;
+		r->subimages++;
+		r->offset = 0;
+	}
+}
+
+static void check_chain(matrix_t *m, const char *name)
+{
+	replay_t r = { .m = m, .name = name, .subimage_stride = m->sample_size * m->width * m->rows };
+	const lldesc_t *first = &m->buffer[0].dma_desc[0];
+
+	size_t n = i2s_mock_replay(first, 2 * m->dma_desc_count, replay_chunk, &r);
+	CHECK(n == m->dma_desc_count, "%s: refresh cycle has %zu of %zu descriptors", name, n, m->dma_desc_count);
+	CHECK(m->buffer[0].dma_desc[m->dma_desc_count - 1].qe.stqe_next == first, "%s: ring not closed", name);
+	CHECK(r.offset == 0, "%s: last subimage incomplete", name);
+	CHECK(r.subimages == subimage_count(m), "%s: %zu subimages, expected %zu", name, r.subimages, subimage_count(m));
+
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		size_t repeats = plane_repeats(m, lvl);
+		CHECK(r.seen[lvl] == repeats, "%s: plane %u output %zu times, expected %zu", name, lvl, r.seen[lvl], repeats);
+		if (repeats > 1)
+		{
+			// Includes the wrap around into the next refresh cycle
+			size_t wrap = r.subimages - r.last[lvl] + r.first[lvl];
+			size_t gap = (wrap > r.max_gap[lvl]) ? wrap : r.max_gap[lvl];
+			size_t limit = SPREAD_SLACK * ((r.subimages + repeats - 1) / repeats) + 1;
+			CHECK(gap <= limit, "%s: plane %u has a gap of %zu subimages, limit %zu", name, lvl, gap, limit);
+		}
+	}
+}
+
+/*
+ * The planner must predict the buffers matrix_alloc created.
+ */
+static void check_plan(matrix_t *m, const char *name)
+{
+	refresh_plan_t plan;
+	plan_depth(m, m->color_depth, m->bam_planes, &plan);
+	CHECK(plan.subimages == subimage_count(m), "%s: planned %zu subimages", name, plan.subimages);
+	CHECK(plan.cycle_samples == m->width * m->rows * subimage_count(m), "%s: planned %u samples per cycle", name, plan.cycle_samples);
+	CHECK(plan.desc_count == m->dma_desc_count, "%s: planned %zu descriptors, has %zu", name, plan.desc_count, m->dma_desc_count);
+	CHECK(plan.stream_bytes == m->stats.stream_bytes, "%s: planned %zu stream bytes, has %zu", name, plan.stream_bytes, m->stats.stream_bytes);
+	CHECK(plan.desc_bytes == m->stats.desc_bytes, "%s: planned %zu descriptor bytes, has %zu", name, plan.desc_bytes, m->stats.desc_bytes);
+	CHECK(plan.plane_bytes * plan.color_depth * m->buffer_count == m->stats.stream_bytes, "%s: planned %zu bytes per plane", name, plan.plane_bytes);
+}
+
+/*
+ * Checks the control bytes of all planes for the current brightness.
+ */
+static void check_control(matrix_t *m, const char *name)
+{
+	size_t row_stride = m->sample_size * m->width;
+	bool narrow = m->sample_size == 1;
+	uint8_t row_mask = (1 << BITSTREAM_ROWS_MAX) - 1;
+	double unit = (double)(m->brightness - 1) / (1 << m->bam_planes);
+
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		const uint8_t *si = m->buffer[0].planes[lvl];
+		size_t plane_on = 0;
+		for (uint8_t row = 0; row < m->rows; row++)
+		{
+			size_t on = 0;
+			for (uint16_t pixel = 0; pixel < m->width; pixel++)
+			{
+				const uint8_t *px = si + row_stride * row + m->sample_size * pixel;
+				uint8_t ctrl = narrow ? px[0] : px[BITSTREAM_CTRL_BYTE];
+				if (m->invert) ctrl = ~ctrl;
+
+				bool lat, enabled;
+				if (narrow)
+				{
+					// The row lines are switched by the interrupt, which must happen while the output is off
+					lat = ctrl & (1 << BITSTREAM8_LAT_BIT);
+					enabled = !(ctrl & (1 << BITSTREAM8_OE_BIT));
+					CHECK(!enabled || pixel < m->width - m->row_blank, "%s: plane %u row %u enabled at pixel %u, within row_blank", name, lvl, row, pixel);
+				}
+				else
+				{
+					uint8_t display_row = (ctrl >> BITSTREAM_CTRL_ROW_START_BIT) & row_mask;
+					CHECK(display_row == ((uint8_t)(row - 1) & row_mask), "%s: plane %u row %u pixel %u selects row %u", name, lvl, row, pixel, display_row);
+					lat = ctrl & (1 << BITSTREAM_CTRL_LAT_BIT);
+					enabled = !(ctrl & (1 << BITSTREAM_CTRL_OE_BIT));
+				}
+
+				CHECK(lat == (pixel == m->width - 2), "%s: plane %u row %u latch at pixel %u", name, lvl, row, pixel);
+				CHECK(!enabled || pixel >= 2, "%s: plane %u row %u enabled while switching rows", name, lvl, row);
+				on += enabled;
+			}
+
+			if (row == 0)
+			{
+				plane_on = on;
+			}
+			CHECK(on == plane_on, "%s: plane %u row %u on for %zu pixels, row 0 for %zu", name, lvl, row, on, plane_on);
+		}
+
+		// On time of the plane over a whole refresh cycle vs. its binary weight
+		double weight = unit * (1 << lvl);
+		double actual = (double)plane_on * plane_repeats(m, lvl);
+		double tolerance = (lvl < m->bam_planes) ? 0.5 : 0.0;
+		CHECK(actual >= weight - tolerance - 1e-9 && actual <= weight + tolerance + 1e-9,
+			"%s: plane %u on for %.1f pixels per cycle, expected %.1f", name, lvl, actual, weight);
+	}
+}
+
+static int setup(matrix_t *m, uint16_t width, uint8_t rows, uint8_t depth, uint8_t bam, bool invert, bool narrow, bool ext_mem, uint8_t dither)
+{
+	memset(m, 0, sizeof(*m));
+	m->dither = dither;
+	m->width = width;
+	m->sample_size = narrow ? 1 : sizeof(uint16_t);
+	m->ext_mem = ext_mem;
+	m->row_blank = narrow ? 8 : 0;
+	m->rows = rows;
+	m->height = rows * 2;
+	m->image_width = m->width;
+	m->image_height = m->height;
+	m->color_depth = depth;
+	m->bam_planes = bam;
+	m->invert = invert;
+	m->kernel_flags = (invert ? KERNEL_FLAG_INVERT : 0) | (narrow ? KERNEL_FLAG_NARROW : 0);
+	m->brightness = width - 1 - m->row_blank;
+	m->buffer_count = 1;
+	m->mono_color[0] = 0xff;
+	m->mono_color[1] = 0x80;
+	m->mono_color[2] = 0x25;
+	esp_err_t err = matrix_alloc(m);
+	if (err == ESP_OK)
+	{
+		// Any colors, so the palette formats don't just convert to black
+		for (size_t i = 0; i < INDEX_LUT_SIZE; i++) m->palette[i] = rand() & 0xffffff;
+	}
+	return err;
+}
+
+/*
+ * Encodes pixels of pixel_size bytes for show with ENC_RLE, or ENC_DELTA against prev.
+ */
+static size_t encode_frame(const uint8_t *img, const uint8_t *prev, size_t pixels, size_t pixel_size, uint8_t *out)
+{
+	size_t len = 0;
+	size_t i = 0;
+	while (i < pixels)
+	{
+		size_t n = 0;
+		while (prev && i + n < pixels && n <= ENC_COUNT_MASK && !memcmp(img + (i + n) * pixel_size, prev + (i + n) * pixel_size, pixel_size)) n++;
+		if (n)
+		{
+			out[len++] = ENC_SKIP | (n - 1);
+			i += n;
+			continue;
+		}
+
+		while (i + n < pixels && n <= ENC_COUNT_MASK && !memcmp(img + (i + n) * pixel_size, img + i * pixel_size, pixel_size)) n++;
+		if (n >= 3)
+		{
+			out[len++] = ENC_RUN | (n - 1);
+			memcpy(out + len, img + i * pixel_size, pixel_size);
+			len += pixel_size;
+			i += n;
+			continue;
+		}
+
+		n = 1;
+		while (i + n < pixels && n < ENC_RUN && memcmp(img + (i + n) * pixel_size, img + (i + n - 1) * pixel_size, pixel_size)) n++;
+		out[len++] = n - 1;
+		memcpy(out + len, img + i * pixel_size, pixel_size * n);
+		len += pixel_size * n;
+		i += n;
+	}
+	return len;
+}
+
+// Random image made of short runs, so all packet types show up
+static void random_runs(uint8_t *img, size_t pixels, size_t pixel_size)
+{
+	for (size_t i = 0; i < pixels; )
+	{
+		size_t n = 1 + rand() % 80;
+		uint8_t v[4] = { rand(), rand(), rand(), rand() };
+		for (; n && i < pixels; n--, i++)
+		{
+			memcpy(img + i * pixel_size, v, pixel_size);
+			if (rand() % 8 == 0) img[i * pixel_size] = rand();
+		}
+	}
+}
+
+/*
+ * Decoded frames must end up with exactly the same planes as converting the raw frame, for a display
+ * showing lines 8 to 39 of a 48 line framebuffer.
+ */
+static void check_decode(matrix_t *m, const char *name)
+{
+	static const uint8_t formats[] = { COLOR_RGB565, COLOR_GS8, COLOR_RGB888, COLOR_PAL8, COLOR_RGB444 };
+	m->fb_y = 8;
+	m->fb_height = m->image_height + 16;
+
+	for (size_t fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++)
+	{
+		uint8_t format = formats[fi];
+		CHECK(prepare_format(m, format) == ESP_OK, "%s: out of memory", name);
+		size_t pixel_size = format_line_size(format, 1);
+		size_t line = source_line_size(m, format);
+		size_t pixels = (size_t)m->image_width * m->fb_height;
+		uint8_t *img = malloc(pixels * pixel_size);
+		uint8_t *prev = malloc(pixels * pixel_size);
+		uint8_t *enc = malloc(pixels * pixel_size * 2);
+		size_t plane_size = m->sample_size * m->width * m->rows;
+		uint8_t *ref = malloc(plane_size * m->color_depth);
+		dirty_t all;
+		dirty_set_all(m, &all);
+
+		for (int delta = 0; delta < 2; delta++)
+		{
+			random_runs(img, pixels, pixel_size);
+			if (delta)
+			{
+				// Change a few blocks of the previous frame, which is in the buffer already
+				memcpy(prev, img, pixels * pixel_size);
+				update_framebuffer(m, &m->buffer[0], prev + line * m->fb_y, line, format, &all);
+				for (int k = 0; k < 20; k++)
+				{
+					size_t at = rand() % pixels;
+					for (size_t n = rand() % 100; n && at < pixels; n--, at++) img[at * pixel_size] ^= 0x5a;
+				}
+			}
+
+			size_t len = encode_frame(img, delta ? prev : NULL, pixels, pixel_size, enc);
+			CHECK(encoded_frame_check(m, enc, len, format, delta ? ENC_DELTA : ENC_RLE) == ESP_OK, "%s: format %u delta=%d rejected", name, format, delta);
+
+			rect_t changed;
+			decode_frame(m, &m->buffer[0], enc, len, format, &changed);
+			for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+			{
+				memcpy(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size);
+			}
+			CHECK(delta || (changed.x1 == m->image_width && changed.y1 == m->image_height), "%s: format %u changed %ux%u", name, format, changed.x1, changed.y1);
+
+			update_framebuffer(m, &m->buffer[0], img + line * m->fb_y, line, format, &all);
+			for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+			{
+				CHECK(!memcmp(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size), "%s: format %u delta=%d decodes differently in plane %u", name, format, delta, lvl);
+			}
+		}
+
+		// Skips are only allowed in delta frames, and frames must not end in a packet
+		uint8_t skip[] = { ENC_SKIP | ENC_COUNT_MASK };
+		CHECK(encoded_frame_check(m, skip, sizeof(skip), format, ENC_RLE) != ESP_OK, "%s: skip accepted for ENC_RLE", name);
+		uint8_t literal[4] = { 1 };
+		CHECK(encoded_frame_check(m, literal, 1 + pixel_size, format, ENC_DELTA) != ESP_OK, "%s: truncated literal accepted", name);
+
+		free(ref);
+		free(enc);
+		free(prev);
+		free(img);
+	}
+}
+
+/*
+ * Color bits of a plane, without the control bits and the inversion of the stream.
+ */
+static void plane_colors(matrix_t *m, const uint8_t *plane, uint8_t *out)
+{
+	size_t count = (size_t)m->width * m->rows;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint8_t mask = (m->sample_size == 1) ? BITSTREAM8_COLOR_MASK : 0xff;
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = (plane[m->sample_size * i + BITSTREAM_COLOR_BYTE] ^ inv) & mask;
+	}
+}
+
+/*
+ * Changing the color depth must keep the planes of the image that are still used, rebuild the ring and the
+ * control pattern and convert like a display set up with the new depth. Every step starts from the original depth.
+ */
+static void check_depth(matrix_t *m, const char *name)
+{
+	uint8_t depth = m->color_depth;
+	uint8_t bam = m->bam_planes;
+	size_t line = source_line_size(m, COLOR_RGB888);
+	size_t count = (size_t)m->width * m->rows;
+	size_t stream_bytes = m->stats.stream_bytes;
+	uint8_t *img = malloc(line * m->image_height);
+	uint8_t *ref = malloc(count * COLOR_DEPTH_MAX);
+	uint8_t *colors = malloc(count);
+	dirty_t all;
+	dirty_set_all(m, &all);
+
+	for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+	for (uint8_t d = 1; d <= COLOR_DEPTH_MAX; d++)
+	{
+		CHECK(prepare_format(m, COLOR_RGB888) == ESP_OK, "%s: out of memory", name);
+		update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB888, &all);
+		for (uint8_t lvl = 0; lvl < depth; lvl++)
+		{
+			plane_colors(m, m->buffer[0].planes[lvl], ref + count * lvl);
+		}
+
+		CHECK(matrix_set_depth(m, d, bam < d ? bam : d - 1) == ESP_OK, "%s: depth %u failed", name, d);
+		check_chain(m, name);
+		check_control(m, name);
+		CHECK(m->stats.stream_bytes == stream_bytes / depth * d, "%s: depth %u has %zu stream bytes", name, d, m->stats.stream_bytes);
+		for (uint8_t lvl = 0; lvl < d; lvl++)
+		{
+			// Planes added below the old ones stay dark
+			plane_colors(m, m->buffer[0].planes[lvl], colors);
+			int old = lvl + depth - d;
+			bool same = (old >= 0) ? !memcmp(colors, ref + count * old, count) : !colors[0] && !memcmp(colors, colors + 1, count - 1);
+			CHECK(same, "%s: depth %u to %u changed plane %u", name, depth, d, lvl);
+		}
+
+		// Without dithering, less depth is the same image with the low bits cut off
+		if (d <= depth)
+		{
+			CHECK(prepare_format(m, COLOR_RGB888) == ESP_OK, "%s: out of memory", name);
+			update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB888, &all);
+			for (uint8_t lvl = 0; lvl < d; lvl++)
+			{
+				plane_colors(m, m->buffer[0].planes[lvl], colors);
+				CHECK(!memcmp(colors, ref + count * (lvl + depth - d), count), "%s: depth %u converts differently in plane %u", name, d, lvl);
+			}
+		}
+
+		CHECK(matrix_set_depth(m, depth, bam) == ESP_OK, "%s: depth %u failed", name, depth);
+	}
+	check_chain(m, name);
+
+	free(colors);
+	free(ref);
+	free(img);
+}
+
+/*
+ * Luminance of buffer 0 counted straight from the color bits of the planes.
+ */
+static void luminance_ref(matrix_t *m, uint8_t *colors, uint32_t *ref)
+{
+	size_t count = (size_t)m->width * m->rows;
+	ref[0] = ref[1] = ref[2] = 0;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		plane_colors(m, m->buffer[0].planes[lvl], colors);
+		for (size_t i = 0; i < count; i++)
+		for (uint8_t c = 0; c < 3; c++)
+		{
+			ref[c] += (((colors[i] >> (BITSTREAM_COLOR_R1_POS + c)) & 1) + ((colors[i] >> (BITSTREAM_COLOR_R2_POS + c)) & 1)) << lvl;
+		}
+	}
+}
+
+/*
+ * The luminance of a frame counts every lit color bit with the weight of its plane, the power limit picks the
+ * highest brightness within the limit.
+ */
+static void check_power(matrix_t *m, const char *name)
+{
+	size_t line = source_line_size(m, COLOR_RGB888);
+	size_t count = (size_t)m->width * m->rows;
+	uint32_t full = (1 << m->color_depth) - 1;
+	uint8_t *img = malloc(line * m->image_height);
+	uint8_t *colors = malloc(count);
+	uint32_t lum[3];
+	dirty_t all;
+	dirty_set_all(m, &all);
+	m->led_ma = LED_MA_DEFAULT;
+	CHECK(prepare_format(m, COLOR_RGB888) == ESP_OK, "%s: out of memory", name);
+
+	memset(img, 0xff, line * m->image_height);
+	update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB888, &all);
+	buffer_luminance(m, &m->buffer[0], lum);
+	for (uint8_t c = 0; c < 3; c++)
+	{
+		CHECK(lum[c] == (uint32_t)m->width * m->height * full, "%s: white has luminance %u in channel %u", name, lum[c], c);
+	}
+	// Every LED is on for brightness - 1 pixels of the width in one of rows rows
+	uint32_t white_ma = (uint64_t)3 * m->height * LED_MA_DEFAULT * (m->brightness - 1) / m->rows;
+	CHECK(luminance_current(m, lum, m->brightness) == white_ma, "%s: white draws %u mA", name, luminance_current(m, lum, m->brightness));
+
+	for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+	update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB888, &all);
+	buffer_luminance(m, &m->buffer[0], lum);
+	uint32_t ref[3];
+	luminance_ref(m, colors, ref);
+	CHECK(!memcmp(lum, ref, sizeof(ref)), "%s: luminance %u/%u/%u, expected %u/%u/%u", name, lum[0], lum[1], lum[2], ref[0], ref[1], ref[2]);
+
+	// The counts kept per row stay right when only a few lines change, before and after they are counted again
+	buffer_update_luminance(m, &m->buffer[0]);
+	rect_t part = { 1, m->image_height / 3, m->image_width / 2, m->image_height / 3 + 2 };
+	dirty_t changed;
+	dirty_clear(&changed);
+	dirty_add_rect(m, &changed, &part);
+	for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+	update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB888, &changed);
+	luminance_ref(m, colors, ref);
+	for (int counted = 0; counted < 2; counted++)
+	{
+		buffer_luminance(m, &m->buffer[0], lum);
+		CHECK(!memcmp(lum, ref, sizeof(ref)), "%s: luminance after a partial update %u/%u/%u, expected %u/%u/%u", name, lum[0], lum[1], lum[2], ref[0], ref[1], ref[2]);
+		buffer_update_luminance(m, &m->buffer[0]);
+	}
+
+	// The current is compared without rounding, in mA * full * rows * width
+	uint16_t max_b = m->width;
+	uint64_t lit = ((uint64_t)lum[0] + lum[1] + lum[2]) * LED_MA_DEFAULT;
+	uint64_t scale = (uint64_t)full * count;
+	uint32_t limits[] = { 0, 1, 100, luminance_current(m, lum, max_b) / 2, luminance_current(m, lum, max_b) };
+	for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++)
+	{
+		uint16_t b = power_limited_brightness(m, lum, max_b, limits[i]);
+		CHECK(b >= 1 && b <= max_b, "%s: limit %u gives brightness %u", name, limits[i], b);
+		CHECK(lit * (b - 1) <= limits[i] * scale, "%s: limit %u exceeded at brightness %u", name, limits[i], b);
+		CHECK(b == max_b || lit * b > limits[i] * scale, "%s: limit %u allows more than brightness %u", name, limits[i], b);
+	}
+
+	free(colors);
+	free(img);
+}
+
+/*
+ * Copies pixel sx of a source line to pixel dx of another, also for the formats with several pixels in a byte.
+ */
+static void copy_source_pixel(uint8_t format, uint8_t *dst, uint16_t dx, const uint8_t *src, uint16_t sx)
+{
+	if (format == COLOR_MONO)
+	{
+		uint8_t v = (src[sx >> 3] >> (7 - (sx & 7))) & 1;
+		dst[dx >> 3] = (dst[dx >> 3] & ~(0x80 >> (dx & 7))) | (v << (7 - (dx & 7)));
+	}
+	else if (format == COLOR_PAL4)
+	{
+		uint8_t v = (sx & 1) ? (src[sx >> 1] & 0x0f) : (src[sx >> 1] >> 4);
+		uint8_t shift = (dx & 1) ? 0 : 4;
+		dst[dx >> 1] = (dst[dx >> 1] & ~(0x0f << shift)) | (v << shift);
+	}
+	else
+	{
+		size_t pixel_size = format_line_size(format, 1);
+		memcpy(dst + pixel_size * dx, src + pixel_size * sx, pixel_size);
+	}
+}
+
+/*
+ * The kernels of the formats with several pixels in a byte must convert like an RGB888 image of the same colors,
+ * pixel by pixel and for all KERNEL_FLAG_* combinations. Without dithering, a clear mono pixel is plain black.
+ */
+static void check_packed(matrix_t *m, const char *name)
+{
+	static const uint8_t formats[] = { COLOR_MONO, COLOR_PAL4 };
+	size_t plane_size = m->sample_size * m->width * m->rows;
+	uint8_t *ref = malloc(plane_size * m->color_depth);
+	size_t rgb_line = source_line_size(m, COLOR_RGB888);
+	uint8_t *rgb = malloc(rgb_line * m->image_height);
+	uint32_t mono = (m->mono_color[0] << 16) | (m->mono_color[1] << 8) | m->mono_color[2];
+	uint8_t flags = m->kernel_flags;
+	dirty_t all;
+	dirty_set_all(m, &all);
+
+	for (size_t fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++)
+	for (int swap = 0; swap < 2; swap++)
+	for (int single = 0; single < 2; single++)
+	{
+		uint8_t format = formats[fi];
+		size_t line = source_line_size(m, format);
+		uint8_t *img = malloc(line * m->image_height);
+		for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+		for (uint16_t y = 0; y < m->image_height; y++)
+		for (uint16_t x = 0; x < m->image_width; x++)
+		{
+			const uint8_t *l = img + line * y;
+			uint32_t color = (format == COLOR_MONO)
+				? (((l[x >> 3] >> (7 - (x & 7))) & 1) ? mono : 0)
+				: m->palette[(x & 1) ? (l[x >> 1] & 0x0f) : (l[x >> 1] >> 4)];
+			uint8_t *px = rgb + rgb_line * y + 3 * x;
+			px[0] = color >> 16;
+			px[1] = color >> 8;
+			px[2] = color;
+		}
+
+		m->column_swap = swap;
+		m->single_chn = single;
+		m->kernel_flags = (flags & ~(KERNEL_FLAG_SWAP | KERNEL_FLAG_SINGLE)) | (swap ? KERNEL_FLAG_SWAP : 0) | (single ? KERNEL_FLAG_SINGLE : 0);
+		CHECK(prepare_format(m, COLOR_RGB888) == ESP_OK, "%s: out of memory", name);
+		update_framebuffer(m, &m->buffer[0], rgb, rgb_line, COLOR_RGB888, &all);
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			memcpy(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size);
+		}
+		CHECK(prepare_format(m, format) == ESP_OK, "%s: out of memory", name);
+		update_framebuffer(m, &m->buffer[0], img, line, format, &all);
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			CHECK(!memcmp(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size), "%s: format %u swap=%d single=%d differs from RGB888 in plane %u", name, format, swap, single, lvl);
+		}
+		free(img);
+	}
+
+	m->column_swap = false;
+	m->single_chn = false;
+	m->kernel_flags = flags;
+	free(rgb);
+	free(ref);
+}
+
+/*
+ * A scaled source image must convert exactly like the same image scaled up in advance.
+ * The scaled path takes every pixel on its own, so it also serves as reference for the full size kernels.
+ */
+static void check_scale(matrix_t *m, const char *name)
+{
+	static const uint8_t formats[] = { COLOR_RGB565, COLOR_GS8, COLOR_RGB888, COLOR_PAL8, COLOR_PAL4, COLOR_MONO };
+	size_t plane_size = m->sample_size * m->width * m->rows;
+	uint8_t *ref = malloc(plane_size * m->color_depth);
+	dirty_t all;
+	dirty_set_all(m, &all);
+
+	for (size_t fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++)
+	for (uint8_t shift = 1; shift <= 2; shift++)
+	{
+		uint8_t format = formats[fi];
+		CHECK(prepare_format(m, format) == ESP_OK, "%s: out of memory", name);
+		uint16_t width = m->image_width >> shift;
+		uint16_t height = m->image_height >> shift;
+		size_t line = format_line_size(format, width);
+		size_t full_line = source_line_size(m, format);
+		uint8_t *img = malloc(line * height);
+		uint8_t *full = calloc(full_line, m->image_height);
+
+		for (size_t i = 0; i < line * height; i++) img[i] = rand();
+		for (uint16_t y = 0; y < m->image_height; y++)
+		for (uint16_t x = 0; x < m->image_width; x++)
+		{
+			copy_source_pixel(format, full + full_line * y, x, img + line * (y >> shift), x >> shift);
+		}
+
+		update_framebuffer(m, &m->buffer[0], full, full_line, format, &all);
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			memcpy(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size);
+		}
+		update_framebuffer_scaled_by(m, &m->buffer[0], img, line, format, shift, &all);
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			CHECK(!memcmp(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size), "%s: format %u scale %u differs in plane %u", name, format, 1 << shift, lvl);
+		}
+
+		free(full);
+		free(img);
+	}
+	free(ref);
+}
+
+/*
+ * A FB_PLANES frame taken from a converted frame must restore exactly the same buffer, control bits included.
+ */
+static void check_planes(matrix_t *m, const char *name)
+{
+	size_t line = source_line_size(m, COLOR_RGB565);
+	size_t plane_size = m->sample_size * m->width * m->rows;
+	size_t count = (size_t)m->width * m->rows;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint8_t *img = malloc(line * m->image_height);
+	uint8_t *frame = malloc(planes_frame_size(m));
+	uint8_t *ref = malloc(plane_size * m->color_depth);
+	dirty_t all;
+	dirty_set_all(m, &all);
+
+	for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+	update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB565, &all);
+
+	// Like encode_planes, without the inversion and the control bits
+	planes_frame_header(m, frame);
+	uint8_t *p = frame + PLANES_HEADER_SIZE;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		memcpy(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size);
+		for (size_t i = 0; i < count; i++)
+		{
+			uint8_t c = m->buffer[0].planes[lvl][m->sample_size * i + BITSTREAM_COLOR_BYTE] ^ inv;
+			*p++ = (m->sample_size == 1) ? (c & BITSTREAM8_COLOR_MASK) : c;
+		}
+	}
+	CHECK(planes_frame_check(m, frame, planes_frame_size(m)) == ESP_OK, "%s: planes frame rejected", name);
+	CHECK(planes_frame_check(m, frame, planes_frame_size(m) - 1) != ESP_OK, "%s: short planes frame accepted", name);
+
+	for (size_t i = 0; i < line * m->image_height; i++) img[i] = rand();
+	update_framebuffer(m, &m->buffer[0], img, line, COLOR_RGB565, &all);
+	copy_planes(m, &m->buffer[0], frame);
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		CHECK(!memcmp(ref + plane_size * lvl, m->buffer[0].planes[lvl], plane_size), "%s: copy_planes differs in plane %u", name, lvl);
+	}
+
+	// Another layout of the stream
+	frame[2] ^= 1;
+	CHECK(planes_frame_check(m, frame, planes_frame_size(m)) != ESP_OK, "%s: planes frame of another depth accepted", name);
+
+	free(ref);
+	free(frame);
+	free(img);
+}
+
+enum { NET_W = 64, NET_H = 16, NET_FB_Y = 4, NET_LINES = 8, NET_STRIDE = 3 * NET_W };
+
+// Collects the spans of net_store in a frame of the lines of the display
+typedef struct
+{
+	uint8_t frame[NET_STRIDE * NET_LINES];
+	uint16_t y0;
+	uint16_t y1;
+	int spans;
+} net_frame_t;
+
+static void net_span(void *ctx, uint16_t y, uint16_t x0, uint16_t x1, const uint8_t *pixels)
+{
+	net_frame_t *f = (net_frame_t *)ctx;
+	CHECK(y < NET_LINES && x0 < x1 && x1 <= NET_W, "net: span %u to %u of line %u", x0, x1, y);
+	memcpy(f->frame + NET_STRIDE * y + 3 * x0, pixels, 3 * (x1 - x0));
+	if (y < f->y0) f->y0 = y;
+	if (y + 1 > f->y1) f->y1 = y + 1;
+	f->spans++;
+}
+
+static void net_frame_clear(net_frame_t *f)
+{
+	memset(f, 0, sizeof(*f));
+	f->y0 = UINT16_MAX;
+}
+
+/*
+ * Feeds DDP and E1.31 packets of a 64x16 frame to a receiver for lines 4 to 11 of it.
+ */
+static void check_net(void)
+{
+	static uint8_t pkt[NET_E131_HEADER_SIZE + NET_E131_UNIVERSE_BYTES];
+	static net_frame_t f;
+	net_sink_t sink;
+	net_packet_t out;
+
+	// DDP packet covering lines 3 to 5 of the frame, only 4 and 5 are on the display
+	net_frame_clear(&f);
+	net_sink_init(&sink, NET_DDP, 1, NET_STRIDE, NET_LINES, NET_FB_Y, NET_H);
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = NET_DDP_FLAG_VERSION | NET_DDP_FLAG_PUSH;
+	pkt[3] = NET_DDP_ID_DISPLAY;
+	uint32_t offset = 3 * NET_STRIDE;
+	pkt[4] = offset >> 24; pkt[5] = offset >> 16; pkt[6] = offset >> 8; pkt[7] = offset;
+	pkt[8] = (3 * NET_STRIDE) >> 8; pkt[9] = (3 * NET_STRIDE) & 0xff;
+	memset(pkt + NET_DDP_HEADER_SIZE, 0x5a, 3 * NET_STRIDE);
+	size_t len = NET_DDP_HEADER_SIZE + 3 * NET_STRIDE;
+	CHECK(net_parse(&sink, pkt, len, len, &out), "ddp: packet rejected");
+	CHECK(out.offset == offset && out.start == NET_DDP_HEADER_SIZE && out.length == 3 * NET_STRIDE && out.push, "ddp: wrong header");
+	net_store(&sink, out.offset, pkt + out.start, out.length, net_span, &f);
+	CHECK(f.y0 == 0 && f.y1 == 2 && f.spans == 2, "ddp: lines %u to %u changed in %d spans", f.y0, f.y1, f.spans);
+	CHECK(f.frame[0] == 0x5a && f.frame[2 * NET_STRIDE - 1] == 0x5a && f.frame[2 * NET_STRIDE] == 0, "ddp: wrong data stored");
+
+	pkt[0] |= NET_DDP_FLAG_QUERY;
+	CHECK(!net_parse(&sink, pkt, len, len, &out) && sink.dropped == 1, "ddp: query accepted");
+
+	// Pixel data split in the middle of pixels, like at the end of a pbuf
+	net_frame_clear(&f);
+	for (size_t i = 0; i < sizeof(pkt); i++) pkt[i] = i * 7 + 1;
+	offset = NET_FB_Y * NET_STRIDE + 3;
+	static const size_t cuts[] = { 0, 4, 5, 200, 385, 600 };
+	for (size_t i = 0; i + 1 < sizeof(cuts) / sizeof(cuts[0]); i++)
+	{
+		net_store(&sink, offset + cuts[i], pkt + cuts[i], cuts[i + 1] - cuts[i], net_span, &f);
+	}
+	CHECK(!memcmp(f.frame + 3, pkt, 600) && f.frame[603] == 0 && f.frame[2] == 0, "ddp: split pixels stored wrong");
+
+	// The rest of a split pixel without its start is dropped
+	net_frame_clear(&f);
+	net_store(&sink, offset + 1, pkt, 5, net_span, &f);
+	CHECK(f.spans == 1 && f.frame[3] == 0 && f.frame[6] == pkt[2], "ddp: incomplete pixel stored");
+
+	// E1.31 starting at universe 10, universe 11 ends in the second line of the display
+	net_frame_clear(&f);
+	net_sink_init(&sink, NET_E131, 10, NET_STRIDE, NET_LINES, NET_FB_Y, NET_H);
+	CHECK(sink.universe_count == (NET_STRIDE * NET_H + NET_E131_UNIVERSE_BYTES - 1) / NET_E131_UNIVERSE_BYTES, "e131: %u universes", sink.universe_count);
+	memset(pkt, 0, sizeof(pkt));
+	pkt[1] = 0x10;
+	memcpy(pkt + 4, "ASC-E1.17", 9);
+	pkt[21] = 0x04;
+	pkt[43] = 0x02;
+	pkt[113] = 0;
+	pkt[114] = 11;
+	pkt[117] = 0x02;
+	pkt[118] = 0xa1;
+	pkt[123] = (NET_E131_UNIVERSE_BYTES + 1) >> 8;
+	pkt[124] = (NET_E131_UNIVERSE_BYTES + 1) & 0xff;
+	memset(pkt + NET_E131_HEADER_SIZE, 0xa5, NET_E131_UNIVERSE_BYTES);
+	CHECK(net_parse(&sink, pkt, sizeof(pkt), sizeof(pkt), &out), "e131: packet rejected");
+	CHECK(out.offset == NET_E131_UNIVERSE_BYTES && out.length == NET_E131_UNIVERSE_BYTES && !out.push, "e131: wrong header");
+	net_store(&sink, out.offset, pkt + out.start, out.length, net_span, &f);
+	size_t end = 2 * NET_E131_UNIVERSE_BYTES - NET_FB_Y * NET_STRIDE;
+	CHECK(f.frame[0] == 0xa5 && f.frame[end - 1] == 0xa5 && f.frame[end] == 0, "e131: wrong data stored");
+	CHECK(f.y0 == 0 && f.y1 == (end - 1) / NET_STRIDE + 1, "e131: lines %u to %u changed", f.y0, f.y1);
+
+	// Universe 14 ends past line 11
+	pkt[114] = 14;
+	CHECK(net_parse(&sink, pkt, sizeof(pkt), sizeof(pkt), &out) && out.push, "e131: last universe doesn't push");
+
+	pkt[112] = 0x80;
+	CHECK(!net_parse(&sink, pkt, sizeof(pkt), sizeof(pkt), &out), "e131: preview data accepted");
+}
+
+int main(void)
+{
+	static const uint16_t widths[] = { 32, 64, 128, 256 };
+	static const uint8_t rows[] = { 8, 16, 32 };
+	size_t configs = 0;
+	matrix_t *m = calloc(1, sizeof(matrix_t));
+
+	for (size_t wi = 0; wi < sizeof(widths) / sizeof(widths[0]); wi++)
+	for (size_t ri = 0; ri < sizeof(rows) / sizeof(rows[0]); ri++)
+	for (uint8_t depth = 1; depth <= COLOR_DEPTH_MAX; depth++)
+	for (uint8_t bam = 0; bam < depth; bam++)
+	for (int invert = 0; invert < 2; invert++)
+	for (int narrow = 0; narrow < 2; narrow++)
+	for (int ext_mem = 0; ext_mem < 2; ext_mem++)
+	{
+		// Same condition as in the init parameters
+		if (ext_mem && (narrow ? widths[wi] : 2 * widths[wi] * rows[ri]) % DMA_EXT_MEM_ALIGN)
+		{
+			continue;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "%ux%u depth=%u bam=%u%s%s%s", widths[wi], rows[ri] * 2, depth, bam, invert ? " inverted" : "", narrow ? " 8 bit" : "", ext_mem ? " psram" : "");
+
+		if (setup(m, widths[wi], rows[ri], depth, bam, invert, narrow, ext_mem, DITHER_NONE) != ESP_OK)
+		{
+			printf("FAIL: %s: out of memory\n", name);
+			return 1;
+		}
+		configs++;
+
+		check_chain(m, name);
+		check_control(m, name);
+		check_plan(m, name);
+		check_planes(m, name);
+		check_power(m, name);
+		if (widths[wi] == 64)
+		{
+			check_depth(m, name);
+			check_packed(m, name);
+		}
+
+		// Incremental brightness changes must end up with the same pattern as a full rebuild
+		size_t size = m->sample_size * m->width * m->rows;
+		uint8_t *ref = malloc(size * m->color_depth);
+		uint16_t steps[] = { m->width / 2, 1, m->width - 1 - m->row_blank, 3 };
+		size_t step_count = sizeof(steps) / sizeof(steps[0]);
+		for (size_t i = 0; i < step_count; i++)
+		{
+			if (i % 2)
+			{
+				// In small pieces like the interrupt does, with the target changing on the way
+				uint32_t budget = 5;
+				buffer_move_brightness(m, &m->buffer[0], steps[(i + 1) % step_count], &budget);
+				unsigned calls = 0;
+				do
+				{
+					budget = 5;
+					calls++;
+				} while (!buffer_move_brightness(m, &m->buffer[0], steps[i], &budget) && calls < 100000);
+				CHECK(calls < 100000, "%s: buffer_move_brightness to %u does not finish", name, steps[i]);
+			}
+			else
+			{
+				buffer_set_brightness(m, &m->buffer[0], steps[i]);
+			}
+			m->brightness = steps[i];
+			for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+			{
+				memcpy(ref + size * lvl, m->buffer[0].planes[lvl], size);
+			}
+			create_control_pattern(m, &m->buffer[0]);
+			for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+			{
+				CHECK(!memcmp(ref + size * lvl, m->buffer[0].planes[lvl], size), "%s: brightness move to %u differs from the full pattern in plane %u", name, steps[i], lvl);
+			}
+			check_control(m, name);
+		}
+		free(ref);
+
+		// The decoder and the scaled kernel handle pixels one at a time, so a few sizes and all kernel flags are enough
+		// Dithering makes the two columns of a pair differ
+		if (widths[wi] == 64 && bam == 0 && (depth == 1 || depth == COLOR_DEPTH_MAX))
+		{
+			matrix_free(m);
+			if (setup(m, widths[wi], rows[ri], depth, bam, invert, narrow, ext_mem, DITHER_ORDERED) != ESP_OK)
+			{
+				printf("FAIL: %s: out of memory\n", name);
+				return 1;
+			}
+			m->dither_phase = 1;
+			for (int swap = 0; swap < 2; swap++)
+			{
+				m->column_swap = swap;
+				m->kernel_flags = (m->kernel_flags & ~KERNEL_FLAG_SWAP) | (swap ? KERNEL_FLAG_SWAP : 0);
+				check_decode(m, name);
+				check_scale(m, name);
+			}
+		}
+
+		matrix_free(m);
+	}
+
+	free(m);
+	check_net();
+	printf("%zu configurations, %d failures\n", configs, failures);
+	return failures != 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Host build: encodes raw frames into FB_PLANES frames for show and play.
+ * The frames are converted by the driver core itself, so the color bytes are exactly what show would
+ * produce on a display with the same settings, only the conversion happens here instead of on the ESP.
+ *
+ *   encode_planes [options] width rows < frames.raw > frames.planes
+ *
+ * width is the width parameter of init, rows the number of row addresses (2 ^ len(io_rows)).
+ * The input is a sequence of frames of width x height pixels, height is 2 * rows (rows with -1).
+ * Every frame of the output is a complete FB_PLANES frame, so they can be sliced at a fixed size.
+ *
+ * Options:
+ *   -f FORMAT  input format: rgb565 (default, little endian like framebuf), rgb888, rgb444 or gs8
+ *   -d DEPTH   color_depth, 1 to 8 (default 8)
+ *   -g GAMMA   gamma curve like set_gamma, "cie" for the CIE 1931 curve (default 1.0)
+ *   -w WHITE   0xRRGGBB of full white like set_gamma (default 0xffffff)
+ *   -m COLOR   0xRRGGBB mono color for gs8 (default 0xffffff)
+ *   -D DITHER  none (default), ordered or temporal, the temporal pattern advances with every frame like show
+ *   -s         column_swap
+ *   -1         single channel display
+ *
+ * Panel mappings (tiles, mapping) are not supported, the frames are laid out for a plain chain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ledmatrix_core.h"
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: encode_planes [-f rgb565|rgb888|rgb444|gs8] [-d depth] [-g gamma|cie] [-w 0xRRGGBB] [-m 0xRRGGBB] [-D none|ordered|temporal] [-s] [-1] width rows\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t format = COLOR_RGB565;
+	int depth = COLOR_DEPTH_MAX;
+	float gamma = 1.0f;
+	uint32_t white = 0xffffff;
+	uint32_t mono = 0xffffff;
+	uint8_t dither = DITHER_NONE;
+	bool swap = false;
+	bool single = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "f:d:g:w:m:D:s1")) != -1)
+	{
+		switch (opt)
+		{
+			case 'f':
+				if (!strcmp(optarg, "rgb565")) format = COLOR_RGB565;
+				else if (!strcmp(optarg, "rgb888")) format = COLOR_RGB888;
+				else if (!strcmp(optarg, "rgb444")) format = COLOR_RGB444;
+				else if (!strcmp(optarg, "gs8")) format = COLOR_GS8;
+				else usage();
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				break;
+			case 'g':
+				gamma = strcmp(optarg, "cie") ? strtof(optarg, NULL) : GAMMA_CIE;
+				break;
+			case 'w':
+				white = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				mono = strtoul(optarg, NULL, 0);
+				break;
+			case 'D':
+				if (!strcmp(optarg, "none")) dither = DITHER_NONE;
+				else if (!strcmp(optarg, "ordered")) dither = DITHER_ORDERED;
+				else if (!strcmp(optarg, "temporal")) dither = DITHER_TEMPORAL;
+				else usage();
+				break;
+			case 's':
+				swap = true;
+				break;
+			case '1':
+				single = true;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 2)
+	{
+		usage();
+	}
+
+	int width = atoi(argv[optind]);
+	int rows = atoi(argv[optind + 1]);
+	if (width < 2 || width > UINT16_MAX || (width & 1) || rows < 1 || rows > 64 || depth < 1 || depth > COLOR_DEPTH_MAX)
+	{
+		fprintf(stderr, "encode_planes: invalid display size or color depth\n");
+		return 2;
+	}
+
+	// The same setup as init, with the wide bus and without inversion: both are applied when the frame is shown
+	matrix_t *m = calloc(1, sizeof(matrix_t));
+	m->width = width;
+	m->sample_size = sizeof(uint16_t);
+	m->rows = rows;
+	m->single_chn = single;
+	m->column_swap = swap;
+	m->height = single ? rows : 2 * rows;
+	m->image_width = m->width;
+	m->image_height = m->height;
+	m->fb_height = m->height;
+	m->color_depth = depth;
+	m->dither = dither;
+	m->kernel_flags = (swap ? KERNEL_FLAG_SWAP : 0) | (single ? KERNEL_FLAG_SINGLE : 0);
+	m->brightness = width - 1;
+	m->buffer_count = 1;
+	m->mono_color[0] = mono >> 16;
+	m->mono_color[1] = mono >> 8;
+	m->mono_color[2] = mono;
+	if (matrix_alloc(m) != ESP_OK)
+	{
+		fprintf(stderr, "encode_planes: out of memory\n");
+		return 1;
+	}
+	init_channel_lut(m, gamma, white);
+	channel_lut_changed(m);
+	if (prepare_format(m, format) != ESP_OK)
+	{
+		fprintf(stderr, "encode_planes: out of memory\n");
+		return 1;
+	}
+
+	size_t line_size = source_line_size(m, format);
+	size_t frame_size = line_size * m->image_height;
+	size_t count = (size_t)m->rows * m->width;
+	uint8_t *frame = malloc(frame_size);
+	uint8_t *out = malloc(planes_frame_size(m));
+	dirty_t all;
+	dirty_set_all(m, &all);
+
+	size_t frames = 0;
+	while (fread(frame, 1, frame_size, stdin) == frame_size)
+	{
+		if (m->dither == DITHER_TEMPORAL)
+		{
+			m->dither_phase = (m->dither_phase + 1) & (DITHER_CELLS - 1);
+		}
+		update_framebuffer(m, &m->buffer[0], frame, line_size, format, &all);
+
+		planes_frame_header(m, out);
+		uint8_t *p = out + PLANES_HEADER_SIZE;
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			const uint8_t *px = m->buffer[0].planes[lvl] + BITSTREAM_COLOR_BYTE;
+			for (size_t i = 0; i < count; i++)
+			{
+				*p++ = px[2 * i];
+			}
+		}
+		fwrite(out, 1, planes_frame_size(m), stdout);
+		frames++;
+	}
+
+	fprintf(stderr, "encode_planes: %zu frames of %zu bytes\n", frames, planes_frame_size(m));
+	free(out);
+	free(frame);
+	matrix_free(m);
+	free(m);
+	return 0;
+}
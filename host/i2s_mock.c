@@ -0,0 +1,24 @@
+/*
+ * Host build: replays the DMA descriptor chains built by the driver core, see i2s_parallel.h
+ */
+
+#include "i2s_parallel.h"
+
+size_t i2s_mock_replay(const lldesc_t *first, size_t limit, i2s_mock_chunk_t chunk, void *ctx)
+{
+	const lldesc_t *desc = first;
+	for (size_t i = 0; i < limit && desc; i++)
+	{
+		if (chunk)
+		{
+			chunk(desc, i, ctx);
+		}
+
+		desc = desc->qe.stqe_next;
+		if (desc == first)
+		{
+			return i + 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * Host build: there is no IRAM, code placement attributes have no effect
+ */
+
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Host build: all memory is DMA capable
+ */
+
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+	(void)caps;
+	return malloc(size);
+}
+
+static inline void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps)
+{
+	(void)caps;
+	void *ptr;
+	return posix_memalign(&ptr, alignment, size) ? NULL : ptr;
+}
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Host build: the types of FreeRTOS that are part of matrix_t.
+ * The core never calls into FreeRTOS, the bindings do.
+ */
+
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stdint.h>
+
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+
+typedef struct
+{
+	int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+
+#endif
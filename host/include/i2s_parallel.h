@@ -0,0 +1,60 @@
+/*
+ * Host build: mocked I2S parallel backend.
+ * The descriptors have the same fields as the ones of the ESP32 DMA, the output is replayed by i2s_mock_replay.
+ */
+
+#ifndef HOST_I2S_PARALLEL_H
+#define HOST_I2S_PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef int i2s_port_t;
+
+#define I2S_NUM_0   0
+#define I2S_NUM_1   1
+#define I2S_NUM_MAX 2
+
+// Linked list DMA descriptor
+typedef struct lldesc_s
+{
+	volatile uint32_t size   :12,
+	                  length :12,
+	                  offset : 5,
+	                  sosf   : 1,
+	                  eof    : 1,
+	                  owner  : 1;
+	volatile uint8_t *buf;
+	union
+	{
+		volatile uint32_t empty;
+		struct
+		{
+			struct lldesc_s *stqe_next;
+		} qe;
+	};
+} lldesc_t;
+
+// Registers read by the driver
+typedef struct
+{
+	struct
+	{
+		uint32_t tx_idle : 1;
+	} state;
+	uint32_t out_link_dscr;
+	uint32_t out_eof_des_addr;
+} i2s_dev_t;
+
+// Called for every descriptor of a refresh cycle, in output order
+typedef void (*i2s_mock_chunk_t)(const lldesc_t *desc, size_t index, void *ctx);
+
+/*
+ * Follows the descriptor ring from first until it links back to first, which is one refresh cycle.
+ * Returns the number of descriptors, or 0 if the ring is not closed within limit descriptors.
+ */
+size_t i2s_mock_replay(const lldesc_t *first, size_t limit, i2s_mock_chunk_t chunk, void *ctx);
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Host build: cycle counter of a 240MHz CPU, derived from the monotonic clock
+ */
+
+#ifndef HOST_XTENSA_HAL_H
+#define HOST_XTENSA_HAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define HOST_CPU_MHZ 240
+
+static inline uint32_t xthal_get_ccount(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	return (uint32_t)(ns * HOST_CPU_MHZ / 1000);
+}
+
+#endif
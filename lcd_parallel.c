@@ -0,0 +1,270 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <esp_attr.h>
+#include "esp_idf_version.h"
+#include "esp_rom_gpio.h"
+#include "esp_rom_sys.h"
+#include "driver/gpio.h"
+#include "esp_private/gdma.h"
+#include "hal/gdma_ll.h"
+#include "soc/gdma_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "soc/lcd_cam_struct.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_private/periph_ctrl.h"
+#else
+#include "driver/periph_ctrl.h"
+#endif
+
+#include "lcd_parallel.h"
+
+// Source of the LCD clock, see the LCD_CAM_LCD_CLK_SEL register
+#define LCD_CLK_SEL_PLL160M 3
+#define LCD_CLK_SRC_HZ 160000000
+
+// Largest dividers of the LCD clock and the pixel clock
+#define LCD_CLKM_DIV_MAX 256
+#define LCD_PCLK_DIV_MAX 64
+
+static gdma_channel_handle_t dma_chan;
+static int dma_chan_id;
+static lcd_parallel_isr_t eof_isr;
+static void *eof_arg;
+static volatile uint32_t eof_desc;
+
+static bool IRAM_ATTR dma_eof(gdma_channel_handle_t chan, gdma_event_data_t *event, void *arg)
+{
+	(void)chan;
+	(void)arg;
+	eof_desc = event->tx_eof_desc_addr;
+	if (eof_isr)
+	{
+		eof_isr(eof_arg);
+	}
+	return false;
+}
+
+static void connect_pin(int gpio, uint32_t signal, bool invert)
+{
+	if (gpio < 0)
+	{
+		return;
+	}
+	gpio_reset_pin(gpio);
+	gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+	esp_rom_gpio_connect_out_signal(gpio, signal, invert, false);
+}
+
+/*
+ * Splits the ratio of the PLL and the sample rate into the LCD clock divider and the pixel clock divider.
+ * The fractional part of the LCD clock divider is not used, it adds jitter.
+ */
+static esp_err_t set_clock(uint32_t sample_rate)
+{
+	if (sample_rate < LCD_PARALLEL_MIN_RATE || sample_rate > LCD_PARALLEL_MAX_RATE)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	uint32_t div = (LCD_CLK_SRC_HZ + sample_rate / 2) / sample_rate;
+	uint32_t best_clkm = 0;
+	uint32_t best_pclk = 0;
+	uint32_t best_err = UINT32_MAX;
+	for (uint32_t pclk = 1; pclk <= LCD_PCLK_DIV_MAX; pclk++)
+	{
+		uint32_t clkm = (div + pclk / 2) / pclk;
+		if (clkm < 2 || clkm > LCD_CLKM_DIV_MAX)
+		{
+			continue;
+		}
+		uint32_t err = (clkm * pclk > div) ? clkm * pclk - div : div - clkm * pclk;
+		if (err < best_err)
+		{
+			best_err = err;
+			best_clkm = clkm;
+			best_pclk = pclk;
+		}
+	}
+	if (!best_clkm)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	LCD_CAM.lcd_clock.clk_en = 1;
+	LCD_CAM.lcd_clock.lcd_clk_sel = LCD_CLK_SEL_PLL160M;
+	LCD_CAM.lcd_clock.lcd_clkm_div_a = 0;
+	LCD_CAM.lcd_clock.lcd_clkm_div_b = 0;
+	// 0 selects the maximum
+	LCD_CAM.lcd_clock.lcd_clkm_div_num = best_clkm & (LCD_CLKM_DIV_MAX - 1);
+	LCD_CAM.lcd_clock.lcd_ck_idle_edge = 0;
+	LCD_CAM.lcd_clock.lcd_ck_out_edge = 0;
+	if (best_pclk == 1)
+	{
+		LCD_CAM.lcd_clock.lcd_clk_equ_sysclk = 1;
+	}
+	else
+	{
+		LCD_CAM.lcd_clock.lcd_clk_equ_sysclk = 0;
+		LCD_CAM.lcd_clock.lcd_clkcnt_n = best_pclk - 1;
+	}
+	return ESP_OK;
+}
+
+esp_err_t lcd_parallel_driver_install(const lcd_parallel_config_t *cfg, bool invert, lcd_parallel_isr_t isr, void *arg)
+{
+	if (dma_chan)
+	{
+		lcd_parallel_driver_uninstall();
+	}
+
+	periph_module_enable(PERIPH_LCD_CAM_MODULE);
+	periph_module_reset(PERIPH_LCD_CAM_MODULE);
+
+	esp_err_t err = set_clock(cfg->sample_rate);
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+
+	// Plain data output, the LCD keeps clocking as long as the DMA delivers data
+	bool wide = cfg->sample_width == LCD_PARALLEL_WIDTH_16;
+	LCD_CAM.lcd_ctrl.lcd_rgb_mode_en = 0;
+	LCD_CAM.lcd_rgb_yuv.lcd_conv_bypass = 0;
+	LCD_CAM.lcd_misc.lcd_next_frame_en = 0;
+	LCD_CAM.lcd_misc.lcd_bk_en = 0;
+	LCD_CAM.lcd_data_dout_mode.val = 0;
+	LCD_CAM.lcd_user.lcd_always_out_en = 1;
+	LCD_CAM.lcd_user.lcd_8bits_order = 0;
+	LCD_CAM.lcd_user.lcd_bit_order = 0;
+	LCD_CAM.lcd_user.lcd_byte_order = 0;
+	LCD_CAM.lcd_user.lcd_2byte_en = wide;
+	LCD_CAM.lcd_user.lcd_cmd = 0;
+	LCD_CAM.lcd_user.lcd_dummy = 0;
+	LCD_CAM.lcd_user.lcd_dout = 1;
+	LCD_CAM.lcd_user.lcd_update = 1;
+	LCD_CAM.lcd_misc.lcd_afifo_reset = 1;
+
+	size_t lines = wide ? 16 : 8;
+	for (size_t i = 0; i < lines; i++)
+	{
+		connect_pin(cfg->gpios_bus[i], LCD_DATA_OUT0_IDX + i, false);
+	}
+	connect_pin(cfg->gpio_clk, LCD_PCLK_IDX, invert);
+
+	gdma_channel_alloc_config_t alloc = { .direction = GDMA_CHANNEL_DIRECTION_TX };
+	err = gdma_new_channel(&alloc, &dma_chan);
+	if (err != ESP_OK)
+	{
+		dma_chan = NULL;
+		return err;
+	}
+	gdma_connect(dma_chan, GDMA_MAKE_TRIGGER(GDMA_TRIG_PERIPH_LCD, 0));
+	gdma_get_channel_id(dma_chan, &dma_chan_id);
+
+	// The ring is output over and over again, so the DMA must not touch the descriptors
+	gdma_strategy_config_t strategy = { .owner_check = false, .auto_update_desc = false };
+	gdma_apply_strategy(dma_chan, &strategy);
+
+	// Buffers in PSRAM must be aligned to the external memory block size, see DMA_EXT_MEM_ALIGN
+	gdma_transfer_ability_t ability = { .sram_trans_align = 4, .psram_trans_align = 64 };
+	gdma_set_transfer_ability(dma_chan, &ability);
+
+	eof_isr = isr;
+	eof_arg = arg;
+	gdma_tx_event_callbacks_t callbacks = { .on_trans_eof = dma_eof };
+	return gdma_register_tx_event_callbacks(dma_chan, &callbacks, NULL);
+}
+
+void lcd_parallel_driver_uninstall(void)
+{
+	if (!dma_chan)
+	{
+		return;
+	}
+
+	LCD_CAM.lcd_user.lcd_start = 0;
+	gdma_stop(dma_chan);
+	gdma_disconnect(dma_chan);
+	gdma_del_channel(dma_chan);
+	dma_chan = NULL;
+	eof_isr = NULL;
+	periph_module_disable(PERIPH_LCD_CAM_MODULE);
+}
+
+esp_err_t lcd_parallel_set_rate(uint32_t sample_rate)
+{
+	if (!dma_chan)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	esp_err_t err = set_clock(sample_rate);
+	if (err == ESP_OK)
+	{
+		LCD_CAM.lcd_user.lcd_update = 1;
+	}
+	return err;
+}
+
+esp_err_t lcd_parallel_send_dma(const lldesc_t *desc)
+{
+	if (!dma_chan)
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	LCD_CAM.lcd_user.lcd_start = 0;
+	gdma_stop(dma_chan);
+	gdma_reset(dma_chan);
+	LCD_CAM.lcd_misc.lcd_afifo_reset = 1;
+
+	esp_err_t err = gdma_start(dma_chan, (intptr_t)desc);
+	if (err != ESP_OK)
+	{
+		return err;
+	}
+
+	// Let the DMA fill the FIFO before the first clock
+	esp_rom_delay_us(1);
+	LCD_CAM.lcd_user.lcd_update = 1;
+	LCD_CAM.lcd_user.lcd_start = 1;
+	return ESP_OK;
+}
+
+bool lcd_parallel_tx_idle(void)
+{
+	return !LCD_CAM.lcd_user.lcd_start;
+}
+
+uint32_t IRAM_ATTR lcd_parallel_out_link(void)
+{
+	return gdma_ll_tx_get_current_desc_addr(&GDMA, dma_chan_id);
+}
+
+uint32_t IRAM_ATTR lcd_parallel_eof_desc(void)
+{
+	return eof_desc;
+}
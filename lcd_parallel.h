@@ -0,0 +1,93 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Parallel output for the ESP32-S3, which has no I2S parallel mode.
+ * The LCD_CAM peripheral runs in i8080 mode without command and dummy phases and is fed by a GDMA channel,
+ * which can also read from PSRAM.
+ * The interface is the same as for esp_i2s_parallel, so the rest of the driver doesn't care which one it uses.
+ */
+
+#ifndef LCD_PARALLEL_H
+#define LCD_PARALLEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "esp32s3/rom/lldesc.h"
+
+// There is a single LCD_CAM peripheral
+#define LCD_PARALLEL_NUM_MAX 1
+
+// Highest supported pixel clock, the LCD clock is derived from the 160MHz PLL
+#define LCD_PARALLEL_MAX_RATE 40000000
+#define LCD_PARALLEL_MIN_RATE 10000
+
+typedef enum
+{
+	LCD_PARALLEL_WIDTH_8,
+	LCD_PARALLEL_WIDTH_16,
+} lcd_parallel_width_t;
+
+typedef struct
+{
+	int gpio_clk;
+	// Data lines, -1 for unused ones. Only the first 8 are used for LCD_PARALLEL_WIDTH_8.
+	int gpios_bus[16];
+	uint32_t sample_rate;
+	lcd_parallel_width_t sample_width;
+} lcd_parallel_config_t;
+
+// Called from the GDMA interrupt at the end of every descriptor with the eof bit set
+typedef void (*lcd_parallel_isr_t)(void *arg);
+
+/*
+ * Sets up the pins, the clock and a GDMA channel for the LCD_CAM peripheral.
+ * invert only inverts the clock output, the data is expected to be inverted already.
+ */
+esp_err_t lcd_parallel_driver_install(const lcd_parallel_config_t *cfg, bool invert, lcd_parallel_isr_t isr, void *arg);
+void lcd_parallel_driver_uninstall(void);
+
+/*
+ * Changes the pixel clock, this also works while the output is running.
+ * The old clock is kept if the rate can't be reached.
+ */
+esp_err_t lcd_parallel_set_rate(uint32_t sample_rate);
+
+/*
+ * Stops the current transfer and starts a new one at the given descriptor.
+ * The output keeps running as long as the descriptors are linked.
+ */
+esp_err_t lcd_parallel_send_dma(const lldesc_t *desc);
+
+// True once everything sent was clocked out
+bool lcd_parallel_tx_idle(void);
+
+// Address of the descriptor the DMA is reading from
+uint32_t lcd_parallel_out_link(void);
+
+// Address of the last descriptor that caused an EOF interrupt
+uint32_t lcd_parallel_eof_desc(void);
+
+#endif
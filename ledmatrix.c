@@ -25,783 +25,3671 @@
 
 #include <esp_heap_caps.h>
 #include <esp_err.h>
+#include <esp_attr.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "py/nlr.h"
 #include "py/obj.h"
 #include "py/runtime.h"
 #include "py/binary.h"
+#include "py/mpthread.h"
+#include "py/mperrno.h"
+#include "lwip/api.h"
+#include "esp_timer.h"
 
-#include "i2s_parallel.h"
+#include <xtensa/hal.h>
+#include "rom/ets_sys.h"
+#include "driver/gpio.h"
+#include "soc/gpio_reg.h"
+
+#include "ledmatrix_core.h"
 
 /*
- * The internal positions of the bits in the data stream buffer are always fixed.
- * Mapping is done through the GPIO matrix
- * The color values are all packed into the first byte.
- * Since these values are the only thing that changes when the images is updated, this saves some time
-*/
-#define BITSTREAM_COLOR_START_IO 0
-#define BITSTREAM_COLOR_BYTE     0
-#define BITSTREAM_COLOR_R1_POS   0
-#define BITSTREAM_COLOR_G1_POS   1
-#define BITSTREAM_COLOR_B1_POS   2
-#define BITSTREAM_COLOR_R2_POS   3
-#define BITSTREAM_COLOR_G2_POS   4
-#define BITSTREAM_COLOR_B2_POS   5
+ * Output backend, the I2S peripheral of the ESP32 or the LCD_CAM peripheral of the ESP32-S3.
+ * Both take the same descriptor rings and call dma_eof_isr for every descriptor with eof set.
+ */
+#if CONFIG_IDF_TARGET_ESP32S3
+#define OUTPUT_PORT_COUNT LCD_PARALLEL_NUM_MAX
+#define OUTPUT_WIDTH_8    LCD_PARALLEL_WIDTH_8
+#define OUTPUT_WIDTH_16   LCD_PARALLEL_WIDTH_16
+#define OUTPUT_MIN_RATE   LCD_PARALLEL_MIN_RATE
+typedef lcd_parallel_config_t output_config_t;
+#else
+#define OUTPUT_PORT_COUNT I2S_NUM_MAX
+#define OUTPUT_WIDTH_8    I2S_PARALLEL_WIDTH_8
+#define OUTPUT_WIDTH_16   I2S_PARALLEL_WIDTH_16
+// Lowest clock the I2S dividers can reach
+#define OUTPUT_MIN_RATE   313000
+// Range of the integer part of the I2S clkm divider
+#define I2S_CLKM_DIV_MIN  2
+#define I2S_CLKM_DIV_MAX  255
+typedef i2s_parallel_config_t output_config_t;
+#endif
 
-#define BITSTREAM_CTRL_BYTE          1
-#define BITSTREAM_CTRL_OE_BIT        0
-#define BITSTREAM_CTRL_LAT_BIT       1
-#define BITSTREAM_CTRL_ROW_START_BIT 2
+// Python object of a display, there is at most one display per I2S port
+typedef struct
+{
+	mp_obj_base_t base;
+	matrix_t m;
+	// Output setup of init, kept for reconfigure
+	output_config_t output_cfg;
+} ledmatrix_obj_t;
+
+extern const mp_obj_type_t ledmatrix_matrix_type;
+
+// Displays are statically allocated, since the interrupt and the worker task keep using them.
+// The lock must be valid before the first init, stats and the other functions take it on any display.
+static ledmatrix_obj_t matrix_objs[OUTPUT_PORT_COUNT] = {
+	[0 ... OUTPUT_PORT_COUNT - 1] = { .m.swap_lock = portMUX_INITIALIZER_UNLOCKED },
+};
 
-#define BITSTREAM_CTRL_OE_IO         8
-#define BITSTREAM_CTRL_LAT_IO        9
-#define BITSTREAM_CTRL_ROW_START_IO  10
+// Display used by the module level functions
+static ledmatrix_obj_t *default_matrix = &matrix_objs[0];
 
-#define BITSTREAM_ROWS_MAX 6
+// Address of the descriptor the DMA is reading from
+static inline uint32_t IRAM_ATTR output_current_desc(matrix_t *m)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	(void)m;
+	return lcd_parallel_out_link();
+#else
+	return m->i2s_dev->out_link_dscr;
+#endif
+}
 
-#define I2S_CHN I2S_NUM_0
+// Address of the descriptor that caused the last EOF interrupt
+static inline uint32_t IRAM_ATTR output_eof_desc(matrix_t *m)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	(void)m;
+	return lcd_parallel_eof_desc();
+#else
+	return m->i2s_dev->out_eof_des_addr;
+#endif
+}
 
-// The DMA length filed is 12 bit long and transfers must be word aligned
-#define DMA_MAX_XFER_SIZE ((1<<12) - 4)
+/*
+ * Buffer whose ring the DMA is in right now, NO_BUFFER if it is in none of them, e.g. in the one of stop_dma.
+ */
+static uint8_t IRAM_ATTR current_ring(matrix_t *m)
+{
+	uint32_t current = output_current_desc(m);
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		uintptr_t offset = (current - (uintptr_t)m->buffer[i].dma_desc) & DMA_DESC_ADDR_MASK;
+		if (offset < m->dma_desc_count * sizeof(lldesc_t))
+		{
+			return i;
+		}
+	}
+	return NO_BUFFER;
+}
 
-#define COLOR_RGB565 0
-#define COLOR_GS8    1
-#define COLOR_MONO   2
+/*
+ * Checks if the DMA has moved on from the frontbuffer and makes the buffer it is in the new frontbuffer.
+ * With triple buffering, that may be a frame that was pending before and got replaced by a newer one just after
+ * the DMA went into it. The newer one stays pending then.
+ * Returns true if the frontbuffer changed. Must be called with swap_lock held.
+ */
+static bool IRAM_ATTR update_frontbuffer(matrix_t *m)
+{
+	if (m->pending == NO_BUFFER)
+	{
+		return false;
+	}
 
+	uint8_t ring = current_ring(m);
+	if (ring == NO_BUFFER || ring == m->frontbuffer)
+	{
+		// Still in the old ring, the link was changed too late for this cycle
+		return false;
+	}
 
-//#define DEBUG
-//#define DEBUG_DMA
-//#define DEBUG_TEST_ON_INIT
+	m->frontbuffer = ring;
+	if (ring == m->pending)
+	{
+		m->pending = NO_BUFFER;
+	}
+	return true;
+}
 
-typedef struct
+/*
+ * Index of the descriptor that caused the EOF interrupt, in whatever buffer it belongs to.
+ * Returns false if it is not one of the ring descriptors, e.g. the one of stop_dma.
+ */
+static bool IRAM_ATTR eof_descriptor(matrix_t *m, size_t *index)
+{
+	uint32_t eof = output_eof_desc(m);
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		uintptr_t offset = (eof - (uintptr_t)m->buffer[i].dma_desc) & DMA_DESC_ADDR_MASK;
+		if (offset < m->dma_desc_count * sizeof(lldesc_t))
+		{
+			*index = offset / sizeof(lldesc_t);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * 8 bit bus: selects the row whose data was just sent and is latched at the end of it.
+ * The output is disabled for the last row_blank pixels of every row, this has to happen in that time.
+ */
+static void IRAM_ATTR select_row(matrix_t *m, uint8_t row)
+{
+	uint64_t set = 0;
+	for (uint8_t i = 0; i < m->row_io_count; i++)
+	{
+		if (row & (1 << i))
+		{
+			set |= m->row_io_bits[i];
+		}
+	}
+	uint64_t clear = m->row_io_all & ~set;
+	if (m->invert)
+	{
+		uint64_t t = set;
+		set = clear;
+		clear = t;
+	}
+
+	REG_WRITE(GPIO_OUT_W1TC_REG, (uint32_t)clear);
+	REG_WRITE(GPIO_OUT1_W1TC_REG, (uint32_t)(clear >> 32));
+	REG_WRITE(GPIO_OUT_W1TS_REG, (uint32_t)set);
+	REG_WRITE(GPIO_OUT1_W1TS_REG, (uint32_t)(set >> 32));
+}
+
+/*
+ * Moves the output enable pattern of the buffers on the display toward the brightness, by at most budget bytes.
+ * Only the buffers the interrupt owns are touched: the frontbuffer and the pending one, a single buffer only while
+ * nothing converts into it. The 8 bit bus has color and control bits in the same byte, so anything else would race
+ * with the conversion. The backbuffer gets its pattern when it is presented.
+ * Large changes take a few refresh cycles this way, but the interrupt never runs for long.
+ * Must be called with swap_lock held.
+ */
+static void IRAM_ATTR follow_brightness(matrix_t *m, uint32_t budget)
 {
-	uint8_t *stream_data;
-	lldesc_t *dma_desc;
-} stream_buffer_t;
+	if (m->buffer_count == 1 && m->backbuffer_acquired)
+	{
+		return;
+	}
 
-struct
+	stream_buffer_t *front = &m->buffer[m->frontbuffer];
+	if (buffer_move_brightness(m, front, buffer_brightness(m, front), &budget) && m->pending != NO_BUFFER)
+	{
+		stream_buffer_t *pending = &m->buffer[m->pending];
+		buffer_move_brightness(m, pending, buffer_brightness(m, pending), &budget);
+	}
+}
+
+/*
+ * Called by the output driver at the end of the last descriptor of a ring,
+ * so once per full refresh of the display.
+ * With the 8 bit bus, it is called at the end of every row and also switches the row lines.
+ */
+static void IRAM_ATTR dma_eof_isr(void *arg)
 {
-	// Buffers for the bitstreams, if not double buffered, the second is not used
-	stream_buffer_t buffer[2];
+	matrix_t *m = (matrix_t *)arg;
+	BaseType_t woken = pdFALSE;
 
-	// Number of dma descriptors, equal for both buffers
-	size_t dma_desc_count;
+	if (m->sample_size == 1)
+	{
+		size_t index;
+		if (!eof_descriptor(m, &index))
+		{
+			return;
+		}
 
-	uint16_t width;
-	uint16_t height;
+		// Every descriptor is a row, the subimages start at a multiple of rows
+		select_row(m, index % m->rows);
+		if (index != m->dma_desc_count - 1)
+		{
+			// Brightness changes are spread over the rows, after the row lines are switched
+			portENTER_CRITICAL_ISR(&m->swap_lock);
+			follow_brightness(m, BRIGHTNESS_WORK_BYTES8);
+			portEXIT_CRITICAL_ISR(&m->swap_lock);
+			return;
+		}
+	}
 
-	// Global brightness
-	// For every line, the driver output is only kept on as long as the current pixel < brightness
-	uint16_t brightness;
+	m->frame_count++;
 
-	// Color for monochrome images
-	uint8_t mono_color[3];
+	portENTER_CRITICAL_ISR(&m->swap_lock);
+#if !CONFIG_IDF_TARGET_ESP32S3
+	// A new clock starts with the next refresh cycle
+	if (m->clkm_next)
+	{
+		m->i2s_dev->clkm_conf.val = m->clkm_next;
+		m->clkm_next = 0;
+	}
+#endif
+#if LEDMATRIX_STATS
+	uint32_t now = xthal_get_ccount();
+	if (m->stats.eof_last)
+	{
+		m->stats.eof_cycles += now - m->stats.eof_last;
+		m->stats.eof_frames++;
+	}
+	m->stats.eof_last = now;
+#endif
+	bool swapped = update_frontbuffer(m);
+	if (!swapped && m->pending != NO_BUFFER)
+	{
+		m->stats.missed_swaps++;
+	}
+	if (m->fade_frames)
+	{
+		fade_step(m);
+	}
+	follow_brightness(m, (m->sample_size == 1) ? BRIGHTNESS_WORK_BYTES8 : BRIGHTNESS_WORK_BYTES);
+	// Within the lock, the player is never notified after play_stop took the task away
+	if (m->play_task)
+	{
+		vTaskNotifyGiveFromISR(m->play_task, &woken);
+	}
+	portEXIT_CRITICAL_ISR(&m->swap_lock);
 
-	// Effective number of rows, this is half of the height for displays that are split into two parts
-	uint8_t rows;
+	if (swapped && m->swap_sem)
+	{
+		xSemaphoreGiveFromISR(m->swap_sem, &woken);
+	}
 
-	// Number of bits per color
-	uint8_t color_depth;
+	if (m->vsync_sem)
+	{
+		xSemaphoreGiveFromISR(m->vsync_sem, &woken);
+	}
 
-	// index of the current backbuffer
-	uint8_t backbuffer;
+	if (m->vsync_callback != MP_OBJ_NULL)
+	{
+		// If the scheduler queue is full, this cycle is just skipped
+		mp_sched_schedule(m->vsync_callback, MP_OBJ_NEW_SMALL_INT(m->frame_count & 0x3fffffff));
+	}
 
-	// invert output signals
-	bool invert;
+	if (woken)
+	{
+		portYIELD_FROM_ISR();
+	}
+}
 
-	// swap every second column
-	// Some displays are wired that way
-	bool column_swap;
+static esp_err_t output_install(matrix_t *m, output_config_t *cfg)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	return lcd_parallel_driver_install(cfg, m->invert, dma_eof_isr, m);
+#else
+	m->i2s_dev = i2s_parallel_get_dev(m->port);
+	return i2s_parallel_driver_install(m->port, cfg, m->invert, dma_eof_isr, m);
+#endif
+}
 
-	// Use two buffers, this avoids tearing, but costs double the RAM
-	bool double_buffer;
+/*
+ * Changes the pixel clock from old_rate to rate while the output keeps running, the old clock is kept on an error.
+ * The I2S driver has no function for it. Its clock is the PLL divided by the clkm divider and the bit clock divider,
+ * so the clkm divider of old_rate is scaled to the new rate, without the jittery fractional part.
+ * The new divider is written by the EOF interrupt at the end of the current refresh cycle.
+ */
+static esp_err_t output_set_rate(matrix_t *m, uint32_t old_rate, uint32_t rate)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	(void)m;
+	(void)old_rate;
+	return lcd_parallel_set_rate(rate);
+#else
+	// old_rate belongs to a divider that is still waiting for the interrupt, if there is one
+	portENTER_CRITICAL(&m->swap_lock);
+	__typeof__(m->i2s_dev->clkm_conf) clkm = m->i2s_dev->clkm_conf;
+	if (m->clkm_next)
+	{
+		clkm.val = m->clkm_next;
+	}
+	portEXIT_CRITICAL(&m->swap_lock);
 
-	// Single channel display only uses a single color channel
-	// Number of rows is equal to the height for this type
-	bool single_chn;
+	uint32_t a = clkm.clkm_div_a ? clkm.clkm_div_a : 1;
+	uint64_t div = ((uint64_t)old_rate * (clkm.clkm_div_num * a + clkm.clkm_div_b) + (uint64_t)a * rate / 2) / ((uint64_t)a * rate);
+	if (div < I2S_CLKM_DIV_MIN || div > I2S_CLKM_DIV_MAX)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
 
-	// DMA is running / initialized
-	bool initialized;
-} matrix = {0};
+	clkm.clkm_div_num = div;
+	clkm.clkm_div_b = 0;
+	clkm.clkm_div_a = 1;
+	portENTER_CRITICAL(&m->swap_lock);
+	if (m->running)
+	{
+		m->clkm_next = clkm.val;
+	}
+	else
+	{
+		m->i2s_dev->clkm_conf.val = clkm.val;
+	}
+	portEXIT_CRITICAL(&m->swap_lock);
+	return ESP_OK;
+#endif
+}
 
-typedef uint8_t (*get_color_func)(uint16_t x, uint16_t y, uint8_t bit, uint8_t *data);
+static esp_err_t output_send(matrix_t *m, lldesc_t *desc)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	return lcd_parallel_send_dma(desc);
+#else
+	return i2s_parallel_send_dma(m->port, desc);
+#endif
+}
 
+static bool output_idle(matrix_t *m)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	return lcd_parallel_tx_idle();
+#else
+	return i2s_parallel_get_dev(m->port)->state.tx_idle;
+#endif
+}
 
-static void start_dma()
+static void start_dma(matrix_t *m)
 {
-	uint8_t buf = 0;
-	if (matrix.double_buffer)
+	// Without the interrupt, nothing kept the pattern of the frontbuffer up to date
+	stream_buffer_t *front = &m->buffer[m->frontbuffer];
+	if (!(m->buffer_count == 1 && m->backbuffer_acquired))
 	{
-		buf = matrix.backbuffer ^ 1;
+		buffer_set_brightness(m, front, buffer_brightness(m, front));
+		buffer_writeback(m, front);
 	}
-	esp_err_t err = i2s_parallel_send_dma(I2S_CHN, &matrix.buffer[buf].dma_desc[0]);
+
+	esp_err_t err = output_send(m, &m->buffer[m->frontbuffer].dma_desc[0]);
 	if (err != ESP_OK)
 	{
 		mp_raise_OSError(err);
 	}
+	m->running = true;
 }
 
-static void stop_dma()
+static void stop_dma(matrix_t *m)
 {
 	// Sends a 'safe' value as last status.
 	// We want to assert the OE line to blank the screen.
 	// Usually the displays are safe so they don't burn out when the signal stops, but better safe than sorry.
 	lldesc_t dma;
-	uint8_t buffer[2];
-	buffer[BITSTREAM_COLOR_BYTE] = 0;
-	buffer[BITSTREAM_CTRL_BYTE] = (1 << BITSTREAM_CTRL_OE_BIT);
+	uint8_t buffer[4];
+	if (m->sample_size == 1)
+	{
+		memset(buffer, 1 << BITSTREAM8_OE_BIT, sizeof(buffer));
+	}
+	else
+	{
+		buffer[BITSTREAM_COLOR_BYTE] = 0;
+		buffer[BITSTREAM_CTRL_BYTE] = (1 << BITSTREAM_CTRL_OE_BIT);
+		buffer[2 + BITSTREAM_COLOR_BYTE] = 0;
+		buffer[2 + BITSTREAM_CTRL_BYTE] = (1 << BITSTREAM_CTRL_OE_BIT);
+	}
 
-	if (matrix.invert)
+	if (m->invert)
 	{
-		buffer[0] = ~buffer[0];
-		buffer[1] = ~buffer[1];
+		for (size_t i = 0; i < sizeof(buffer); i++)
+		{
+			buffer[i] = ~buffer[i];
+		}
 	}
 
 	dma.buf = buffer;
 	dma.empty = 0;
 	dma.eof = 1;
-	dma.length = 2;
-	dma.size = 2;
+	dma.length = sizeof(buffer);
+	dma.size = sizeof(buffer);
 	dma.offset = 0;
 	dma.owner = 1;
 	dma.sosf = 0;
+	dma.qe.stqe_next = NULL;
 
-	i2s_parallel_send_dma(I2S_CHN, &dma);
+	output_send(m, &dma);
 
 	// wait transaction finished
-	while(!i2s_parallel_get_dev(I2S_CHN)->state.tx_idle);
-}
+	while(!output_idle(m));
 
-static void deinit()
-{
-	if (matrix.initialized)
+	// Nothing is displayed anymore, so a pending swap or clock change can be done right away
+	portENTER_CRITICAL(&m->swap_lock);
+	m->running = false;
+	if (m->pending != NO_BUFFER)
+	{
+		m->frontbuffer = m->pending;
+		m->pending = NO_BUFFER;
+	}
+#if !CONFIG_IDF_TARGET_ESP32S3
+	if (m->clkm_next)
 	{
-		stop_dma();
+		m->i2s_dev->clkm_conf.val = m->clkm_next;
+		m->clkm_next = 0;
 	}
-	if (matrix.buffer[0].stream_data) free(matrix.buffer[0].stream_data);
-	if (matrix.buffer[0].dma_desc) free(matrix.buffer[0].dma_desc);
-	if (matrix.buffer[1].stream_data) free(matrix.buffer[1].stream_data);
-	if (matrix.buffer[1].dma_desc) free(matrix.buffer[1].dma_desc);
-	memset(&matrix, 0, sizeof(matrix));
+#endif
+	portEXIT_CRITICAL(&m->swap_lock);
 }
 
-static void initialize_buffer(stream_buffer_t *buf)
+/*
+ * Selects a buffer that is neither displayed nor waiting to be displayed as backbuffer.
+ * With two buffers, this has to wait until the last frame made it to the display.
+ * Without multiple buffers, the backbuffer is the one on the display and acquiring it only stops the interrupt
+ * from touching it until it is presented.
+ * release_gil must only be set when called from a micropython thread.
+ */
+static void acquire_backbuffer(matrix_t *m, bool release_gil)
 {
-	// Two bytes per pixel
-	size_t subimage_stride = sizeof(uint16_t) * matrix.width * matrix.rows;
-	size_t buffersize = subimage_stride * matrix.color_depth;
-	size_t dma_entries_per_subimage = ((subimage_stride - 1) / DMA_MAX_XFER_SIZE) + 1;
-	matrix.dma_desc_count = ((1 << matrix.color_depth) - 1) * dma_entries_per_subimage;
-
-	buf->stream_data = heap_caps_malloc(buffersize, MALLOC_CAP_DMA);
-	buf->dma_desc = heap_caps_malloc(matrix.dma_desc_count * sizeof(buf->dma_desc[0]), MALLOC_CAP_DMA);
-
-	if (!buf->stream_data || !buf->dma_desc)
+	if (m->backbuffer_acquired)
 	{
-		mp_raise_OSError(ESP_ERR_NO_MEM);
+		return;
 	}
 
-#ifdef DEBUG
-	printf("stream %u bytes @%08X\n", buffersize, (uint32_t)buf->stream_data);
-	printf("dma desc %u bytes @%08X\n", matrix.dma_desc_count * sizeof(buf->dma_desc[0]), (uint32_t)buf->dma_desc);
-#endif
-
-	memset(buf->stream_data, matrix.invert ? 0xff : 0, buffersize);
-	memset(buf->dma_desc, 0, matrix.dma_desc_count * sizeof(buf->dma_desc[0]));
-
-
-	/*
-	 * Spread the subimages evenly across the buffer to avoid flickering at lower framerates
-	 * so instead of
-	 * 1 2 2 3 3 3 3 4 4 4 4 4 4 4 4
-	 * we want something like
-	 * 4 2 4 3 4 3 1 4 2 4 3 4 3 4 4
-
-	 * We first fill all but the last level.
-	 * All remaining elements will later on be filled with the longest subimage
-	 * The whole process gets a bit more complicated, since the max dma transfer size per block is limited.
-	 * So to begin with, we just fill the first blocks. The sizes and other blocks are filled later.
-	 */
-	for (size_t i = 0; i < matrix.color_depth - 1; i++)
+	if (m->buffer_count == 1)
 	{
-		size_t n = 1 << i;
-		for (size_t k = 0; k < n; k++)
-		{
-			size_t pos = (matrix.dma_desc_count * k) / n + (matrix.dma_desc_count / n / 2);
-
-			// in case we need more than one dma desc per image, we fill only the first element
-			pos /= dma_entries_per_subimage;
-			pos *= dma_entries_per_subimage;
+		// The single buffer stays on the display, this only keeps the interrupt away from it, see follow_brightness
+		portENTER_CRITICAL(&m->swap_lock);
+		m->backbuffer_acquired = true;
+		portEXIT_CRITICAL(&m->swap_lock);
+		return;
+	}
 
-#ifdef DEBUG_DMA
-			printf("level=%u n=%u k=%u pos=%u\n", i, n, k, pos);
-#endif
+	for (;;)
+	{
+		uint8_t back = NO_BUFFER;
 
-			// Find next free entry, wrap around if required
-			while (buf->dma_desc[pos].buf)
+		portENTER_CRITICAL(&m->swap_lock);
+		update_frontbuffer(m);
+		for (uint8_t i = 0; i < m->buffer_count; i++)
+		{
+			if (i != m->frontbuffer && i != m->pending)
 			{
-				pos += dma_entries_per_subimage;
-				if (pos >= matrix.dma_desc_count)
-				{
-					pos = 0;
-				}
+				back = i;
+				break;
 			}
-
-			buf->dma_desc[pos].buf = buf->stream_data + subimage_stride * i;
-#ifdef DEBUG_DMA
-			printf("  -> %u=%08X\n", pos, (uint32_t)buf->dma_desc[pos].buf);
-#endif
 		}
-	}
+		portEXIT_CRITICAL(&m->swap_lock);
 
-	// Fill remaining elements and create links + fill common data
-	for (size_t i = 0; i < matrix.dma_desc_count; i++)
-	{
-		if (!buf->dma_desc[i].buf)
+		if (back != NO_BUFFER)
 		{
-			buf->dma_desc[i].buf = buf->stream_data + subimage_stride * (matrix.color_depth - 1);
+			m->backbuffer = back;
+			m->backbuffer_acquired = true;
+			return;
 		}
 
-		size_t remaining = subimage_stride;
-		volatile uint8_t *ptr = buf->dma_desc[i].buf;
-		--i;
-		while (remaining)
+		if (release_gil)
 		{
-			++i;
+			MP_THREAD_GIL_EXIT();
+		}
+		bool swapped = xSemaphoreTake(m->swap_sem, m->swap_timeout) == pdTRUE;
+		if (release_gil)
+		{
+			MP_THREAD_GIL_ENTER();
+		}
 
-			size_t block = remaining;
-			if (block > DMA_MAX_XFER_SIZE)
+		if (!swapped && !m->running)
+		{
+			// Nothing is output that could swap, so the pending frame is as good as shown.
+			// While running, the loop checks where the DMA actually is instead, see update_frontbuffer.
+			portENTER_CRITICAL(&m->swap_lock);
+			if (m->pending != NO_BUFFER)
 			{
-				block = DMA_MAX_XFER_SIZE;
+				m->frontbuffer = m->pending;
+				m->pending = NO_BUFFER;
 			}
-
-#ifdef DEBUG_DMA
-			printf("dma %u=%08X length=%u\n", i, (uint32_t)ptr, block);
-#endif
-			buf->dma_desc[i].buf = ptr;
-			buf->dma_desc[i].length = block;
-			buf->dma_desc[i].size = block;
-			buf->dma_desc[i].owner = 1;
-			ptr += block;
-			remaining -= block;
+			portEXIT_CRITICAL(&m->swap_lock);
 		}
 	}
+}
+
+/*
+ * Buffer that was presented last, it is either on the display or will be after the current refresh cycle.
+ */
+static stream_buffer_t *shown_buffer(matrix_t *m)
+{
+	portENTER_CRITICAL(&m->swap_lock);
+	uint8_t i = (m->pending != NO_BUFFER) ? m->pending : m->frontbuffer;
+	portEXIT_CRITICAL(&m->swap_lock);
+	return &m->buffer[i];
+}
 
-	for (size_t i = 0; i < matrix.dma_desc_count - 1; i++)
+/*
+ * Highest brightness that keeps the estimated current of the frame in a buffer within limit_ma,
+ * POWER_CAP_NONE without a limit.
+ */
+static uint16_t power_cap(matrix_t *m, const stream_buffer_t *buf, uint32_t limit_ma)
+{
+	if (!limit_ma)
 	{
-		// link to next
-		buf->dma_desc[i].qe.stqe_next = &buf->dma_desc[i + 1];
+		return POWER_CAP_NONE;
 	}
+	uint32_t lum[3];
+	buffer_luminance(m, buf, lum);
+	return power_limited_brightness(m, lum, POWER_CAP_NONE, limit_ma);
+}
 
-	//close the loop
-	buf->dma_desc[matrix.dma_desc_count - 1].qe.stqe_next = &buf->dma_desc[0];
+/*
+ * Lowers the brightness of the frame in the backbuffer as far as needed for the power limit.
+ * The cap belongs to the frame, so the frame on the display keeps its own until the swap.
+ * Only the rows the frame changed are counted again.
+ */
+static void limit_power(matrix_t *m, stream_buffer_t *buf)
+{
+	if (m->power_limit_ma)
+	{
+		buffer_update_luminance(m, buf);
+	}
+	buf->power_cap = power_cap(m, buf, m->power_limit_ma);
+	if (buf->power_cap < m->user_brightness)
+	{
+		m->stats.power_limited++;
+	}
 }
 
+/*
+ * Finishes the conversion into the backbuffer: its output enable pattern is brought up to the brightness,
+ * outside of the lock, since nobody else touches it, and everything is made visible to the DMA.
+ * A single buffer is handed back to the interrupt.
+ */
+static void release_backbuffer(matrix_t *m)
+{
+	stream_buffer_t *buf = &m->buffer[m->backbuffer];
+	buffer_set_brightness(m, buf, buffer_brightness(m, buf));
+	buffer_writeback(m, buf);
+
+	if (m->buffer_count == 1)
+	{
+		portENTER_CRITICAL(&m->swap_lock);
+		m->backbuffer_acquired = false;
+		portEXIT_CRITICAL(&m->swap_lock);
+	}
+}
 
 /*
- * Creates the control sequence for selecting the display lines and the latching.
- * This also handles the global brightness setting
+ * Queues the backbuffer for display.
+ * The swap itself happens at the end of the current refresh cycle, so the frame on the display is never modified.
+ * With a power limit, the brightness is adjusted for the new frame, see limit_power.
  */
-void create_control_pattern(stream_buffer_t *buf)
+static void present_backbuffer(matrix_t *m)
 {
-	size_t row_stride = sizeof(uint16_t) * matrix.width;
-	size_t subimage_stride = row_stride * matrix.rows;
-	for (uint8_t lvl = 0; lvl < matrix.color_depth; lvl++)
+	limit_power(m, &m->buffer[m->backbuffer]);
+	release_backbuffer(m);
+	if (m->buffer_count == 1)
 	{
-		uint8_t *si = buf->stream_data + subimage_stride * lvl;
-		for (uint8_t row = 0; row < matrix.rows; row++)
-		{
-			uint8_t *r = si + row_stride * row;
+		return;
+	}
 
-			// The row lines control the currently shown row.
-			// this is always the last row as the current row is being filled with new data
-			uint8_t display_row = row - 1; // the possible underflow IS expected and desired!
+	m->backbuffer_acquired = false;
+	lldesc_t *first = &m->buffer[m->backbuffer].dma_desc[0];
 
-			for (uint16_t pixel = 0; pixel < matrix.width; pixel++)
-			{
-				uint8_t *px = r + sizeof(uint16_t) * pixel;
+	portENTER_CRITICAL(&m->swap_lock);
 
-				uint8_t ctrl = display_row << BITSTREAM_CTRL_ROW_START_BIT;
+	// Make sure a pending buffer is not considered free while the DMA is already in it
+	update_frontbuffer(m);
 
-				if (pixel < 2 || pixel > matrix.brightness)
-				{
-					// Disable the led drivers while switching rows. We also use this to control
-					// the global brightness by blanking the screen after transmitting n pixels.
-					// NOTE: The OE line is active low, BLANK would be a more suiting name...
-					ctrl |= 1 << BITSTREAM_CTRL_OE_BIT;
-				}
+	// Redirect all rings, this includes the one the DMA is in right now.
+	// The new frame also loops into itself.
+	// With triple buffering, a frame that is still pending gets dropped.
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		m->buffer[i].dma_desc[m->dma_desc_count - 1].qe.stqe_next = first;
+	}
+
+	if (m->running)
+	{
+		m->pending = m->backbuffer;
+	}
+	else
+	{
+		m->frontbuffer = m->backbuffer;
+		m->pending = NO_BUFFER;
+	}
+
+	portEXIT_CRITICAL(&m->swap_lock);
+}
+
+/*
+ * Copies everything the acquired backbuffer missed from the buffer that was presented last,
+ * so it holds the last frame again.
+ */
+static void sync_backbuffer(matrix_t *m)
+{
+	if (m->buffer_count == 1)
+	{
+		return;
+	}
+
+	portENTER_CRITICAL(&m->swap_lock);
+	uint8_t latest = (m->pending != NO_BUFFER) ? m->pending : m->frontbuffer;
+	portEXIT_CRITICAL(&m->swap_lock);
 
-				if (pixel == matrix.width - 2)
+	stream_buffer_t *dst = &m->buffer[m->backbuffer];
+	const stream_buffer_t *src = &m->buffer[latest];
+	dirty_t *stale = &m->stale[m->backbuffer];
+
+	if (stale->x0 < stale->x1)
+	{
+		dst->lum_stale |= stale->rows;
+
+		// Only the color bits are copied, the output enable pattern of the buffers may differ and the interrupt may be
+		// changing the one of src right now. Words of whole pairs are copied, the columns added at the edges hold the
+		// same colors in both buffers anyway.
+		bool narrow = m->sample_size == 1;
+		uint32_t color = narrow ? BITSTREAM8_COLOR_MASK * 0x01010101u : 0x00ff00ff;
+		size_t row_words = m->sample_size * m->width / sizeof(uint32_t);
+		size_t pixels = narrow ? 4 : 2;
+		size_t w0 = stale->x0 / pixels;
+		size_t w1 = (stale->x1 + pixels - 1) / pixels;
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			for (uint8_t row = 0; row < m->rows; row++)
+			{
+				if (stale->rows & (1ULL << row))
 				{
-					// Latch when transmitting the last pixel
-					// NOTE: This is somewhat problematic, since we are latching while the clock is
-					//       still running and we are still loading fresh data into the shift registers.
-					//       Asserting the latch with the second last pixel (and thus having the falling edge on the last) seems to work reliable though.
-					ctrl |= 1 << BITSTREAM_CTRL_LAT_BIT;
+					uint32_t *d = (uint32_t *)dst->planes[lvl] + row_words * row;
+					const uint32_t *s = (const uint32_t *)src->planes[lvl] + row_words * row;
+					for (size_t i = w0; i < w1; i++)
+					{
+						d[i] = (d[i] & ~color) | (s[i] & color);
+					}
 				}
-
-				if (matrix.invert)    ctrl = ~ctrl;
-				px[BITSTREAM_CTRL_BYTE] = ctrl;
 			}
 		}
 	}
+	dirty_clear(stale);
 }
 
-#ifdef DEBUG_TEST_ON_INIT
-static uint8_t get_color_bits_test(uint16_t x, uint16_t y, uint8_t bit, uint8_t *data)
+/*
+ * Moves the temporal dither pattern on for a new frame, before the frame is converted.
+ * Every pixel cycles through all cells of the pattern over four frames.
+ */
+static void next_dither_phase(matrix_t *m)
 {
-	(void)data;
-	(void)bit;
-	if ((x + y) % 4 == 3) return 0;
-	return 9 << ((x + y) % 4);
+	if (m->dither == DITHER_TEMPORAL)
+	{
+		m->dither_phase = (m->dither_phase + 1) & (DITHER_CELLS - 1);
+	}
 }
-#endif
 
-static uint8_t get_rgb565_bits(uint16_t color, uint8_t bit)
+/*
+ * Decodes an encoded frame into the backbuffer.
+ * A delta frame modifies the last frame like the drawing functions do, a full frame overwrites every pixel,
+ * so whatever the backbuffer missed doesn't matter.
+ */
+static void convert_encoded(matrix_t *m, const show_job_t *job, bool release_gil)
 {
-	// expand to 3x8 bits
-	uint8_t r = (color >> 8) & 0xf8;
-	uint8_t g = (color >> 3) & 0xfc;
-	uint8_t b = (color << 3);
+	m->line_hash_valid = false;
+
+	acquire_backbuffer(m, release_gil);
+	if (job->encoding == ENC_DELTA)
+	{
+		sync_backbuffer(m);
+	}
+	else
+	{
+		dirty_clear(&m->stale[m->backbuffer]);
+	}
 
-	return (
-		((r >> (7 - bit)) & 1) |
-		(((g >> (7 - bit)) & 1) << 1) |
-		(((b >> (7 - bit)) & 1) << 2)
-		);
+	rect_t changed;
+	decode_frame(m, &m->buffer[m->backbuffer], job->data, job->length, job->format, &changed);
+	draw_mark(m, &changed);
+	m->stats.frames_shown++;
 }
 
-static uint8_t get_mono_color_bits(uint8_t bit)
+/*
+ * Copies a pre-encoded frame into the backbuffer, every color byte is overwritten.
+ */
+static void convert_planes(matrix_t *m, const show_job_t *job, bool release_gil)
 {
-	return (
-		(( matrix.mono_color[0] >> (7 - bit)) & 1) |
-		(((matrix.mono_color[1] >> (7 - bit)) & 1) << 1) |
-		(((matrix.mono_color[2] >> (7 - bit)) & 1) << 2)
-		);
+	m->line_hash_valid = false;
+
+	acquire_backbuffer(m, release_gil);
+	dirty_clear(&m->stale[m->backbuffer]);
+	copy_planes(m, &m->buffer[m->backbuffer], job->data);
+
+	rect_t all = { 0, 0, m->image_width, m->image_height };
+	draw_mark(m, &all);
+	m->stats.frames_shown++;
 }
 
-static uint8_t get_color_bits_mono_hlsb(uint16_t x, uint16_t y, uint8_t bit, uint8_t *data)
+/*
+ * Updates the changed part of the backbuffer from a full frame.
+ * Every buffer keeps track of what changed since it was written last, so with multiple buffers
+ * the backbuffer gets all changes the other buffers received in the meantime.
+ */
+static void convert_frame(matrix_t *m, const show_job_t *job, bool release_gil)
 {
-	if (data[(x >> 3) + ((y * matrix.width) >> 3)] & (0x80 >> (1 - (x & 7))))
+	if (job->encoding != ENC_NONE)
+	{
+		convert_encoded(m, job, release_gil);
+		return;
+	}
+	if (job->format == COLOR_PLANES)
+	{
+		convert_planes(m, job, release_gil);
+		return;
+	}
+
+	dirty_t changes;
+	dirty_clear(&changes);
+
+	if (job->diff)
+	{
+		diff_lines(m, job, &changes);
+	}
+	else
+	{
+		dirty_add_rect(m, &changes, &job->region);
+
+		// The hashes don't match the display anymore
+		m->line_hash_valid = false;
+	}
+
+	for (uint8_t i = 0; i < m->buffer_count; i++)
 	{
-		return get_mono_color_bits(bit);
+		dirty_add(&m->stale[i], &changes);
 	}
-	return 0;
+
+	next_dither_phase(m);
+
+	acquire_backbuffer(m, release_gil);
+	update_framebuffer_scaled_by(m, &m->buffer[m->backbuffer], job->data, job->stride, job->format, job->scale_shift, &m->stale[m->backbuffer]);
+	m->stats.frames_shown++;
+	dirty_clear(&m->stale[m->backbuffer]);
 }
 
-static uint8_t get_color_bits_rgb(uint16_t x, uint16_t y, uint8_t bit, uint8_t *data)
+static void show_frame(matrix_t *m, const show_job_t *job, bool release_gil)
 {
-	uint16_t val = ((uint16_t *)data)[y * matrix.width + x];
-	return get_rgb565_bits(val, bit);
+	convert_frame(m, job, release_gil);
+	present_backbuffer(m);
 }
 
-static uint8_t get_color_bits_gs8(uint16_t x, uint16_t y, uint8_t bit, uint8_t *data)
+/*
+ * Prepares the backbuffer for the drawing functions.
+ * Drawing modifies the last frame, so a fresh backbuffer first gets everything it missed copied
+ * from the buffer that was presented last. Without multiple buffers, drawing goes straight to the display.
+ */
+static stream_buffer_t *draw_begin(matrix_t *m)
 {
-	uint16_t v = data[(y * matrix.width + x)];
+	// The line hashes can't know about drawing
+	m->line_hash_valid = false;
 
-	uint8_t r = (uint8_t)((v * matrix.mono_color[0]) / 255);
-	uint8_t g = (uint8_t)((v * matrix.mono_color[1]) / 255);
-	uint8_t b = (uint8_t)((v * matrix.mono_color[2]) / 255);
+	if (m->backbuffer_acquired)
+	{
+		return &m->buffer[m->backbuffer];
+	}
 
-	return (
-		((r >> (7 - bit)) & 1) |
-		(((g >> (7 - bit)) & 1) << 1) |
-		(((b >> (7 - bit)) & 1) << 2)
-		);
+	acquire_backbuffer(m, true);
+	sync_backbuffer(m);
+	return &m->buffer[m->backbuffer];
 }
 
-static void update_framebuffer(stream_buffer_t *buf, uint8_t *data, get_color_func get_color_bits)
+/*
+ * Finishes a drawing function, the other buffers get the drawn area as stale.
+ * Without multiple buffers, the changes are visible right away, so they also have to leave the cache now,
+ * and the buffer goes back to the interrupt.
+ */
+static void draw_end(matrix_t *m, stream_buffer_t *buf, const rect_t *rect)
 {
-	size_t row_stride = sizeof(uint16_t) * matrix.width;
-	size_t subimage_stride = row_stride * matrix.rows;
-	for (uint8_t lvl = 0; lvl < matrix.color_depth; lvl++)
+	draw_mark(m, rect);
+	if (m->buffer_count == 1)
 	{
-		uint8_t *si = buf->stream_data + subimage_stride * lvl;
-		for (uint8_t row = 0; row < matrix.rows; row++)
-		{
-			uint8_t *r = si + row_stride * row;
-			for (uint16_t pixel = 0; pixel < matrix.width; pixel++)
-			{
-				uint8_t *px = r + sizeof(uint16_t) * pixel;
-
-				uint16_t source_px = pixel;
-				if (matrix.column_swap) source_px ^= 0x01;
-				uint8_t bit = matrix.color_depth - lvl - 1;
-				uint8_t c = get_color_bits(source_px, row, bit, data);
-				if (!matrix.single_chn)
-				{
-					c |= get_color_bits(source_px, row + matrix.rows, bit, data) << 3;
-				}
-				if (matrix.invert) c = ~c;
-				px[BITSTREAM_COLOR_BYTE] = c;
-			}
-		}
+		release_backbuffer(m);
 	}
 }
 
+static void async_worker(void *arg)
+{
+	matrix_t *m = (matrix_t *)arg;
+	for (;;)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-/*
- * Initialize the led matrix driver
- * Parameters are:
- * io_colors
- *    GPIO lines for the color inputs of the matrix
- *    The order is R1 G1 B1 [R2 G2 B2]
- *    The *2 values are only required in the double channel (default) mode.
- * io_rows
- *    GPIO lines for the row inputs of the matrix
- *    The order is from LSB to MSB. On most displays these are named A B C D ...
- *    The display height is implicitly defined by the number of rows
- * io_oe
- *    GPIO line for the BLANK / OE (Output enable) input.
- * io_lat
- *    GPIO line for the LAT (latch) input
- * io_clk
- *    GPIO line for the CLK (clock) input
- * width
- *    Width of the display.
- *    If multiple segments are chained, the width is just extended as if it would be one longer display.
- * color_depth, default=4
- *    Number of bits per color channel.
- *    A higher color depth requires a higher clock to be flicker-free.
- * clock_speed_khz, default=2500
- *    Clock speed of the output. Must be between 313 and 40000.
- * invert, default=False
- *     Invert the output signal for use with inverting level shifters.
- * double_buffer, default=False
- *     Use double buffering for tearing free updates.
- *     This doubles the memory requirement.
- * column_swap, default=True
- *     Swap the output for every second column, since on many displays these are swapped internally.
- * single_channel, default=False
- *     Single channel display with only three color lines.
- *     Most displays are split vertically into an upper and lower half with two separate sets of color lines.
- * brightness, default=width-2
- *     Global brightness control.
- *     Must be between 0 (off) and width - 2 (max)
+		show_frame(m, &m->async_job, false);
+
+		m->async_busy = false;
+		xSemaphoreGive(m->async_done);
+	}
+}
+
+static void async_start_worker(matrix_t *m)
+{
+	if (m->async_task)
+	{
+		return;
+	}
+
+	m->async_done = xSemaphoreCreateBinary();
+	if (!m->async_done)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+
+#if CONFIG_FREERTOS_UNICORE
+	BaseType_t core = 0;
+#else
+	// Keep the conversion away from the core that is running micropython
+	BaseType_t core = xPortGetCoreID() ^ 1;
+#endif
+
+	if (xTaskCreatePinnedToCore(async_worker, "ledmatrix", ASYNC_TASK_STACK_SIZE, m, ASYNC_TASK_PRIORITY, &m->async_task, core) != pdPASS)
+	{
+		m->async_task = NULL;
+		vSemaphoreDelete(m->async_done);
+		m->async_done = NULL;
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+}
+
+/*
+ * Waits until the worker has finished the current job.
+ * Returns false on timeout.
  */
-STATIC mp_obj_t ledmatrix_init(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+static bool async_wait(matrix_t *m, TickType_t timeout)
+{
+	if (!m->async_busy)
+	{
+		return true;
+	}
+
+	MP_THREAD_GIL_EXIT();
+	bool done = xSemaphoreTake(m->async_done, timeout) == pdTRUE;
+	MP_THREAD_GIL_ENTER();
+	return done;
+}
+
+static void async_stop(matrix_t *m)
 {
-	deinit();
+	if (!m->async_task)
+	{
+		return;
+	}
 
-	// The height is implicitly defined by the number of rows
-	static const mp_arg_t allowed_args[] = {
+	async_wait(m, portMAX_DELAY);
+	vTaskDelete(m->async_task);
+	vSemaphoreDelete(m->async_done);
+	m->async_task = NULL;
+	m->async_done = NULL;
+}
+
+/*
+ * Takes over the channel correction and the palette staged by set_gamma, set_lut and set_palette.
+ * Called by the background tasks before every frame and after they stopped, nothing else converts in that time.
+ */
+static void take_staged_tables(matrix_t *m)
+{
+	portENTER_CRITICAL(&m->swap_lock);
+	uint8_t (*lut)[256] = m->channel_lut_next;
+	uint32_t *palette = m->palette_next;
+	if (lut)
+	{
+		lut = m->channel_lut;
+		m->channel_lut = m->channel_lut_next;
+		m->channel_lut_next = NULL;
+	}
+	if (palette)
+	{
+		palette = m->palette;
+		m->palette = m->palette_next;
+		m->palette_next = NULL;
+	}
+	portEXIT_CRITICAL(&m->swap_lock);
+
+	// The old tables are no longer used by anyone
+	if (lut)
+	{
+		free(lut);
+		channel_lut_changed(m);
+	}
+	if (palette)
+	{
+		free(palette);
+		if (m->index_lut_color == INDEX_LUT_PALETTE)
+		{
+			m->index_lut_color = INDEX_LUT_INVALID;
+		}
+		m->line_hash_valid = false;
+	}
+}
+
+// Target of the spans of a packet, see net_span
+typedef struct
+{
+	matrix_t *m;
+	stream_buffer_t *buf;
+	rect_t changed;
+} net_target_t;
+
+static void net_span(void *ctx, uint16_t y, uint16_t x0, uint16_t x1, const uint8_t *pixels)
+{
+	net_target_t *t = (net_target_t *)ctx;
+	draw_span(t->m, t->buf, pixels, x0, x1, y, COLOR_RGB888);
+
+	if (x0 < t->changed.x0) t->changed.x0 = x0;
+	if (x1 > t->changed.x1) t->changed.x1 = x1;
+	if (y < t->changed.y0) t->changed.y0 = y;
+	if (y + 1 > t->changed.y1) t->changed.y1 = y + 1;
+}
+
+/*
+ * Converts the pixel data of a packet straight into the backbuffer, there is no copy of the frame.
+ * Like a delta frame, a fresh backbuffer first gets everything it missed from the buffer that was presented last.
+ */
+static void net_convert(matrix_t *m, struct pbuf *p, const net_packet_t *pkt)
+{
+	// The table is rebuilt here after a gamma change
+	take_staged_tables(m);
+	if (prepare_format(m, COLOR_RGB888) != ESP_OK)
+	{
+		// No memory for the table, the pixels are lost like those of a bad packet
+		m->net.dropped++;
+		return;
+	}
+
+	acquire_backbuffer(m, false);
+	sync_backbuffer(m);
+	m->line_hash_valid = false;
+
+	net_target_t t = { m, &m->buffer[m->backbuffer], { m->image_width, m->image_height, 0, 0 } };
+	size_t end = pkt->start + pkt->length;
+	size_t pos = 0;
+	for (struct pbuf *q = p; q && pos < end; pos += q->len, q = q->next)
+	{
+		size_t from = (pkt->start > pos) ? pkt->start : pos;
+		size_t to = (end < pos + q->len) ? end : pos + q->len;
+		if (from < to)
+		{
+			net_store(&m->net, pkt->offset + (from - pkt->start), (const uint8_t *)q->payload + (from - pos), to - from, net_span, &t);
+		}
+	}
+
+	if (t.changed.x0 < t.changed.x1)
+	{
+		draw_mark(m, &t.changed);
+	}
+}
+
+/*
+ * Receives packets until net_stop is set.
+ * Every packet is converted right away, so only the last one of a frame is left when the push arrives.
+ */
+static void net_worker(void *arg)
+{
+	matrix_t *m = (matrix_t *)arg;
+	struct netconn *conn = m->net_conn;
+	// Like show, the dither phase moves on before the first packet of a frame is converted
+	bool frame_started = false;
+
+	while (!m->net_stop)
+	{
+		struct netbuf *nb;
+		if (netconn_recv(conn, &nb) != ERR_OK)
+		{
+			continue;
+		}
+
+		// The headers are always in the first pbuf, the pixel data may continue in the next ones
+		struct pbuf *p = nb->p;
+		net_packet_t pkt;
+		if (net_parse(&m->net, p->payload, p->len, p->tot_len, &pkt))
+		{
+			if (!frame_started)
+			{
+				next_dither_phase(m);
+				frame_started = true;
+			}
+			net_convert(m, p, &pkt);
+			if (pkt.push)
+			{
+				m->net.frames++;
+				m->stats.frames_shown++;
+				present_backbuffer(m);
+				frame_started = false;
+			}
+		}
+		netbuf_delete(nb);
+	}
+
+	if (m->buffer_count == 1 && m->backbuffer_acquired)
+	{
+		release_backbuffer(m);
+	}
+
+	netconn_delete(conn);
+	xSemaphoreGive(m->net_done);
+	vTaskDelete(NULL);
+}
+
+static void net_stop(matrix_t *m)
+{
+	if (!m->net_task)
+	{
+		return;
+	}
+
+	m->net_stop = true;
+	MP_THREAD_GIL_EXIT();
+	xSemaphoreTake(m->net_done, portMAX_DELAY);
+	MP_THREAD_GIL_ENTER();
+
+	vSemaphoreDelete(m->net_done);
+	take_staged_tables(m);
+	m->net_task = NULL;
+	m->net_done = NULL;
+	m->net_conn = NULL;
+	m->net_stop = false;
+}
+
+/*
+ * Shows the frames of play until play_stop is set or the last frame is shown without loop.
+ * Every frame is converted as soon as there is a free buffer and presented with the first refresh cycle
+ * after its time, so the timing doesn't depend on how long the conversion takes.
+ */
+static void play_worker(void *arg)
+{
+	matrix_t *m = (matrix_t *)arg;
+	show_job_t job = m->play_job;
+	int64_t due = esp_timer_get_time();
+	size_t index = 0;
+
+	while (!m->play_stop)
+	{
+		const play_frame_t *frame = &m->play_frames[index];
+		job.data = frame->data;
+		job.length = frame->length;
+
+		// The tables are rebuilt here after a gamma change
+		take_staged_tables(m);
+		if (prepare_format(m, job.format) == ESP_OK)
+		{
+			convert_frame(m, &job, false);
+		}
+
+		if (esp_timer_get_time() > due)
+		{
+			// Too late, start over from now instead of rushing the next frames
+			m->play_late++;
+			due = esp_timer_get_time();
+		}
+		while (!m->play_stop && esp_timer_get_time() < due)
+		{
+			ulTaskNotifyTake(pdTRUE, m->swap_timeout);
+		}
+		if (m->play_stop)
+		{
+			break;
+		}
+
+		present_backbuffer(m);
+		m->play_shown++;
+		due += m->play_period_us;
+
+		if (++index == m->play_count)
+		{
+			if (!m->play_loop)
+			{
+				break;
+			}
+			index = 0;
+		}
+	}
+
+	// A frame converted into a single buffer is on the display already, the interrupt gets the buffer back
+	if (m->buffer_count == 1 && m->backbuffer_acquired)
+	{
+		release_backbuffer(m);
+	}
+
+	m->play_running = false;
+	xSemaphoreGive(m->play_done);
+	// Deleted by play_stop
+	vTaskSuspend(NULL);
+}
+
+static void play_stop(matrix_t *m)
+{
+	if (!m->play_task)
+	{
+		return;
+	}
+
+	m->play_stop = true;
+	MP_THREAD_GIL_EXIT();
+	xSemaphoreTake(m->play_done, portMAX_DELAY);
+	MP_THREAD_GIL_ENTER();
+
+	portENTER_CRITICAL(&m->swap_lock);
+	TaskHandle_t task = m->play_task;
+	m->play_task = NULL;
+	portEXIT_CRITICAL(&m->swap_lock);
+
+	vTaskDelete(task);
+	vSemaphoreDelete(m->play_done);
+	free(m->play_frames);
+	take_staged_tables(m);
+	m->play_done = NULL;
+	m->play_frames = NULL;
+	m->play_count = 0;
+	m->play_stop = false;
+}
+
+static bool background_running(matrix_t *m)
+{
+	return m->net_task || m->play_task;
+}
+
+/*
+ * show and the drawing functions would fight with the receiver or the player over the backbuffer.
+ */
+static void background_check(matrix_t *m)
+{
+	if (m->net_task)
+		mp_raise_ValueError(MP_ERROR_TEXT("not possible while listening"));
+	if (m->play_task)
+		mp_raise_ValueError(MP_ERROR_TEXT("not possible while playing"));
+}
+
+static void deinit(matrix_t *m)
+{
+	play_stop(m);
+	net_stop(m);
+	async_stop(m);
+	if (m->initialized)
+	{
+		stop_dma(m);
+	}
+	matrix_free(m);
+
+	for (uint8_t pin = 0; pin < 64; pin++)
+	{
+		if (m->row_io_all & (1ULL << pin))
+		{
+			gpio_reset_pin(pin);
+		}
+	}
+
+	// The interrupt may still be installed, so remove the references first
+	SemaphoreHandle_t vsync_sem = m->vsync_sem;
+	SemaphoreHandle_t swap_sem = m->swap_sem;
+	m->vsync_sem = NULL;
+	m->swap_sem = NULL;
+	if (vsync_sem) vSemaphoreDelete(vsync_sem);
+	if (swap_sem) vSemaphoreDelete(swap_sem);
+
+	uint8_t port = m->port;
+	memset(m, 0, sizeof(*m));
+	m->port = port;
+	m->swap_lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+}
+
+
+
+// Parameters of ledmatrix.init and ledmatrix.Matrix, see ledmatrix_init
+// The height is implicitly defined by the number of rows
+static const mp_arg_t init_args[] = {
 	/*  0 */ { MP_QSTR_io_colors,       MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = mp_const_none}},
 	/*  1 */ { MP_QSTR_io_rows,         MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = mp_const_none}},
 	/*  2 */ { MP_QSTR_io_oe,           MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0}},
 	/*  3 */ { MP_QSTR_io_lat,          MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0}},
 	/*  4 */ { MP_QSTR_io_clk,          MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0}},
 	/*  5 */ { MP_QSTR_width,           MP_ARG_KW_ONLY | MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0}},
-	/*  6 */ { MP_QSTR_color_depth,     MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 4}},
+	/*  6 */ { MP_QSTR_color_depth,     MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1}},
 	/*  7 */ { MP_QSTR_clock_speed_khz, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 2500}},
 	/*  8 */ { MP_QSTR_invert,          MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
 	/*  9 */ { MP_QSTR_double_buffer,   MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
 	/* 10 */ { MP_QSTR_column_swap,     MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = true} },
 	/* 11 */ { MP_QSTR_single_channel,  MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
 	/* 12 */ { MP_QSTR_brightness,      MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1}},
+	/* 13 */ { MP_QSTR_triple_buffer,   MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+	/* 14 */ { MP_QSTR_bam_planes,      MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0}},
+	/* 15 */ { MP_QSTR_dither,          MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = DITHER_NONE}},
+	/* 16 */ { MP_QSTR_i2s,             MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0}},
+	/* 17 */ { MP_QSTR_fb_y,            MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0}},
+	/* 18 */ { MP_QSTR_fb_height,       MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1}},
+	/* 19 */ { MP_QSTR_tiles,           MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none}},
+	/* 20 */ { MP_QSTR_tile_rotation,   MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = MP_OBJ_NEW_SMALL_INT(0)}},
+	/* 21 */ { MP_QSTR_serpentine,      MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false}},
+	/* 22 */ { MP_QSTR_mapping,         MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none}},
+	/* 23 */ { MP_QSTR_bus_width,       MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 16}},
+	/* 24 */ { MP_QSTR_row_blank,       MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 8}},
+	/* 25 */ { MP_QSTR_psram,           MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false}},
+	/* 26 */ { MP_QSTR_target_fps,      MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0}},
+	/* 27 */ { MP_QSTR_max_clock_khz,   MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1}},
+};
+
+// Color depth without target_fps
+#define COLOR_DEPTH_DEFAULT 4
+
+// Image position of a display pixel for building the panel mapping, returns false if the pixel is not used
+typedef bool (*map_point_func_t)(void *ctx, uint16_t x, uint16_t y, uint16_t *ix, uint16_t *iy);
+
+// Layout for the tiles init parameter
+typedef struct
+{
+	// Size of a single panel on the chain
+	uint16_t tile_width;
+	uint16_t tile_height;
+	// Size of a single panel in the image, after rotation
+	uint16_t out_width;
+	uint16_t out_height;
+	uint16_t columns;
+	// Every second row of tiles runs right to left and is upside down
+	bool serpentine;
+	// Clockwise rotation of every tile in quarter turns
+	uint8_t rotation[MAP_TILES_MAX];
+} tile_layout_t;
+
+/*
+ * Tile n shows columns n * tile_width to (n + 1) * tile_width - 1 of the chain.
+ * Tiles are placed row by row, starting at the top left of the image.
+ * The rotation of the tiles in serpentine rows already includes the additional half turn.
+ */
+static bool map_tile_point(void *ctx, uint16_t x, uint16_t y, uint16_t *ix, uint16_t *iy)
+{
+	const tile_layout_t *t = (const tile_layout_t *)ctx;
+	uint16_t tile = x / t->tile_width;
+	uint16_t u = x % t->tile_width;
+	uint16_t v = y;
+	uint16_t tu, tv;
+
+	switch (t->rotation[tile])
+	{
+		case 0:
+			tu = u;
+			tv = v;
+			break;
+		case 1:
+			tu = t->tile_height - 1 - v;
+			tv = u;
+			break;
+		case 2:
+			tu = t->tile_width - 1 - u;
+			tv = t->tile_height - 1 - v;
+			break;
+		default:
+			tu = v;
+			tv = t->tile_width - 1 - u;
+			break;
+	}
+
+	uint16_t column = tile % t->columns;
+	uint16_t row = tile / t->columns;
+	if (t->serpentine && (row & 1))
+	{
+		column = t->columns - 1 - column;
+	}
+
+	*ix = column * t->out_width + tu;
+	*iy = row * t->out_height + tv;
+	return true;
+}
+
+// Position from the python mapping function, which returns a tuple (x, y) or None
+static bool map_func_point(void *ctx, uint16_t x, uint16_t y, uint16_t *ix, uint16_t *iy)
+{
+	mp_obj_t res = mp_call_function_2(*(mp_obj_t *)ctx, MP_OBJ_NEW_SMALL_INT(x), MP_OBJ_NEW_SMALL_INT(y));
+	if (res == mp_const_none)
+	{
+		return false;
+	}
+
+	mp_obj_t *items;
+	mp_obj_get_array_fixed_n(res, 2, &items);
+	mp_int_t px = mp_obj_get_int(items[0]);
+	mp_int_t py = mp_obj_get_int(items[1]);
+	if (px < 0 || py < 0 || px >= MAP_NONE || py >= MAP_NONE)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("mapping out of range"));
+	}
+	*ix = px;
+	*iy = py;
+	return true;
+}
+
+// Extends the last run of a row by the next pixel, if it continues the same line of the image
+static bool map_extend(map_run_t *run, uint16_t ix, uint16_t iy)
+{
+	if (run->ix == MAP_NONE || ix == MAP_NONE)
+	{
+		if (run->ix != ix)
+		{
+			return false;
+		}
+	}
+	else if (run->x1 - run->x0 == 1)
+	{
+		int32_t dx = (int32_t)ix - run->ix;
+		int32_t dy = (int32_t)iy - run->iy;
+		if (dx < -1 || dx > 1 || dy < -1 || dy > 1 || (dx == 0 && dy == 0))
+		{
+			return false;
+		}
+		run->dx = dx;
+		run->dy = dy;
+	}
+	else
+	{
+		int32_t len = run->x1 - run->x0;
+		if (ix != run->ix + len * run->dx || iy != run->iy + len * run->dy)
+		{
+			return false;
+		}
+	}
+
+	run->x1++;
+	return true;
+}
+
+/*
+ * Compiles a panel mapping into runs of display pixels showing straight lines of the image.
+ * For tiled layouts, this is one run per tile and row, so the conversion only has to follow a few runs per row.
+ * The image size is the bounding box of all mapped pixels.
+ */
+static void map_build(matrix_t *m, map_point_func_t point, void *ctx)
+{
+	size_t count = 0;
+	size_t capacity = 0;
+	uint32_t image_width = 0;
+	uint32_t image_height = 0;
+
+	m->map_row = malloc(sizeof(uint32_t) * (m->height + 1));
+	if (!m->map_row)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+
+	for (uint16_t y = 0; y < m->height; y++)
+	{
+		m->map_row[y] = count;
+		for (uint16_t x = 0; x < m->width; x++)
+		{
+			uint16_t ix, iy;
+			if (point(ctx, x, y, &ix, &iy))
+			{
+				if (ix >= image_width) image_width = ix + 1;
+				if (iy >= image_height) image_height = iy + 1;
+			}
+			else
+			{
+				ix = MAP_NONE;
+				iy = 0;
+			}
+
+			if (x > 0 && map_extend(&m->map_runs[count - 1], ix, iy))
+			{
+				continue;
+			}
+
+			if (count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : m->height * 4;
+				map_run_t *runs = realloc(m->map_runs, sizeof(map_run_t) * capacity);
+				if (!runs)
+				{
+					mp_raise_OSError(ESP_ERR_NO_MEM);
+				}
+				m->map_runs = runs;
+			}
+			m->map_runs[count++] = (map_run_t){ .x0 = x, .x1 = x + 1, .ix = ix, .iy = iy, .dx = 0, .dy = 0 };
+		}
+	}
+	m->map_row[m->height] = count;
+
+	if (image_width == 0)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("mapping doesn't show any pixel"));
+	}
+	m->image_width = image_width;
+	m->image_height = image_height;
+
+	// Collect the stream rows and columns of every image line for the partial updates
+	m->map_lines = malloc(sizeof(dirty_t) * image_height);
+	if (!m->map_lines)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+	for (uint16_t iy = 0; iy < image_height; iy++)
+	{
+		dirty_clear(&m->map_lines[iy]);
+	}
+
+	for (uint16_t y = 0; y < m->height; y++)
+	{
+		for (uint32_t i = m->map_row[y]; i < m->map_row[y + 1]; i++)
+		{
+			const map_run_t *run = &m->map_runs[i];
+			if (run->ix == MAP_NONE)
+			{
+				continue;
+			}
+
+			for (uint16_t k = 0; k < run->x1 - run->x0; k++)
+			{
+				dirty_t *line = &m->map_lines[run->iy + k * run->dy];
+				uint16_t x = run->x0 + k;
+				line->rows |= 1ULL << (y % m->rows);
+				dirty_add_columns(line, x & ~1, (x + 2) & ~1);
+			}
+		}
+	}
+}
+
+/*
+ * Sets up the panel mapping from the tiles, tile_rotation, serpentine and mapping init parameters.
+ * Without any of them, the image is shown as is.
+ */
+static void map_init(matrix_t *m, const mp_arg_val_t *args)
+{
+	if (args[19].u_obj != mp_const_none && args[22].u_obj != mp_const_none)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("tiles and mapping can't be combined"));
+	}
+
+	if (args[22].u_obj != mp_const_none)
+	{
+		mp_obj_t func = args[22].u_obj;
+		if (!mp_obj_is_callable(func))
+		{
+			mp_raise_TypeError(MP_ERROR_TEXT("mapping must be callable"));
+		}
+		map_build(m, map_func_point, &func);
+		return;
+	}
+
+	if (args[19].u_obj == mp_const_none)
+	{
+		m->image_width = m->width;
+		m->image_height = m->height;
+		return;
+	}
+
+	mp_obj_t *items;
+	mp_obj_get_array_fixed_n(args[19].u_obj, 2, &items);
+	mp_int_t columns = mp_obj_get_int(items[0]);
+	mp_int_t tile_rows = mp_obj_get_int(items[1]);
+	if (columns <= 0 || tile_rows <= 0 || columns * tile_rows > MAP_TILES_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid number of tiles"));
+	}
+
+	mp_int_t count = columns * tile_rows;
+	if (m->width % count)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("width must be a multiple of the number of tiles"));
+	}
+
+	tile_layout_t t;
+	t.tile_width = m->width / count;
+	t.tile_height = m->height;
+	t.columns = columns;
+	t.serpentine = args[21].u_bool;
+
+	size_t n_rot = 1;
+	mp_obj_t rot_all = args[20].u_obj;
+	mp_obj_t *rot = &rot_all;
+	if (!mp_obj_is_int(args[20].u_obj))
+	{
+		mp_obj_get_array(args[20].u_obj, &n_rot, &rot);
+		if (n_rot != (size_t)count)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("tile_rotation needs a value for every tile"));
+		}
+	}
+
+	for (mp_int_t i = 0; i < count; i++)
+	{
+		mp_int_t deg = mp_obj_get_int(rot[n_rot > 1 ? i : 0]);
+		if (deg != 0 && deg != 90 && deg != 180 && deg != 270)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("tile_rotation must be 0, 90, 180 or 270"));
+		}
+		t.rotation[i] = deg / 90;
+
+		if (t.serpentine && ((i / columns) & 1))
+		{
+			t.rotation[i] = (t.rotation[i] + 2) & 3;
+		}
+	}
+
+	bool quarter = t.rotation[0] & 1;
+	t.out_width = quarter ? t.tile_height : t.tile_width;
+	t.out_height = quarter ? t.tile_width : t.tile_height;
+	for (mp_int_t i = 1; i < count; i++)
+	{
+		if ((t.rotation[i] & 1) != quarter && t.tile_width != t.tile_height)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("all tiles must have the same size after rotation"));
+		}
+	}
+
+	map_build(m, map_tile_point, &t);
+}
+
+// Highest value for set_brightness, the last row_blank pixels of a row are always off
+static mp_int_t max_brightness(matrix_t *m)
+{
+	return m->width - 2 - m->row_blank;
+}
+
+static void check_brightness(matrix_t *m, mp_int_t b)
+{
+	if (b < 0 || b > max_brightness(m))
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("Brightness must be between 0 and width - 2 - row_blank"));
+	}
+}
+
+static void set_refresh_time(matrix_t *m, uint32_t sample_rate)
+{
+	// Allow for two full refresh cycles and some scheduling delay
+	m->refresh_us = ((uint64_t)m->width * m->rows * subimage_count(m) * 1000000) / sample_rate;
+	m->swap_timeout = pdMS_TO_TICKS(2 * m->refresh_us / 1000 + 10);
+}
+
+/*
+ * Checks if the buffers of a plan fit into the heap.
+ * The current buffers of the display count as free, they are freed before a new allocation.
+ */
+static bool plan_fits(matrix_t *m, const refresh_plan_t *plan)
+{
+	// Only the descriptors of a buffer need a single block
+	size_t desc_block = plan->desc_bytes / m->buffer_count;
+	if (desc_block > heap_caps_get_largest_free_block(MALLOC_CAP_DMA) && desc_block > m->stats.desc_bytes / m->buffer_count)
+	{
+		return false;
+	}
+
+	// Neither can a plane be split. The planes of the display have the same size, so with them there is a block for every plane.
+	size_t plane_block = heap_caps_get_largest_free_block(m->ext_mem ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DMA);
+	if (plan->plane_bytes > plane_block && !m->stats.stream_bytes)
+	{
+		return false;
+	}
+
+	size_t dma_free = heap_caps_get_free_size(MALLOC_CAP_DMA) + m->stats.desc_bytes;
+	if (m->ext_mem)
+	{
+		return plan->desc_bytes <= dma_free && plan->stream_bytes <= heap_caps_get_free_size(MALLOC_CAP_SPIRAM) + m->stats.stream_bytes;
+	}
+	return plan->stream_bytes + plan->desc_bytes <= dma_free + m->stats.stream_bytes;
+}
+
+/*
+ * Selects the highest color depth up to m->color_depth that reaches the refresh rate with at most max_rate
+ * and fits into the heap, and returns the lowest clock for it. bam_planes is lowered for smaller depths.
+ */
+static uint32_t plan_init(matrix_t *m, mp_int_t target_fps, uint32_t max_rate)
+{
+	uint8_t bam = m->bam_planes;
+	for (uint8_t depth = m->color_depth; depth > 0; depth--)
+	{
+		refresh_plan_t plan;
+		plan_depth(m, depth, (bam < depth) ? bam : depth - 1, &plan);
+		uint64_t rate = (uint64_t)target_fps * plan.cycle_samples;
+		if (rate > max_rate || !plan_fits(m, &plan))
+		{
+			continue;
+		}
+
+		m->color_depth = plan.color_depth;
+		m->bam_planes = plan.bam_planes;
+
+		// Whole kHz like clock_speed_khz
+		rate = ((rate + 999) / 1000) * 1000;
+		return (rate < OUTPUT_MIN_RATE) ? OUTPUT_MIN_RATE : rate;
+	}
+	mp_raise_ValueError(MP_ERROR_TEXT("target_fps can't be reached"));
+}
+
+static void matrix_init(matrix_t *m, const mp_arg_val_t *args)
+{
+	deinit(m);
+
+	// With target_fps, color_depth is the highest depth to consider
+	mp_int_t target_fps = args[26].u_int;
+	if (target_fps < 0)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid target_fps"));
+	}
+
+	m->width = args[5].u_int;
+	m->color_depth = (args[6].u_int >= 0) ? args[6].u_int : (target_fps ? COLOR_DEPTH_MAX : COLOR_DEPTH_DEFAULT);
+	m->invert = args[8].u_bool;
+	m->buffer_count = args[13].u_bool ? 3 : (args[9].u_bool ? 2 : 1);
+	m->column_swap = args[10].u_bool;
+	m->single_chn = args[11].u_bool;
+
+	if (args[23].u_int != 8 && args[23].u_int != 16)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("bus_width must be 8 or 16"));
+	}
+	m->sample_size = args[23].u_int / 8;
+
+	m->kernel_flags =
+		(m->column_swap ? KERNEL_FLAG_SWAP : 0) |
+		(m->single_chn ? KERNEL_FLAG_SINGLE : 0) |
+		(m->invert ? KERNEL_FLAG_INVERT : 0) |
+		(m->sample_size == 1 ? KERNEL_FLAG_NARROW : 0);
+
+	if (m->width & 1)
+	{
+		// I don't want to deal with padding for the DMA transfers...
+		mp_raise_ValueError(MP_ERROR_TEXT("width must be an even number"));
+	}
+
+	if (m->sample_size == 1)
+	{
+		// Every row is a DMA transfer of its own, which must be a multiple of 4 bytes
+		if ((m->width & 3) || m->width > DMA_MAX_XFER_SIZE)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("width must be a multiple of 4 with bus_width=8"));
+		}
+		if (args[24].u_int < 0 || args[24].u_int >= m->width - 2)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("row_blank must be less than width - 2"));
+		}
+		m->row_blank = args[24].u_int;
+	}
+
+	if (args[12].u_int > 0)
+	{
+		m->brightness = args[12].u_int;
+		check_brightness(m, m->brightness);
+		m->brightness++;
+	}
+	else
+	{
+		m->brightness = max_brightness(m) + 1;
+	}
+	m->user_brightness = m->brightness;
+	m->led_ma = LED_MA_DEFAULT;
+
+	if (m->color_depth == 0 || m->color_depth > COLOR_DEPTH_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid value for color depth"));
+	}
+
+	// With target_fps, bam_planes is lowered for smaller color depths
+	if (args[14].u_int < 0 || (!target_fps && args[14].u_int >= m->color_depth) || args[14].u_int >= COLOR_DEPTH_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("bam_planes must be less than color_depth"));
+	}
+	m->bam_planes = args[14].u_int;
+
+	if (args[15].u_int < DITHER_NONE || args[15].u_int > DITHER_TEMPORAL)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid dither mode"));
+	}
+	m->dither = args[15].u_int;
+
+	output_config_t cfg;
+	cfg.sample_width = (m->sample_size == 1) ? OUTPUT_WIDTH_8 : OUTPUT_WIDTH_16;
+
+	for (size_t i = 0; i < MP_ARRAY_SIZE(cfg.gpios_bus); i++)
+	{
+		cfg.gpios_bus[i] = -1;
+	}
+
+	cfg.gpios_bus[(m->sample_size == 1) ? BITSTREAM8_OE_IO : BITSTREAM_CTRL_OE_IO] = args[2].u_int;
+	cfg.gpios_bus[(m->sample_size == 1) ? BITSTREAM8_LAT_IO : BITSTREAM_CTRL_LAT_IO] = args[3].u_int;
+	cfg.gpio_clk = args[4].u_int;
+	cfg.sample_rate = args[7].u_int * 1000; // parameter is in khz
+
+
+	size_t iteridx = 0;
+	mp_obj_iter_buf_t iter_buf;
+	mp_obj_t item, iterable = mp_getiter(args[0].u_obj, &iter_buf);
+	while ((item = mp_iternext(iterable)) != MP_OBJ_STOP_ITERATION) {
+		if (iteridx >= 6)
+		{
+			break;
+		}
+
+		if (!mp_obj_is_small_int(item))
+		{
+			mp_raise_TypeError(MP_ERROR_TEXT("values of io_colors must be ints"));
+		}
+
+		cfg.gpios_bus[BITSTREAM_COLOR_START_IO + iteridx] = MP_OBJ_SMALL_INT_VALUE(item);
+		iteridx++;
+	}
+	if ((m->single_chn && iteridx != 3) || (!m->single_chn && iteridx != 6))
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("Unexpected number of color io lines"));
+	}
+
+	iteridx = 0;
+
+	iterable = mp_getiter(args[1].u_obj, &iter_buf);
+	while ((item = mp_iternext(iterable)) != MP_OBJ_STOP_ITERATION) {
+		if (iteridx >= BITSTREAM_ROWS_MAX)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("Too many values given for io_rows"));
+		}
+
+		if (!mp_obj_is_small_int(item))
+		{
+			mp_raise_TypeError(MP_ERROR_TEXT("values of io_rows must be ints"));
+		}
+
+		mp_int_t pin = MP_OBJ_SMALL_INT_VALUE(item);
+		if (m->sample_size == 1)
+		{
+			// Driven by the EOF interrupt, see select_row
+			if (!GPIO_IS_VALID_OUTPUT_GPIO(pin))
+			{
+				mp_raise_ValueError(MP_ERROR_TEXT("invalid row pin"));
+			}
+			m->row_io_bits[iteridx] = 1ULL << pin;
+			m->row_io_all |= 1ULL << pin;
+		}
+		else
+		{
+			cfg.gpios_bus[BITSTREAM_CTRL_ROW_START_IO + iteridx] = pin;
+		}
+		iteridx++;
+	}
+	m->row_io_count = iteridx;
+
+	for (uint8_t pin = 0; pin < 64; pin++)
+	{
+		if (m->row_io_all & (1ULL << pin))
+		{
+			gpio_reset_pin(pin);
+			gpio_set_direction(pin, GPIO_MODE_OUTPUT);
+		}
+	}
+
+	// number of 'rows' in the display
+	// For most displays, the height of the display is twice the number of 'rows' since the display is split into two halves
+	// There are some small / old versions, that only have a single channel
+	m->rows = 1U << iteridx;
+
+	if (m->single_chn)
+	{
+		m->height = m->rows;
+	}
+	else
+	{
+		m->height = m->rows << 1;
+	}
+
+#if CONFIG_IDF_TARGET_ESP32S3
+	m->ext_mem = args[25].u_bool;
+#else
+	if (args[25].u_bool)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("psram requires the ESP32-S3"));
+	}
+#endif
+	// Every DMA transfer must start and end on a block of the external memory, these are the rows for the 8 bit bus and the planes otherwise
+	if (m->ext_mem && ((m->sample_size == 1) ? m->width : 2 * m->width * m->rows) % DMA_EXT_MEM_ALIGN)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("psram requires width (bus_width=8) or width * rows * 2 to be a multiple of 64"));
+	}
+
+	if (target_fps)
+	{
+		mp_int_t max_khz = (args[27].u_int < 0) ? args[7].u_int : args[27].u_int;
+		cfg.sample_rate = plan_init(m, target_fps, max_khz * 1000);
+	}
+
+	map_init(m, args);
+
+	mp_int_t fb_y = args[17].u_int;
+	mp_int_t fb_height = args[18].u_int < 0 ? fb_y + m->image_height : args[18].u_int;
+	if (fb_y < 0 || fb_y + m->image_height > fb_height || fb_height > 0xffff)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("display must be within fb_height"));
+	}
+	m->fb_y = fb_y;
+	m->fb_height = fb_height;
+
+	m->backbuffer = 0;
+	m->frontbuffer = 0;
+	m->pending = NO_BUFFER;
+	m->mono_color[0] = 0xff;
+	m->mono_color[1] = 0xff;
+	m->mono_color[2] = 0xff;
+
+#ifdef DEBUG
+	printf("I2S config: io_clk=%i, rate=%i gpio:\n", cfg.gpio_clk, cfg.sample_rate);
+	for(size_t i = 0; i < 16; i++)
+	{
+		printf("%i ", cfg.gpios_bus[i]);
+	}
+	printf("\nSize %ix%i : %i\n", m->width, m->height, m->color_depth);
+	printf("brightness %i\n", m->brightness);
+	printf("swap %i\n", m->column_swap);
+	printf("invert %i\n", m->invert);
+	printf("buffers %i\n", m->buffer_count);
+	printf("bam planes %i\n", m->bam_planes);
+	printf("dither %i\n", m->dither);
+#endif
+
+	esp_err_t err = matrix_alloc(m);
+	if (err != ESP_OK)
+	{
+		mp_raise_OSError(err);
+	}
+
+	set_refresh_time(m, cfg.sample_rate);
+
+#ifdef DEBUG_TEST_ON_INIT
+	draw_test_pattern(m, &m->buffer[0]);
+#endif
+
+	m->vsync_sem = xSemaphoreCreateBinary();
+	m->swap_sem = xSemaphoreCreateBinary();
+	if (!m->vsync_sem || !m->swap_sem)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+
+	err = output_install(m, &cfg);
+	if (err != ESP_OK)
+	{
+		mp_raise_OSError(err);
+	}
+	matrix_objs[m->port].output_cfg = cfg;
+
+	m->initialized = true;
+
+	start_dma(m);
+}
+
+/*
+ * Selects the display for the I2S peripheral given in the init parameters.
+ */
+static ledmatrix_obj_t *matrix_for_port(const mp_arg_val_t *args)
+{
+	mp_int_t port = args[16].u_int;
+	if (port < 0 || port >= OUTPUT_PORT_COUNT)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid I2S peripheral"));
+	}
+
+	ledmatrix_obj_t *self = &matrix_objs[port];
+	self->base.type = &ledmatrix_matrix_type;
+	self->m.port = port;
+	return self;
+}
+
+/*
+ * Initialize the led matrix driver
+ * Parameters are:
+ * io_colors
+ *    GPIO lines for the color inputs of the matrix
+ *    The order is R1 G1 B1 [R2 G2 B2]
+ *    The *2 values are only required in the double channel (default) mode.
+ * io_rows
+ *    GPIO lines for the row inputs of the matrix
+ *    The order is from LSB to MSB. On most displays these are named A B C D ...
+ *    The display height is implicitly defined by the number of rows
+ * io_oe
+ *    GPIO line for the BLANK / OE (Output enable) input.
+ * io_lat
+ *    GPIO line for the LAT (latch) input
+ * io_clk
+ *    GPIO line for the CLK (clock) input
+ * width
+ *    Width of the display.
+ *    If multiple segments are chained, the width is just extended as if it would be one longer display.
+ * color_depth, default=4
+ *    Number of bits per color channel.
+ *    A higher color depth requires a higher clock to be flicker-free.
+ *    Must be between 1 and 8. With target_fps, this is the highest color depth to choose, default=8.
+ * clock_speed_khz, default=2500
+ *    Clock speed of the output. Must be between 313 and 40000 (10 and 40000 on the ESP32-S3).
+ * target_fps, optional
+ *    Refresh rate to reach. The highest color depth that reaches it with at most max_clock_khz and fits
+ *    into the heap is used, at the lowest clock for it. clock_speed_khz is not used then, see plan.
+ * max_clock_khz, default=clock_speed_khz
+ *    Only with target_fps: highest clock to choose, e.g. the limit of the level shifters.
+ * invert, default=False
+ *     Invert the output signal for use with inverting level shifters.
+ * double_buffer, default=False
+ *     Use double buffering for tearing free updates.
+ *     This doubles the memory requirement.
+ *     The buffers are swapped at the end of a refresh cycle, so show may have to wait for the display.
+ * triple_buffer, default=False
+ *     Use three buffers, so show never has to wait for the display.
+ *     If a frame is not displayed before the next one is shown, it is dropped.
+ *     This triples the memory requirement.
+ * column_swap, default=True
+ *     Swap the output for every second column, since on many displays these are swapped internally.
+ * single_channel, default=False
+ *     Single channel display with only three color lines.
+ *     Most displays are split vertically into an upper and lower half with two separate sets of color lines.
+ * brightness, default=width-2-row_blank
+ *     Global brightness control.
+ *     Must be between 0 (off) and width - 2 - row_blank (max)
+ * bam_planes, default=0
+ *     Number of low bit planes that are output only once per refresh cycle, with a shorter output enable time instead of repeating them.
+ *     This reduces the subimages per refresh cycle from 2^color_depth - 1 to 2^(color_depth - bam_planes) - 1 + bam_planes.
+ *     Must be less than color_depth. With target_fps, it is lowered to color_depth - 1 for smaller color depths.
+ * dither, default=DITHER_NONE
+ *     DITHER_ORDERED adds a 2x2 ordered dither pattern for about two bits of additional perceived color depth.
+ *     DITHER_TEMPORAL additionally rotates the pattern with every show, so every pixel alternates between the neighboring levels.
+ *     The pattern only moves when frames are shown, region and diff are ignored then.
+ * i2s, default=0
+ *     I2S peripheral used for the output. Displays on different peripherals are refreshed in parallel.
+ *     The ESP32-S3 only has the LCD_CAM peripheral, so this must be 0.
+ * fb_y, default=0
+ *     First line of the framebuffer shown on this display.
+ *     This allows multiple displays to show parts of the same framebuffer.
+ * fb_height, default=height
+ *     Total height of the framebuffer passed to show.
+ * tiles, optional
+ *     Tuple (columns, rows) of panels on the chain, the image is arranged as a grid of panels.
+ * tile_rotation, default=0
+ *     Clockwise rotation of the panels in degrees, a single value or a tuple with a value for every panel.
+ * serpentine, default=False
+ *     Every second row of panels runs from right to left and is upside down.
+ * mapping, optional
+ *     Function (x, y) -> (x, y) or None, giving the image position of every display pixel.
+ *     Can't be combined with tiles.
+ * bus_width, default=16
+ *     With 8, the stream only holds the colors, OE and LAT, which halves its memory.
+ *     The row lines are then switched by an interrupt at the end of every row, the width must be a multiple of 4.
+ * row_blank, default=8
+ *     Only used with bus_width=8: pixels at the end of every row with the output disabled,
+ *     the row lines are switched in that time. The maximum brightness is reduced by the same amount.
+ * psram, default=False
+ *     Only on the ESP32-S3: the stream buffers are allocated in PSRAM, only the DMA descriptors stay in internal RAM.
+ *     Every DMA transfer must be a multiple of 64 bytes, so width * rows * 2 (bus_width=8: the width) must be a multiple of 64.
+ *
+ * The module level functions operate on the display created by this function,
+ * ledmatrix.Matrix takes the same parameters and returns an object for the display.
+ */
+STATIC mp_obj_t ledmatrix_init(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	mp_arg_val_t args[MP_ARRAY_SIZE(init_args)];
+	mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(init_args), init_args, args);
+
+	ledmatrix_obj_t *self = matrix_for_port(args);
+	matrix_init(&self->m, args);
+	default_matrix = self;
+
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_init_obj, 0, ledmatrix_init);
+
+/*
+ * Create a display object, the parameters are the same as for init.
+ * There is only one display per I2S peripheral, creating a new one replaces the old one.
+ */
+STATIC mp_obj_t ledmatrix_matrix_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *all_args)
+{
+	(void)type;
+	mp_arg_val_t args[MP_ARRAY_SIZE(init_args)];
+	mp_arg_parse_all_kw_array(n_args, n_kw, all_args, MP_ARRAY_SIZE(init_args), init_args, args);
+
+	ledmatrix_obj_t *self = matrix_for_port(args);
+	matrix_init(&self->m, args);
+
+	return MP_OBJ_FROM_PTR(self);
+}
+
+static matrix_t *get_matrix(mp_obj_t self)
+{
+	return &((ledmatrix_obj_t *)MP_OBJ_TO_PTR(self))->m;
+}
+
+
+/*
+ * Set the global brightness
+ * Value must be between 0 (off) and width - 2 - row_blank (max)
+ */
+STATIC mp_obj_t ledmatrix_set_brightness(mp_obj_t self, mp_obj_t b)
+{
+	matrix_t *m = get_matrix(self);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	if (!mp_obj_is_small_int(b))
+		mp_raise_TypeError(MP_ERROR_TEXT("expected small int"));
+
+	int newb = MP_OBJ_SMALL_INT_VALUE(b);
+	check_brightness(m, newb);
+
+	async_wait(m, portMAX_DELAY);
+
+	// Only the value changes here, the interrupt moves the cutoff of the buffers on the display with the next
+	// refresh cycle and the backbuffer gets it when it is presented, see follow_brightness.
+	// A running fade is stopped. The power limit of every frame still applies, see buffer_brightness.
+	portENTER_CRITICAL(&m->swap_lock);
+	m->fade_frames = 0;
+	m->user_brightness = newb + 1;
+	m->brightness = m->user_brightness;
+	portEXIT_CRITICAL(&m->swap_lock);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(ledmatrix_set_brightness_obj, ledmatrix_set_brightness);
+
+/*
+ * Limit the estimated current of the LEDs
+ * Parameters are
+ * limit_ma
+ *     Highest current in mA, 0 turns the limit off.
+ *     Every shown frame that would draw more at the set brightness is shown with a lower brightness instead.
+ * led_ma, default=20
+ *     Current of one LED channel while it is on, the setting of the constant current drivers of the panel.
+ * The current is estimated from the lit color bits of the frame, the plane weights, the multiplexing and the
+ * output enable time of the brightness, see stats.
+ */
+STATIC mp_obj_t ledmatrix_set_power_limit(size_t n_args, const mp_obj_t *args)
+{
+	matrix_t *m = get_matrix(args[0]);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	mp_int_t limit = mp_obj_get_int(args[1]);
+	mp_int_t led = (n_args > 2) ? mp_obj_get_int(args[2]) : LED_MA_DEFAULT;
+	if (limit < 0 || led <= 0 || led > UINT16_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid current"));
+	}
+
+	async_wait(m, portMAX_DELAY);
+	m->led_ma = led;
+	m->power_limit_ma = limit;
+
+	// Applies to the frames on the display right away, the caps are computed outside of the lock.
+	// A buffer that is being converted gets its cap when it is presented.
+	uint16_t caps[BUFFER_COUNT_MAX];
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		caps[i] = power_cap(m, &m->buffer[i], limit);
+	}
+	portENTER_CRITICAL(&m->swap_lock);
+	if (!(m->buffer_count == 1 && m->backbuffer_acquired))
+	{
+		m->buffer[m->frontbuffer].power_cap = caps[m->frontbuffer];
+		if (m->pending != NO_BUFFER)
+		{
+			m->buffer[m->pending].power_cap = caps[m->pending];
+		}
+	}
+	portEXIT_CRITICAL(&m->swap_lock);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_set_power_limit_obj, 2, 3, ledmatrix_set_power_limit);
+
+/*
+ * Fade the global brightness to target over duration_ms.
+ * The brightness is changed by the refresh interrupt, so the fade runs in the background and is in sync with the display.
+ * The target is in the same range as for set_brightness. A new fade or set_brightness stops a running fade.
+ */
+STATIC mp_obj_t ledmatrix_fade(mp_obj_t self, mp_obj_t target, mp_obj_t duration)
+{
+	matrix_t *m = get_matrix(self);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	mp_int_t newb = mp_obj_get_int(target);
+	mp_int_t ms = mp_obj_get_int(duration);
+	check_brightness(m, newb);
+	if (ms < 0)
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid duration"));
+
+	async_wait(m, portMAX_DELAY);
+
+	uint32_t frames = ((uint64_t)ms * 1000) / (m->refresh_us ? m->refresh_us : 1);
+	if (frames == 0 || !m->running)
+	{
+		// Too short for a single cycle, or nothing is refreshed that could run the fade
+		ledmatrix_set_brightness(self, MP_OBJ_NEW_SMALL_INT(newb));
+		return mp_const_none;
+	}
+
+	portENTER_CRITICAL(&m->swap_lock);
+	m->user_brightness = newb + 1;
+	m->fade_from = m->brightness;
+	m->fade_to = m->user_brightness;
+	m->fade_frame = 0;
+	m->fade_frames = frames;
+	portEXIT_CRITICAL(&m->swap_lock);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(ledmatrix_fade_obj, ledmatrix_fade);
+
+/*
+ * True while a fade is running.
+ */
+STATIC mp_obj_t ledmatrix_fading(mp_obj_t self)
+{
+	return mp_obj_new_bool(get_matrix(self)->fade_frames != 0);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_fading_obj, ledmatrix_fading);
+
+static uint8_t (*new_channel_lut(void))[256]
+{
+	uint8_t (*lut)[256] = malloc(3 * sizeof(*lut));
+	if (!lut)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+	return lut;
+}
+
+/*
+ * Hands a new channel correction over to the background task, see take_staged_tables.
+ * A table that was staged before and not taken yet is replaced.
+ */
+static void stage_channel_lut(matrix_t *m, uint8_t (*lut)[256])
+{
+	portENTER_CRITICAL(&m->swap_lock);
+	uint8_t (*old)[256] = m->channel_lut_next;
+	m->channel_lut_next = lut;
+	portEXIT_CRITICAL(&m->swap_lock);
+	if (old)
+	{
+		free(old);
+	}
+}
+
+/*
+ * Set the gamma correction of the color channels
+ * Parameters are
+ * gamma
+ *     Exponent of the correction curve, 1.0 means no correction.
+ *     GAMMA_CIE selects the CIE 1931 lightness curve.
+ * white, default=0xffffff
+ *     Color of full white, the channels are scaled by it for white balance.
+ */
+STATIC mp_obj_t ledmatrix_set_gamma(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_gamma, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_white, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0xffffff} },
+	};
+
+	matrix_t *m = get_matrix(pos_args[0]);
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	float gamma = mp_obj_get_float(args[0].u_obj);
+	if (gamma < 0)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid gamma"));
+	}
+
+	async_wait(m, portMAX_DELAY);
+	if (!background_running(m))
+	{
+		init_channel_lut(m, gamma, args[1].u_int);
+		channel_lut_changed(m);
+		return mp_const_none;
+	}
+
+	uint8_t (*lut)[256] = new_channel_lut();
+	build_channel_lut(lut, gamma, args[1].u_int);
+	stage_channel_lut(m, lut);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_set_gamma_obj, 2, ledmatrix_set_gamma);
+
+/*
+ * Set the channel correction from lookup tables
+ * r, g, b are buffers with 256 bytes, the output value for every input value of the channel.
+ * g and b default to the table given for r.
+ */
+STATIC mp_obj_t ledmatrix_set_lut(size_t n_args, const mp_obj_t *args)
+{
+	matrix_t *m = get_matrix(args[0]);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	mp_buffer_info_t lut[3];
+	for (uint8_t c = 0; c < 3; c++)
+	{
+		mp_get_buffer_raise(args[(c + 1 < n_args) ? c + 1 : 1], &lut[c], MP_BUFFER_READ);
+		if (lut[c].len != 256)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
+		}
+	}
+
+	async_wait(m, portMAX_DELAY);
+	bool staged = background_running(m);
+	uint8_t (*table)[256] = staged ? new_channel_lut() : m->channel_lut;
+	for (uint8_t c = 0; c < 3; c++)
+	{
+		memcpy(table[c], lut[c].buf, 256);
+	}
+
+	if (staged)
+	{
+		stage_channel_lut(m, table);
+	}
+	else
+	{
+		channel_lut_changed(m);
+	}
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_set_lut_obj, 2, 4, ledmatrix_set_lut);
+
+/*
+ * Set the palette for FB_PAL8 and FB_PAL4 images
+ * Parameters are
+ * colors
+ *     Sequence of colors 0xRRGGBB
+ * start, default=0
+ *     First palette index to set
+ */
+STATIC mp_obj_t ledmatrix_set_palette(size_t n_args, const mp_obj_t *args)
+{
+	matrix_t *m = get_matrix(args[0]);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	mp_int_t start = (n_args > 2) ? mp_obj_get_int(args[2]) : 0;
+	size_t len;
+	mp_obj_t *items;
+	mp_obj_get_array(args[1], &len, &items);
+	if (start < 0 || start + len > INDEX_LUT_SIZE)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("palette has 256 entries"));
+	}
+
+	async_wait(m, portMAX_DELAY);
+	if (background_running(m))
+	{
+		// Raise before anything is allocated
+		for (size_t i = 0; i < len; i++)
+		{
+			mp_obj_get_int(items[i]);
+		}
+
+		// Changes on top of a palette that is still staged, otherwise on top of the current one.
+		// The task only replaces the current palette while one is staged, so it can be read here.
+		portENTER_CRITICAL(&m->swap_lock);
+		uint32_t *palette = m->palette_next;
+		m->palette_next = NULL;
+		portEXIT_CRITICAL(&m->swap_lock);
+		if (!palette)
+		{
+			palette = malloc(sizeof(uint32_t) * INDEX_LUT_SIZE);
+			if (!palette)
+			{
+				mp_raise_OSError(ESP_ERR_NO_MEM);
+			}
+			memcpy(palette, m->palette, sizeof(uint32_t) * INDEX_LUT_SIZE);
+		}
+		for (size_t i = 0; i < len; i++)
+		{
+			palette[start + i] = mp_obj_get_int(items[i]) & 0xffffff;
+		}
+
+		portENTER_CRITICAL(&m->swap_lock);
+		m->palette_next = palette;
+		portEXIT_CRITICAL(&m->swap_lock);
+		return mp_const_none;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		m->palette[start + i] = mp_obj_get_int(items[i]) & 0xffffff;
+	}
+
+	if (m->index_lut_color == INDEX_LUT_PALETTE)
+	{
+		m->index_lut_color = INDEX_LUT_INVALID;
+	}
+	m->line_hash_valid = false;
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_set_palette_obj, 2, 3, ledmatrix_set_palette);
+
+/*
+ * Shared argument handling of show and show_async.
+ * Any pending asynchronous update is finished first, since it may still use the mono color.
+ */
+static void parse_show_args(matrix_t *m, size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args, show_job_t *job)
+{
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	background_check(m);
+
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_fb, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_int = 0} },
+		{ MP_QSTR_mono_color, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_mode, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = COLOR_RGB565} },
+		{ MP_QSTR_region, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_diff, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+		{ MP_QSTR_stride, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_x_offset, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_y_offset, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_encoding, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = ENC_NONE} },
+		{ MP_QSTR_scale, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
+	};
+
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+	mp_buffer_info_t src;
+	mp_get_buffer_raise(args[0].u_obj, &src, MP_BUFFER_READ);
+
+	rect_t *region = &job->region;
+	region->x0 = 0;
+	region->y0 = 0;
+	region->x1 = m->image_width;
+	region->y1 = m->image_height;
+	if (args[3].u_obj != mp_const_none)
+	{
+		mp_obj_t *items;
+		mp_obj_get_array_fixed_n(args[3].u_obj, 4, &items);
+		mp_int_t x = mp_obj_get_int(items[0]);
+		mp_int_t y = mp_obj_get_int(items[1]);
+		mp_int_t w = mp_obj_get_int(items[2]);
+		mp_int_t h = mp_obj_get_int(items[3]);
+
+		// Clip to the display, an empty region is fine and just doesn't update anything
+		mp_int_t x1 = x + w;
+		mp_int_t y1 = y + h;
+		if (x < 0) x = 0;
+		if (y < 0) y = 0;
+		if (x1 > m->image_width) x1 = m->image_width;
+		if (y1 > m->image_height) y1 = m->image_height;
+		if (x1 < x) x1 = x;
+		if (y1 < y) y1 = y;
+
+		region->x0 = x;
+		region->y0 = y;
+		region->x1 = x1;
+		region->y1 = y1;
+	}
+
+	job->diff = args[4].u_bool;
+	if (job->diff && args[3].u_obj != mp_const_none)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("region and diff can't be combined"));
+	}
+
+	// The pattern moves on with every frame, so the whole frame is converted and never mixes two phases
+	if (m->dither == DITHER_TEMPORAL)
+	{
+		job->diff = false;
+		region->x0 = 0;
+		region->y0 = 0;
+		region->x1 = m->image_width;
+		region->y1 = m->image_height;
+	}
+
+	if ((args[2].u_int < 0 || args[2].u_int >= COLOR_COUNT) && args[2].u_int != COLOR_PLANES)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid mode"));
+	}
+	job->format = args[2].u_int;
+
+	mp_int_t scale = args[9].u_int;
+	if (scale != 1 && scale != 2 && scale != 4)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("scale must be 1, 2 or 4"));
+	}
+	job->scale_shift = scale >> 1;
+	if ((m->image_width | m->image_height | m->fb_y | m->fb_height) & (scale - 1))
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("display size, fb_y and fb_height must be multiples of scale"));
+	}
+
+	// The source image and the lines of the framebuffer are scaled down, the region stays in display pixels
+	uint16_t source_width = m->image_width >> job->scale_shift;
+	uint16_t fb_y = m->fb_y >> job->scale_shift;
+	uint16_t fb_height = m->fb_height >> job->scale_shift;
+	size_t line_size = format_line_size(job->format, source_width);
+	mp_int_t stride = args[5].u_int;
+	mp_int_t x_offset = args[6].u_int;
+	mp_int_t y_offset = args[7].u_int;
+	job->encoding = args[8].u_int;
+	job->length = 0;
+	if (job->scale_shift && (job->format == COLOR_PLANES || job->encoding != ENC_NONE))
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("scale can't be combined with FB_PLANES or an encoding"));
+	}
+	if (job->format == COLOR_PLANES)
+	{
+		if (args[3].u_obj != mp_const_none || job->diff || stride >= 0 || x_offset != 0 || y_offset != 0 || job->encoding != ENC_NONE)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("FB_PLANES can't be combined with region, diff, a window or an encoding"));
+		}
+		if (planes_frame_check(m, src.buf, src.len) != ESP_OK)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("frame doesn't match the display"));
+		}
+		job->data = (const uint8_t *)src.buf;
+		job->length = src.len;
+		job->stride = 0;
+	}
+	else if (job->encoding != ENC_NONE)
+	{
+		if (job->encoding != ENC_RLE && job->encoding != ENC_DELTA)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("invalid encoding"));
+		}
+		if (job->format == COLOR_MONO || job->format == COLOR_PAL4)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("encoding requires whole bytes per pixel"));
+		}
+		if (args[3].u_obj != mp_const_none || job->diff || stride >= 0 || x_offset != 0 || y_offset != 0)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("encoded frames can't be combined with region, diff or a window"));
+		}
+		// Checked up front, so a broken frame never ends up half drawn
+		if (encoded_frame_check(m, src.buf, src.len, job->format, job->encoding) != ESP_OK)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("invalid encoded frame"));
+		}
+		job->data = (const uint8_t *)src.buf;
+		job->length = src.len;
+		job->stride = 0;
+	}
+	else if (stride < 0 && x_offset == 0 && y_offset == 0)
+	{
+		if (src.len != line_size * fb_height)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
+		}
+		job->stride = line_size;
+		job->data = (const uint8_t *)src.buf + line_size * fb_y;
+	}
+	else
+	{
+		// Window into a larger image, the lines are read in place
+		if (stride < 0)
+			stride = source_width + x_offset;
+		if (x_offset < 0 || y_offset < 0 || x_offset + source_width > stride || stride > UINT16_MAX)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("window outside of the source image"));
+		}
+		if ((job->format == COLOR_MONO && (x_offset & 7)) || (job->format == COLOR_PAL4 && (x_offset & 1)))
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("x_offset must be byte aligned"));
+		}
+		size_t x_offset_bytes = format_line_size(job->format, x_offset);
+		job->stride = format_line_size(job->format, stride);
+		if (job->stride * (y_offset + fb_height - 1) + x_offset_bytes + line_size > src.len)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
+		}
+		job->data = (const uint8_t *)src.buf + job->stride * (y_offset + fb_y) + x_offset_bytes;
+	}
+
+	async_wait(m, portMAX_DELAY);
+
+	int color = args[1].u_int;
+	if (color >= 0)
+	{
+		m->mono_color[0] = (color >> 16) & 0xff;
+		m->mono_color[1] = (color >> 8) & 0xff;
+		m->mono_color[2] = color & 0xff;
+	}
+
+	esp_err_t err = prepare_format(m, job->format);
+	if (err != ESP_OK)
+	{
+		mp_raise_OSError(err);
+	}
+}
+
+/*
+ * Update the internal framebuffer from the specified data
+ * Parameters are
+ * fb
+ *     Framebuffer
+ *     The format must be one of the following:
+ *         RGB565
+ *         GS8
+ *         MONO_HLSB
+ *         RGB888, three bytes R G B per pixel
+ *         RGB444, 16 bit per pixel 0x0RGB
+ *         PAL8, one palette index per byte
+ *         PAL4, two palette indices per byte, the first one in the high nibble
+ *         PLANES, color bytes of the stream encoded in advance, see host/encode_planes.c
+ * mode, default=RGB565
+ *    Format of the framebuffer, values are the COLOR_* constants
+ *    Must be matching the format of the specified framebuffer
+ * mono_color, optional
+ *     Color to use for monochrome images.
+ * region, optional, ignored with DITHER_TEMPORAL
+ *     Tuple (x, y, w, h) of the part of the image that changed since the last call.
+ *     The framebuffer must still contain the full image, only the region is converted.
+ * diff, default=False, ignored with DITHER_TEMPORAL
+ *     Only convert lines that changed since the last call with diff enabled.
+ *     Can't be combined with region.
+ * stride, optional
+ *     Width of the source image in pixels, to show a window of a larger image.
+ * x_offset, y_offset, default=0
+ *     Position of the window in the source image.
+ *     For MONO_HLSB and PAL4, x_offset must start on a byte boundary.
+ * encoding, default=ENC_NONE
+ *     ENC_RLE: fb is a run length encoded frame with pixel values in the format given by mode.
+ *     ENC_DELTA: the same with packets that skip unchanged pixels, applied to the last frame.
+ *     The frames are decoded straight into the buffer, see ENC_RUN and ENC_SKIP for the packets.
+ *     Only formats with whole bytes per pixel, can't be combined with region, diff or a window.
+ * scale, default=1
+ *     2 or 4 to show a source image of width / scale x height / scale pixels, every source pixel covers
+ *     scale x scale display pixels. The framebuffer, stride, x_offset and y_offset are in source pixels,
+ *     region stays in display pixels. Can't be combined with FB_PLANES or an encoding.
+ */
+STATIC mp_obj_t ledmatrix_show(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+	matrix_t *m = get_matrix(pos_args[0]);
+	show_job_t job;
+	parse_show_args(m, n_args - 1, pos_args + 1, kw_args, &job);
+
+	show_frame(m, &job, true);
+
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_show_obj, 2, ledmatrix_show);
+
+/*
+ * Same as show, but the conversion is done by a worker task on the other core.
+ * The function returns immediately, the framebuffer must be kept alive and unchanged until busy returns False.
+ * If the previous asynchronous update is still running, this waits for it to finish first.
+ */
+STATIC mp_obj_t ledmatrix_show_async(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+	matrix_t *m = get_matrix(pos_args[0]);
+	show_job_t job;
+	parse_show_args(m, n_args - 1, pos_args + 1, kw_args, &job);
+
+	async_start_worker(m);
+
+	// Clear a completion nobody waited for
+	xSemaphoreTake(m->async_done, 0);
+
+	m->async_job = job;
+	m->async_busy = true;
+	xTaskNotifyGive(m->async_task);
+
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_show_async_obj, 2, ledmatrix_show_async);
+
+/*
+ * Returns True while an asynchronous update is running.
+ */
+STATIC mp_obj_t ledmatrix_busy(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	return mp_obj_new_bool(m->async_busy);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_busy_obj, ledmatrix_busy);
+
+/*
+ * Wait for a running asynchronous update to finish.
+ * Parameters are
+ * timeout_ms, default=-1
+ *     Maximum time to wait, negative values wait forever.
+ * Returns False if the timeout expired before the update was finished.
+ */
+STATIC mp_obj_t ledmatrix_wait(size_t n_args, const mp_obj_t *args)
+{
+	matrix_t *m = get_matrix(args[0]);
+	mp_int_t timeout_ms = n_args > 1 ? mp_obj_get_int(args[1]) : -1;
+	return mp_obj_new_bool(async_wait(m, timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms)));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_wait_obj, 1, 2, ledmatrix_wait);
+
+static void draw_check(matrix_t *m)
+{
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	background_check(m);
+	async_wait(m, portMAX_DELAY);
+}
+
+static void draw_rect(matrix_t *m, mp_int_t x, mp_int_t y, mp_int_t w, mp_int_t h, mp_obj_t color)
+{
+	draw_check(m);
+
+	rect_t rect;
+	if (!clip_rect(m, x, y, w, h, &rect))
+	{
+		return;
+	}
+
+	uint32_t c = mp_obj_get_int(color);
+	plane_bits_t bits[DITHER_CELLS];
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		bits[cell] = get_rgb888_plane_bits(m, c, cell);
+	}
+
+	stream_buffer_t *buf = draw_begin(m);
+	draw_fill_rect(m, buf, &rect, bits);
+	draw_end(m, buf, &rect);
+}
+
+/*
+ * Set a single pixel.
+ * The color is given as 24 bit value 0xRRGGBB.
+ * The drawing functions write directly into the internal buffer, so no framebuffer is required.
+ * With multiple buffers, the result is displayed by present.
+ */
+STATIC mp_obj_t ledmatrix_pixel(size_t n_args, const mp_obj_t *args)
+{
+	draw_rect(get_matrix(args[0]), mp_obj_get_int(args[1]), mp_obj_get_int(args[2]), 1, 1, args[3]);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_pixel_obj, 4, 4, ledmatrix_pixel);
+
+/*
+ * Fill a rectangle, parameters are x, y, w, h, color
+ */
+STATIC mp_obj_t ledmatrix_fill_rect(size_t n_args, const mp_obj_t *args)
+{
+	draw_rect(get_matrix(args[0]), mp_obj_get_int(args[1]), mp_obj_get_int(args[2]), mp_obj_get_int(args[3]), mp_obj_get_int(args[4]), args[5]);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_fill_rect_obj, 6, 6, ledmatrix_fill_rect);
+
+/*
+ * Draw a horizontal line, parameters are x, y, w, color
+ */
+STATIC mp_obj_t ledmatrix_hline(size_t n_args, const mp_obj_t *args)
+{
+	draw_rect(get_matrix(args[0]), mp_obj_get_int(args[1]), mp_obj_get_int(args[2]), mp_obj_get_int(args[3]), 1, args[4]);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_hline_obj, 5, 5, ledmatrix_hline);
+
+/*
+ * Draw a vertical line, parameters are x, y, h, color
+ */
+STATIC mp_obj_t ledmatrix_vline(size_t n_args, const mp_obj_t *args)
+{
+	draw_rect(get_matrix(args[0]), mp_obj_get_int(args[1]), mp_obj_get_int(args[2]), 1, mp_obj_get_int(args[3]), args[4]);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_vline_obj, 5, 5, ledmatrix_vline);
+
+/*
+ * Checks the image for blit and sets up the source.
+ * The mono color is updated if color is not negative.
+ */
+static void blit_prepare(matrix_t *m, blit_src_t *blit, mp_obj_t fb, mp_int_t x, mp_int_t y, mp_int_t w, mp_int_t h, mp_int_t format, mp_int_t key, mp_int_t color)
+{
+	mp_buffer_info_t src;
+	mp_get_buffer_raise(fb, &src, MP_BUFFER_READ);
+
+	if (w < 0 || h < 0)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid size"));
+	}
+
+	if (format < 0 || format >= COLOR_COUNT)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid mode"));
+	}
+	size_t line_size = format_line_size(format, w);
+
+	if (src.len < line_size * h)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
+	}
+
+	if (color >= 0)
+	{
+		m->mono_color[0] = (color >> 16) & 0xff;
+		m->mono_color[1] = (color >> 8) & 0xff;
+		m->mono_color[2] = color & 0xff;
+	}
+
+	blit->data = (const uint8_t *)src.buf;
+	blit->line_size = line_size;
+	blit->x = x;
+	blit->y = y;
+	blit->format = format;
+	blit->key = key;
+	get_mono_plane_bits(m, blit->mono_bits);
+	esp_err_t err = prepare_format(m, format);
+	if (err != ESP_OK)
+	{
+		mp_raise_OSError(err);
+	}
+}
+
+/*
+ * Draw an image
+ * Parameters are
+ * fb
+ *     Image data, in the same formats as for show
+ * x, y
+ *     Position on the display
+ * w, h
+ *     Size of the image
+ * mode, default=FB_RGB565
+ *     Format of the image data
+ * key, default=-1
+ *     Pixels with this value are not drawn.
+ * mono_color, optional
+ *     Color to use for non-rgb images.
+ */
+STATIC mp_obj_t ledmatrix_blit(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_fb, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_x, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_y, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_w, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_h, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_mode, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = COLOR_RGB565} },
+		{ MP_QSTR_key, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_mono_color, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+	};
+
+	matrix_t *m = get_matrix(pos_args[0]);
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+	draw_check(m);
+
+	blit_src_t blit;
+	blit_prepare(m, &blit, args[0].u_obj, args[1].u_int, args[2].u_int, args[3].u_int, args[4].u_int, args[5].u_int, args[6].u_int, args[7].u_int);
+
+	rect_t rect;
+	if (!clip_rect(m, blit.x, blit.y, args[3].u_int, args[4].u_int, &rect))
+	{
+		return mp_const_none;
+	}
+
+	stream_buffer_t *buf = draw_begin(m);
+	draw_each(m, buf, &rect, draw_blit_pixel, &blit);
+	draw_end(m, buf, &rect);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_blit_obj, 6, ledmatrix_blit);
+
+/*
+ * Move the image on the display, without converting it again.
+ * The color bits are shifted inside the internal buffer, so only the part moved in at the edge is new.
+ * Parameters are
+ * dx, dy
+ *     Distance in pixels, positive values move the image right and down.
+ * fill_fb, optional
+ *     Image for the part moved in at the edge, in the same formats as for show.
+ *     For horizontal moves it is abs(dx) pixels wide and as high as the display,
+ *     for vertical moves as wide as the display and abs(dy) pixels high.
+ *     Without it, that part is black. Can't be used for diagonal moves.
+ * mode, default=FB_RGB565
+ *     Format of fill_fb
+ * mono_color, optional
+ *     Color to use for non-rgb images.
+ */
+STATIC mp_obj_t ledmatrix_scroll(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_dx, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_dy, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+		{ MP_QSTR_fill_fb, MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_mode, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = COLOR_RGB565} },
+		{ MP_QSTR_mono_color, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+	};
+
+	matrix_t *m = get_matrix(pos_args[0]);
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+	draw_check(m);
+
+	if (m->map_runs)
+	{
+		// Neighbouring image pixels are not neighbours in the buffer
+		mp_raise_ValueError(MP_ERROR_TEXT("scroll not supported with a panel mapping"));
+	}
+
+	mp_int_t dx = args[0].u_int;
+	mp_int_t dy = args[1].u_int;
+	if (dx > m->width) dx = m->width;
+	if (dx < -m->width) dx = -m->width;
+	if (dy > m->height) dy = m->height;
+	if (dy < -m->height) dy = -m->height;
+
+	// Check the fill image before anything is moved
+	blit_src_t blit;
+	rect_t fill;
+	bool has_fill = args[2].u_obj != mp_const_none;
+	if (has_fill)
+	{
+		if (args[0].u_int && args[1].u_int)
+		{
+			mp_raise_ValueError(MP_ERROR_TEXT("fill_fb requires a horizontal or vertical move"));
+		}
+
+		mp_int_t x = (args[0].u_int < 0) ? m->width + args[0].u_int : 0;
+		mp_int_t y = (args[1].u_int < 0) ? m->height + args[1].u_int : 0;
+		mp_int_t w = (args[0].u_int > 0) ? args[0].u_int : (args[0].u_int < 0) ? -args[0].u_int : m->width;
+		mp_int_t h = (args[1].u_int > 0) ? args[1].u_int : (args[1].u_int < 0) ? -args[1].u_int : m->height;
+		blit_prepare(m, &blit, args[2].u_obj, x, y, w, h, args[3].u_int, -1, args[4].u_int);
+		has_fill = clip_rect(m, x, y, w, h, &fill);
+	}
+
+	if (!dx && !dy)
+	{
+		return mp_const_none;
+	}
+
+	stream_buffer_t *buf = draw_begin(m);
+	if (dx)
+	{
+		scroll_columns(m, buf, dx);
+	}
+	if (dy)
+	{
+		scroll_lines(m, buf, dy);
+	}
+
+	if (has_fill)
+	{
+		draw_each(m, buf, &fill, draw_blit_pixel, &blit);
+	}
+
+	rect_t all = { 0, 0, m->width, m->height };
+	draw_end(m, buf, &all);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_scroll_obj, 3, ledmatrix_scroll);
+
+/*
+ * Display everything drawn since the last call.
+ * Only required with double or triple buffering, otherwise drawing is visible right away.
+ */
+STATIC mp_obj_t ledmatrix_present(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	draw_check(m);
+	if (m->backbuffer_acquired)
+	{
+		present_backbuffer(m);
+	}
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_present_obj, ledmatrix_present);
+
+/*
+ * Wait for the end of the current refresh cycle.
+ * Parameters are
+ * timeout_ms, default=-1
+ *     Maximum time to wait, negative values wait forever.
+ * Returns False if the timeout expired, e.g. because the output is stopped.
+ */
+STATIC mp_obj_t ledmatrix_wait_vsync(size_t n_args, const mp_obj_t *args)
+{
+	matrix_t *m = get_matrix(args[0]);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	mp_int_t timeout_ms = n_args > 1 ? mp_obj_get_int(args[1]) : -1;
+
+	// Only count refresh cycles ending after this call
+	xSemaphoreTake(m->vsync_sem, 0);
+
+	MP_THREAD_GIL_EXIT();
+	bool done = xSemaphoreTake(m->vsync_sem, timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+	MP_THREAD_GIL_ENTER();
+
+	return mp_obj_new_bool(done);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(ledmatrix_wait_vsync_obj, 1, 2, ledmatrix_wait_vsync);
+
+/*
+ * Get a dict with statistics of the driver
+ * update_cycles_last, update_cycles_avg
+ *     CPU cycles of the last and the average conversion, None if built without LEDMATRIX_STATS
+ * frames_shown
+ *     Number of frames shown with show and show_async
+ * refresh_rate
+ *     Measured refresh cycles per second since the last call of stats, None if built without LEDMATRIX_STATS
+ * missed_swaps
+ *     Number of times a new frame missed the end of a refresh cycle and was displayed one cycle later
+ * stream_bytes, desc_bytes
+ *     Memory used for the bitstreams and the DMA descriptors of all buffers
+ * current_ma
+ *     Estimated current of the LEDs for the frame on the display at the current brightness, see set_power_limit
+ * power_limited
+ *     Number of frames shown with a lower brightness because of the power limit
+ */
+STATIC mp_obj_t ledmatrix_stats(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	stats_t *st = &m->stats;
+	mp_obj_t update_last = mp_const_none;
+	mp_obj_t update_avg = mp_const_none;
+	mp_obj_t refresh_rate = mp_const_none;
+
+#if LEDMATRIX_STATS
+	if (st->update_count)
+	{
+		update_last = mp_obj_new_int_from_uint(st->update_cycles_last);
+		update_avg = mp_obj_new_int_from_uint(st->update_cycles_total / st->update_count);
+	}
+
+	portENTER_CRITICAL(&m->swap_lock);
+	uint32_t frames = st->eof_frames;
+	uint64_t cycles = st->eof_cycles;
+	st->eof_frames = 0;
+	st->eof_cycles = 0;
+	portEXIT_CRITICAL(&m->swap_lock);
+
+	if (cycles)
+	{
+		refresh_rate = mp_obj_new_float((mp_float_t)frames * ets_get_cpu_frequency() * 1000000 / cycles);
+	}
+#endif
+
+	// Estimated from the frame on the display, if there is one
+	uint32_t current_ma = 0;
+	if (m->initialized)
+	{
+		stream_buffer_t *buf = shown_buffer(m);
+		uint32_t lum[3];
+		buffer_luminance(m, buf, lum);
+		current_ma = luminance_current(m, lum, buffer_brightness(m, buf));
+	}
+
+	mp_obj_t dict = mp_obj_new_dict(14);
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_update_cycles_last), update_last);
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_update_cycles_avg), update_avg);
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_frames_shown), mp_obj_new_int_from_uint(st->frames_shown));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_refresh_rate), refresh_rate);
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_missed_swaps), mp_obj_new_int_from_uint(st->missed_swaps));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_stream_bytes), mp_obj_new_int_from_uint(st->stream_bytes));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_desc_bytes), mp_obj_new_int_from_uint(st->desc_bytes));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_net_packets), mp_obj_new_int_from_uint(m->net.packets));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_net_dropped), mp_obj_new_int_from_uint(m->net.dropped));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_net_frames), mp_obj_new_int_from_uint(m->net.frames));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_play_frames), mp_obj_new_int_from_uint(m->play_shown));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_play_late), mp_obj_new_int_from_uint(m->play_late));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_current_ma), mp_obj_new_int_from_uint(current_ma));
+	mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_power_limited), mp_obj_new_int_from_uint(st->power_limited));
+	return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_stats_obj, ledmatrix_stats);
+
+/*
+ * Receive frames from the network and show them without going through python.
+ * A task of its own receives the UDP packets and converts the pixel data of every packet right away,
+ * the frame is presented when the sender marks it as complete.
+ * show and the drawing functions are not available while listening.
+ * Parameters are
+ * protocol
+ *     NET_DDP, NET_E131 or NET_NONE to stop listening.
+ *     The pixel data is RGB888, in the layout of the framebuffer of show (fb_y and fb_height apply).
+ * port, optional
+ *     UDP port, 4048 for DDP and 5568 for E1.31 by default.
+ * universe, default=1
+ *     E1.31: universe of the first pixel of the frame, every universe carries 170 pixels.
+ *     The multicast groups of the universes of the display are joined as far as lwIP allows.
+ */
+STATIC mp_obj_t ledmatrix_listen(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_protocol, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = NET_NONE} },
+		{ MP_QSTR_port, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_universe, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
 	};
 
+	matrix_t *m = get_matrix(pos_args[0]);
 	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
-	mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
 
-	matrix.width = args[5].u_int;
-	matrix.color_depth = args[6].u_int;
-	matrix.invert = args[8].u_bool;
-	matrix.double_buffer = args[9].u_bool;
-	matrix.column_swap = args[10].u_bool;
-	matrix.single_chn = args[11].u_bool;
+	play_stop(m);
+	net_stop(m);
 
-	if (matrix.width & 1)
+	mp_int_t protocol = args[0].u_int;
+	if (protocol == NET_NONE)
 	{
-		// I don't want to deal with padding for the DMA transfers...
-		mp_raise_ValueError(MP_ERROR_TEXT("width must be an even number"));
+		return mp_const_none;
+	}
+	if (protocol != NET_DDP && protocol != NET_E131)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid protocol"));
 	}
 
-	if (args[12].u_int > 0)
+	mp_int_t port = args[1].u_int;
+	if (port < 0)
 	{
-		matrix.brightness = args[12].u_int;
-		if (matrix.brightness >= matrix.width - 1)
-		{
-			mp_raise_ValueError(MP_ERROR_TEXT("Brightness must be between 0 and width - 2"));
-		}
-		matrix.brightness++;
+		port = (protocol == NET_DDP) ? NET_DDP_PORT : NET_E131_PORT;
 	}
-	else
+	if (port == 0 || port > 0xffff)
 	{
-		matrix.brightness = matrix.width - 1;
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid port"));
 	}
 
-	if (matrix.color_depth == 0)
+	mp_int_t universe = args[2].u_int;
+	if (universe < 1 || universe > NET_E131_UNIVERSE_MAX)
 	{
-		mp_raise_ValueError(MP_ERROR_TEXT("invalid value for color depth"));
+		mp_raise_ValueError(MP_ERROR_TEXT("universe must be between 1 and 63999"));
 	}
 
-	i2s_parallel_config_t cfg;
-	cfg.sample_width = I2S_PARALLEL_WIDTH_16;
+	async_wait(m, portMAX_DELAY);
 
-	for (size_t i = 0; i < MP_ARRAY_SIZE(cfg.gpios_bus); i++)
+	esp_err_t err = prepare_format(m, COLOR_RGB888);
+	if (err != ESP_OK)
 	{
-		cfg.gpios_bus[i] = -1;
+		mp_raise_OSError(err);
 	}
 
-	cfg.gpios_bus[BITSTREAM_CTRL_OE_IO] = args[2].u_int;
-	cfg.gpios_bus[BITSTREAM_CTRL_LAT_IO] = args[3].u_int;
-	cfg.gpio_clk = args[4].u_int;
-	cfg.sample_rate = args[7].u_int * 1000; // parameter is in khz
+	net_sink_init(&m->net, protocol, universe, source_line_size(m, COLOR_RGB888), m->image_height, m->fb_y, m->fb_height);
 
+	struct netconn *conn = netconn_new(NETCONN_UDP);
+	if (!conn)
+	{
+		mp_raise_OSError(MP_ENOMEM);
+	}
+	if (netconn_bind(conn, IP_ADDR_ANY, port) != ERR_OK)
+	{
+		netconn_delete(conn);
+		mp_raise_OSError(MP_EADDRINUSE);
+	}
+	netconn_set_recvtimeout(conn, NET_POLL_MS);
 
-	size_t iteridx = 0;
-	mp_obj_iter_buf_t iter_buf;
-	mp_obj_t item, iterable = mp_getiter(args[0].u_obj, &iter_buf);
-	while ((item = mp_iternext(iterable)) != MP_OBJ_STOP_ITERATION) {
-		if (iteridx >= 6)
+	if (protocol == NET_E131)
+	{
+		// Unicast always works, the number of multicast groups is limited by the lwIP configuration
+		uint32_t first = universe + m->net.frame_offset / NET_E131_UNIVERSE_BYTES;
+		uint32_t last = universe + (m->net.frame_offset + m->net.frame_size - 1) / NET_E131_UNIVERSE_BYTES;
+		for (uint32_t u = first; u <= last && u <= NET_E131_UNIVERSE_MAX; u++)
 		{
-			break;
+			ip_addr_t group;
+			IP_ADDR4(&group, 239, 255, u >> 8, u & 0xff);
+			if (netconn_join_leave_group(conn, &group, IP_ADDR_ANY, NETCONN_JOIN) != ERR_OK)
+			{
+				break;
+			}
 		}
+	}
 
-		if (!mp_obj_is_small_int(item))
-		{
-			mp_raise_TypeError(MP_ERROR_TEXT("values of io_colors must be ints"));
-		}
+	m->net_conn = conn;
+	m->net_stop = false;
+	m->net_done = xSemaphoreCreateBinary();
 
-		cfg.gpios_bus[BITSTREAM_COLOR_START_IO + iteridx] = MP_OBJ_SMALL_INT_VALUE(item);
-		iteridx++;
-	}
-	if ((matrix.single_chn && iteridx != 3) || (!matrix.single_chn && iteridx != 6))
+#if CONFIG_FREERTOS_UNICORE
+	BaseType_t core = 0;
+#else
+	// Same core as the conversion of show_async, away from micropython
+	BaseType_t core = xPortGetCoreID() ^ 1;
+#endif
+
+	if (!m->net_done || xTaskCreatePinnedToCore(net_worker, "ledmatrix_net", NET_TASK_STACK_SIZE, m, NET_TASK_PRIORITY, &m->net_task, core) != pdPASS)
 	{
-		mp_raise_ValueError(MP_ERROR_TEXT("Unexpected number of color io lines"));
+		if (m->net_done) vSemaphoreDelete(m->net_done);
+		netconn_delete(conn);
+		m->net_task = NULL;
+		m->net_done = NULL;
+		m->net_conn = NULL;
+		mp_raise_OSError(ESP_ERR_NO_MEM);
 	}
 
-	iteridx = 0;
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_listen_obj, 2, ledmatrix_listen);
 
-	iterable = mp_getiter(args[1].u_obj, &iter_buf);
-	while ((item = mp_iternext(iterable)) != MP_OBJ_STOP_ITERATION) {
-		if (iteridx >= BITSTREAM_ROWS_MAX)
-		{
-			mp_raise_ValueError(MP_ERROR_TEXT("Too many values given for io_rows"));
-		}
+/*
+ * Play an animation in the background, without any python code involved in showing the frames.
+ * A task on the other core converts every frame into the backbuffer and presents it with the refresh cycle,
+ * so garbage collection and other python code don't delay the frames.
+ * show and the drawing functions are not available while playing.
+ * Parameters are
+ * frames
+ *     List or tuple of frames, each of them like fb of show, or None to stop.
+ *     The frames are not copied, keep them alive and unchanged while playing.
+ * fps
+ *     Frames per second.
+ * loop, default=True
+ *     Start over after the last frame, otherwise the last frame stays on the display.
+ * mode, default=RGB565
+ *     Format of the frames, see show.
+ * encoding, default=ENC_NONE
+ *     Encoding of the frames, see show. With ENC_DELTA, the first frame should not skip any pixels,
+ *     so the animation doesn't depend on what was shown before.
+ */
+STATIC mp_obj_t ledmatrix_play(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_frames, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_fps, MP_ARG_OBJ, {.u_obj = mp_const_none} },
+		{ MP_QSTR_loop, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = true} },
+		{ MP_QSTR_mode, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = COLOR_RGB565} },
+		{ MP_QSTR_encoding, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = ENC_NONE} },
+	};
 
-		if (!mp_obj_is_small_int(item))
-		{
-			mp_raise_TypeError(MP_ERROR_TEXT("values of io_rows must be ints"));
-		}
+	matrix_t *m = get_matrix(pos_args[0]);
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
 
-		cfg.gpios_bus[BITSTREAM_CTRL_ROW_START_IO + iteridx] = MP_OBJ_SMALL_INT_VALUE(item);
-		iteridx++;
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	play_stop(m);
+	if (args[0].u_obj == mp_const_none)
+	{
+		return mp_const_none;
 	}
 
-	// number of 'rows' in the display
-	// For most displays, the height of the display is twice the number of 'rows' since the display is split into two halves
-	// There are some small / old versions, that only have a single channel
-	matrix.rows = 1U << iteridx;
+	net_stop(m);
 
-	if (matrix.single_chn)
+	mp_float_t fps = mp_obj_get_float(args[1].u_obj);
+	if (!(fps > 0 && fps <= 1000))
 	{
-		matrix.height = matrix.rows;
+		mp_raise_ValueError(MP_ERROR_TEXT("fps must be between 0 and 1000"));
 	}
-	else
+
+	mp_int_t format = args[3].u_int;
+	if ((format < 0 || format >= COLOR_COUNT) && format != COLOR_PLANES)
 	{
-		matrix.height = matrix.rows << 1;
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid mode"));
+	}
+	mp_int_t encoding = args[4].u_int;
+	if (encoding != ENC_NONE && encoding != ENC_RLE && encoding != ENC_DELTA)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid encoding"));
+	}
+	if (encoding != ENC_NONE && (format == COLOR_MONO || format == COLOR_PAL4 || format == COLOR_PLANES))
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("encoding requires whole bytes per pixel"));
 	}
 
-	matrix.backbuffer = 0;
-	matrix.mono_color[0] = 0xff;
-	matrix.mono_color[1] = 0xff;
-	matrix.mono_color[2] = 0xff;
-
-#ifdef DEBUG
-	printf("I2S config: io_clk=%i, rate=%i gpio:\n", cfg.gpio_clk, cfg.sample_rate);
-	for(size_t i = 0; i < 16; i++)
+	size_t count;
+	mp_obj_t *items;
+	mp_obj_get_array(args[0].u_obj, &count, &items);
+	if (!count)
 	{
-		printf("%i ", cfg.gpios_bus[i]);
+		mp_raise_ValueError(MP_ERROR_TEXT("no frames"));
 	}
-	printf("\nSize %ix%i : %i\n", matrix.width, matrix.height, matrix.color_depth);
-	printf("brightness %i\n", matrix.brightness);
-	printf("swap %i\n", matrix.column_swap);
-	printf("invert %i\n", matrix.invert);
-	printf("doublebuffer %i\n", matrix.double_buffer);
-#endif
 
-	initialize_buffer(&matrix.buffer[0]);
-	create_control_pattern(&matrix.buffer[0]);
-	if (matrix.double_buffer)
+	// Everything is checked here, the player can't raise errors
+	size_t line_size = source_line_size(m, format);
+	play_frame_t *frames = malloc(sizeof(play_frame_t) * count);
+	if (!frames)
+	{
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
+	for (size_t i = 0; i < count; i++)
 	{
-		initialize_buffer(&matrix.buffer[1]);
-		create_control_pattern(&matrix.buffer[1]);
-		matrix.backbuffer = 1;
+		mp_buffer_info_t src;
+		if (!mp_get_buffer(items[i], &src, MP_BUFFER_READ))
+		{
+			free(frames);
+			mp_raise_TypeError(MP_ERROR_TEXT("frames must be buffers"));
+		}
+
+		bool valid;
+		if (format == COLOR_PLANES)
+		{
+			valid = planes_frame_check(m, src.buf, src.len) == ESP_OK;
+			frames[i].data = (const uint8_t *)src.buf;
+		}
+		else if (encoding != ENC_NONE)
+		{
+			valid = encoded_frame_check(m, src.buf, src.len, format, encoding) == ESP_OK;
+			frames[i].data = (const uint8_t *)src.buf;
+		}
+		else
+		{
+			valid = src.len == line_size * m->fb_height;
+			frames[i].data = (const uint8_t *)src.buf + line_size * m->fb_y;
+		}
+		frames[i].length = src.len;
+
+		if (!valid)
+		{
+			free(frames);
+			mp_raise_ValueError(MP_ERROR_TEXT("invalid frame"));
+		}
 	}
 
-#ifdef DEBUG_TEST_ON_INIT
-	update_framebuffer(&matrix.buffer[0], NULL, &get_color_bits_test);
-#endif
+	async_wait(m, portMAX_DELAY);
 
-	esp_err_t err = i2s_parallel_driver_install(I2S_CHN, &cfg, matrix.invert, NULL, NULL);
+	esp_err_t err = prepare_format(m, format);
 	if (err != ESP_OK)
 	{
+		free(frames);
 		mp_raise_OSError(err);
 	}
 
-	matrix.initialized = true;
+	show_job_t *job = &m->play_job;
+	memset(job, 0, sizeof(*job));
+	job->stride = line_size;
+	job->region.x1 = m->image_width;
+	job->region.y1 = m->image_height;
+	job->format = format;
+	job->encoding = encoding;
+
+	m->play_frames = frames;
+	m->play_count = count;
+	m->play_period_us = 1000000 / fps;
+	m->play_loop = args[2].u_bool;
+	m->play_stop = false;
+	m->play_running = true;
+	m->play_done = xSemaphoreCreateBinary();
+
+#if CONFIG_FREERTOS_UNICORE
+	BaseType_t core = 0;
+#else
+	// Away from micropython, so it can't be delayed by the garbage collection
+	BaseType_t core = xPortGetCoreID() ^ 1;
+#endif
+
+	TaskHandle_t task = NULL;
+	if (!m->play_done || xTaskCreatePinnedToCore(play_worker, "ledmatrix_play", PLAY_TASK_STACK_SIZE, m, PLAY_TASK_PRIORITY, &task, core) != pdPASS)
+	{
+		if (m->play_done) vSemaphoreDelete(m->play_done);
+		free(frames);
+		m->play_done = NULL;
+		m->play_frames = NULL;
+		m->play_count = 0;
+		m->play_running = false;
+		mp_raise_OSError(ESP_ERR_NO_MEM);
+	}
 
-	start_dma();
+	portENTER_CRITICAL(&m->swap_lock);
+	m->play_task = task;
+	portEXIT_CRITICAL(&m->swap_lock);
 
 	return mp_const_none;
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_init_obj, 0, ledmatrix_init);
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_play_obj, 2, ledmatrix_play);
 
+/*
+ * Returns True while an animation started by play is running.
+ */
+STATIC mp_obj_t ledmatrix_playing(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	return mp_obj_new_bool(m->play_task && m->play_running);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_playing_obj, ledmatrix_playing);
 
 /*
- * Set the global brightness
- * Value must be between 0 (off) and width - 2 (max)
+ * Set a function that is called after every refresh cycle.
+ * The function is run through the micropython scheduler and gets the number of
+ * completed refresh cycles as argument. Cycles are skipped if the scheduler is busy.
+ * The driver does not keep the function alive, a reference must be kept by the caller.
+ * None removes the callback.
  */
-STATIC mp_obj_t ledmatrix_set_brightness(mp_obj_t b)
+STATIC mp_obj_t ledmatrix_vsync_callback(mp_obj_t self, mp_obj_t cb)
 {
-	if (!matrix.initialized)
+	matrix_t *m = get_matrix(self);
+	if (!m->initialized)
 		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
-	if (!mp_obj_is_small_int(b))
-		mp_raise_TypeError(MP_ERROR_TEXT("expected small int"));
 
-	int newb = MP_OBJ_SMALL_INT_VALUE(b);
+	if (cb == mp_const_none)
+	{
+		m->vsync_callback = MP_OBJ_NULL;
+	}
+	else if (mp_obj_is_callable(cb))
+	{
+		m->vsync_callback = cb;
+	}
+	else
+	{
+		mp_raise_TypeError(MP_ERROR_TEXT("callback must be callable or None"));
+	}
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(ledmatrix_vsync_callback_obj, ledmatrix_vsync_callback);
+
+/*
+ * Blank the screen and stop the data output to the display.
+ * Buffers are kept and can be changed while the display is off.
+ */
+STATIC mp_obj_t ledmatrix_stop(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	async_wait(m, portMAX_DELAY);
+	stop_dma(m);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_stop_obj, ledmatrix_stop);
+
+/*
+ * Resume outputting data to the display.
+ */
+STATIC mp_obj_t ledmatrix_resume(mp_obj_t self)
+{
+	matrix_t *m = get_matrix(self);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	async_wait(m, portMAX_DELAY);
+	start_dma(m);
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_resume_obj, ledmatrix_resume);
+
+/*
+ * Refresh rate and memory of the display for every color depth, the same numbers init uses for target_fps
+ * Parameters are
+ * clock_speed_khz, default=the current clock
+ * bam_planes, default=the current value
+ *     Lowered to color_depth - 1 for smaller color depths.
+ * target_fps, optional
+ *     Adds the clock required for this refresh rate.
+ * Returns a tuple of dicts for the color depths 1 to 8 with
+ * color_depth, bam_planes
+ * fps: refresh rate at the clock
+ * desc_count: DMA descriptors per buffer
+ * stream_bytes, desc_bytes: memory of all buffers
+ * fits: True if the buffers fit into the heap, counting the current ones as free
+ * clock_khz: only with target_fps, the clock required for it
+ */
+STATIC mp_obj_t ledmatrix_plan(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	matrix_t *m = get_matrix(pos_args[0]);
+	if (!m->initialized)
+		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+
+	static const mp_arg_t allowed_args[] = {
+		{ MP_QSTR_clock_speed_khz, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_bam_planes, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_target_fps, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+	};
 
-	if (newb < 0 || newb >= matrix.width - 1)
-		mp_raise_ValueError(MP_ERROR_TEXT("Brightness must be between 0 and width - 2"));
+	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
 
-	matrix.brightness = newb + 1;
+	uint32_t rate = (args[0].u_int > 0) ? args[0].u_int * 1000 : matrix_objs[m->port].output_cfg.sample_rate;
+	mp_int_t bam = (args[1].u_int < 0) ? m->bam_planes : args[1].u_int;
+	mp_int_t target_fps = args[2].u_int;
+	if (bam >= COLOR_DEPTH_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("bam_planes must be less than color_depth"));
+	}
 
-	// This somewhat bypasses the double buffer feature,
-	// but the global brightness control is not really intended to be used frequent
-	// Also, it won't induce any tearing etc...
-	create_control_pattern(&matrix.buffer[0]);
-	if (matrix.double_buffer)
+	mp_obj_t plans[COLOR_DEPTH_MAX];
+	for (uint8_t depth = 1; depth <= COLOR_DEPTH_MAX; depth++)
 	{
-		create_control_pattern(&matrix.buffer[1]);
+		refresh_plan_t plan;
+		plan_depth(m, depth, (bam < depth) ? bam : depth - 1, &plan);
+
+		mp_obj_t dict = mp_obj_new_dict(8);
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_color_depth), MP_OBJ_NEW_SMALL_INT(plan.color_depth));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_bam_planes), MP_OBJ_NEW_SMALL_INT(plan.bam_planes));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_fps), mp_obj_new_float((mp_float_t)rate / plan.cycle_samples));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_desc_count), mp_obj_new_int_from_uint(plan.desc_count));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_stream_bytes), mp_obj_new_int_from_uint(plan.stream_bytes));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_desc_bytes), mp_obj_new_int_from_uint(plan.desc_bytes));
+		mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_fits), mp_obj_new_bool(plan_fits(m, &plan)));
+		if (target_fps > 0)
+		{
+			uint32_t khz = ((uint64_t)target_fps * plan.cycle_samples + 999) / 1000;
+			mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_clock_khz), mp_obj_new_int_from_uint(khz));
+		}
+		plans[depth - 1] = dict;
 	}
-	return mp_const_none;
+	return mp_obj_new_tuple(COLOR_DEPTH_MAX, plans);
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_set_brightness_obj, ledmatrix_set_brightness);
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_plan_obj, 1, ledmatrix_plan);
 
 /*
- * Update the internal framebuffer from the specified data
+ * Change the color depth, the clock or the brightness of the running display, without init.
  * Parameters are
- * fb
- *     Framebuffer
- *     The format must be one of the following:
- *         RGB565
- *         GS8
- *         MONO_HLSB
- * mode, default=RGB565
- *    Format of the framebuffer, values are the COLOR_* constants
- *    Must be matching the format of the specified framebuffer
- * mono_color, optional
- *     Color to use for monochrome images.
+ * color_depth, bam_planes, clock_speed_khz, brightness, optional
+ *     Same as for init, each one keeps its value if not given.
+ *     bam_planes is lowered to color_depth - 1 if the new color depth is too small for it.
+ * The image stays on the display. With less color depth, the planes of the dropped low bits are freed and the
+ * rest is used as is. With more, new planes are allocated and stay dark until the next image is shown.
+ * The descriptor rings are rebuilt in place, except when they have to grow. The output stops for a moment if the
+ * color depth or bam_planes change, a new clock applies on the fly with the next refresh cycle,
+ * or is not changed if it can't be reached. Otherwise, nothing is changed on an error.
  */
-STATIC mp_obj_t ledmatrix_show(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
-	if (!matrix.initialized)
+STATIC mp_obj_t ledmatrix_reconfigure(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+	matrix_t *m = get_matrix(pos_args[0]);
+	if (!m->initialized)
 		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
+	background_check(m);
 
 	static const mp_arg_t allowed_args[] = {
-		{ MP_QSTR_fb, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_int = 0} },
-		{ MP_QSTR_mono_color, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
-		{ MP_QSTR_mode, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = COLOR_RGB565} },
+		{ MP_QSTR_color_depth, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_bam_planes, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_clock_speed_khz, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+		{ MP_QSTR_brightness, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
 	};
 
 	mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
-	mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+	mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
 
-	mp_buffer_info_t src;
-	mp_get_buffer_raise(args[0].u_obj, &src, MP_BUFFER_READ);
-
-	int color = args[1].u_int;
-	if (color >= 0)
+	mp_int_t depth = (args[0].u_int < 0) ? m->color_depth : args[0].u_int;
+	if (depth == 0 || depth > COLOR_DEPTH_MAX)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("invalid value for color depth"));
+	}
+	mp_int_t bam = args[1].u_int;
+	if (bam < 0)
 	{
-		matrix.mono_color[0] = (color >> 16) & 0xff;
-		matrix.mono_color[1] = (color >> 8) & 0xff;
-		matrix.mono_color[2] = color & 0xff;
+		bam = (m->bam_planes < depth) ? m->bam_planes : depth - 1;
+	}
+	if (bam >= depth)
+	{
+		mp_raise_ValueError(MP_ERROR_TEXT("bam_planes must be less than color_depth"));
+	}
+	if (args[3].u_int >= 0)
+	{
+		check_brightness(m, args[3].u_int);
 	}
 
-	stream_buffer_t *strm = &matrix.buffer[matrix.backbuffer];
+	output_config_t *cfg = &matrix_objs[m->port].output_cfg;
+	uint32_t old_rate = cfg->sample_rate;
+	uint32_t rate = (args[2].u_int < 0) ? old_rate : args[2].u_int * 1000;
+	bool planes_changed = depth != m->color_depth || bam != m->bam_planes;
+	bool restart = planes_changed && m->running;
 
-	switch (args[2].u_int)
+	async_wait(m, portMAX_DELAY);
+	if (restart)
 	{
-		case COLOR_RGB565:
-			if (src.len != matrix.width * matrix.height * 2)
-			{
-				mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
-			}
-			update_framebuffer(strm, (uint8_t*)src.buf, &get_color_bits_rgb);
-			break;
-		case COLOR_GS8:
-			if (src.len != matrix.width * matrix.height)
-			{
-				mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
-			}
-			update_framebuffer(strm, (uint8_t*)src.buf, &get_color_bits_gs8);
-			break;
-		case COLOR_MONO:
-			if (src.len != (((matrix.width - 1) / 8) + 1) * matrix.height)
-			{
-				mp_raise_ValueError(MP_ERROR_TEXT("Unexpected buffer size"));
-			}
-			update_framebuffer(strm, (uint8_t*)src.buf, &get_color_bits_mono_hlsb);
-			break;
+		stop_dma(m);
 	}
 
-	if (matrix.double_buffer)
+	esp_err_t err = ESP_OK;
+	if (planes_changed)
+	{
+		err = matrix_set_depth(m, depth, bam);
+	}
+	if (err == ESP_OK && rate != old_rate)
 	{
-		// Close loop for new frontbuffer and redirect running DMA transaction
-		matrix.buffer[0].dma_desc[matrix.dma_desc_count - 1].qe.stqe_next = &matrix.buffer[matrix.backbuffer].dma_desc[0];
-		matrix.buffer[1].dma_desc[matrix.dma_desc_count - 1].qe.stqe_next = &matrix.buffer[matrix.backbuffer].dma_desc[0];
-		matrix.backbuffer ^= 1;
+		// On an error, the old clock stays, the color depth was fine and stays as well
+		err = output_set_rate(m, old_rate, rate);
+		if (err == ESP_OK)
+		{
+			cfg->sample_rate = rate;
+		}
 	}
+	set_refresh_time(m, cfg->sample_rate);
 
-	return mp_const_none;
-}
-STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_show_obj, 1, ledmatrix_show);
+	if (restart)
+	{
+		start_dma(m);
+	}
+	if (err != ESP_OK)
+	{
+		mp_raise_OSError(err);
+	}
 
-/*
- * Blank the screen and stop the data output to the display.
- * Buffers are kept and can be changed while the display is off.
- */
-STATIC mp_obj_t ledmatrix_stop()
-{
-	if (!matrix.initialized)
-		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
-	stop_dma();
+	if (args[3].u_int >= 0)
+	{
+		ledmatrix_set_brightness(pos_args[0], MP_OBJ_NEW_SMALL_INT(args[3].u_int));
+	}
 	return mp_const_none;
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_0(ledmatrix_stop_obj, ledmatrix_stop);
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_reconfigure_obj, 1, ledmatrix_reconfigure);
 
 /*
- * Resume outputting data to the display.
+ * Turn off the screen and deinitialize the display driver. All buffers are freed.
  */
-STATIC mp_obj_t ledmatrix_resume()
+STATIC mp_obj_t ledmatrix_deinitialize(mp_obj_t self)
 {
-	if (!matrix.initialized)
-		mp_raise_ValueError(MP_ERROR_TEXT("ledmatrix not initialized"));
-	start_dma();
+	matrix_t *m = get_matrix(self);
+	deinit(m);
 	return mp_const_none;
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_0(ledmatrix_resume_obj, ledmatrix_resume);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(ledmatrix_deinitialize_obj, ledmatrix_deinitialize);
+
+STATIC const mp_rom_map_elem_t ledmatrix_matrix_locals_table[] = {
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_brightness), (mp_obj_t)&ledmatrix_set_brightness_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fade), (mp_obj_t)&ledmatrix_fade_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fading), (mp_obj_t)&ledmatrix_fading_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_power_limit), (mp_obj_t)&ledmatrix_set_power_limit_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_gamma), (mp_obj_t)&ledmatrix_set_gamma_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_lut), (mp_obj_t)&ledmatrix_set_lut_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_palette), (mp_obj_t)&ledmatrix_set_palette_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_show), (mp_obj_t)&ledmatrix_show_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_show_async), (mp_obj_t)&ledmatrix_show_async_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_busy), (mp_obj_t)&ledmatrix_busy_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_wait), (mp_obj_t)&ledmatrix_wait_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_pixel), (mp_obj_t)&ledmatrix_pixel_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fill_rect), (mp_obj_t)&ledmatrix_fill_rect_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_hline), (mp_obj_t)&ledmatrix_hline_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_vline), (mp_obj_t)&ledmatrix_vline_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_blit), (mp_obj_t)&ledmatrix_blit_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_scroll), (mp_obj_t)&ledmatrix_scroll_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_present), (mp_obj_t)&ledmatrix_present_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_wait_vsync), (mp_obj_t)&ledmatrix_wait_vsync_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_stats), (mp_obj_t)&ledmatrix_stats_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_vsync_callback), (mp_obj_t)&ledmatrix_vsync_callback_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_listen), (mp_obj_t)&ledmatrix_listen_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_play), (mp_obj_t)&ledmatrix_play_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_playing), (mp_obj_t)&ledmatrix_playing_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_stop), (mp_obj_t)&ledmatrix_stop_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_resume), (mp_obj_t)&ledmatrix_resume_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_reconfigure), (mp_obj_t)&ledmatrix_reconfigure_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_plan), (mp_obj_t)&ledmatrix_plan_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_deinitialize), (mp_obj_t)&ledmatrix_deinitialize_obj },
+};
+
+STATIC MP_DEFINE_CONST_DICT(ledmatrix_matrix_locals, ledmatrix_matrix_locals_table);
+
+const mp_obj_type_t ledmatrix_matrix_type = {
+		{ &mp_type_type },
+		.name = MP_QSTR_Matrix,
+		.make_new = ledmatrix_matrix_make_new,
+		.locals_dict = (mp_obj_dict_t*)&ledmatrix_matrix_locals,
+};
+
+// Upper limit for the number of arguments of the module level functions, blit has the most
+#define MODULE_FUN_ARGS_MAX 16
 
 /*
- * Turn off the screen and deinitialize the display driver. All buffers are freed.
+ * Calls a method of the display with the given arguments.
+ * This implements the module level functions, which are kept for the single display setup.
  */
-STATIC mp_obj_t ledmatrix_deinitialize()
+static mp_obj_t call_default(mp_obj_t method, size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
 {
-	deinit();
-	return mp_const_none;
+	size_t n_kw = kw_args ? kw_args->used : 0;
+	if (1 + n_args + 2 * n_kw > MODULE_FUN_ARGS_MAX)
+	{
+		mp_raise_TypeError(MP_ERROR_TEXT("too many arguments"));
+	}
+
+	mp_obj_t args[MODULE_FUN_ARGS_MAX];
+	args[0] = MP_OBJ_FROM_PTR(default_matrix);
+	memcpy(&args[1], pos_args, n_args * sizeof(mp_obj_t));
+
+	mp_obj_t *kw = &args[1 + n_args];
+	for (size_t i = 0; n_kw && i < kw_args->alloc; i++)
+	{
+		if (mp_map_slot_is_filled(kw_args, i))
+		{
+			*kw++ = kw_args->table[i].key;
+			*kw++ = kw_args->table[i].value;
+		}
+	}
+
+	return mp_call_function_n_kw(method, 1 + n_args, n_kw, args);
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_0(ledmatrix_deinitialize_obj, ledmatrix_deinitialize);
+
+#define MODULE_FUN(name) \
+	STATIC mp_obj_t ledmatrix_##name##_module(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) \
+	{ \
+		return call_default(MP_OBJ_FROM_PTR(&ledmatrix_##name##_obj), n_args, pos_args, kw_args); \
+	} \
+	STATIC MP_DEFINE_CONST_FUN_OBJ_KW(ledmatrix_##name##_module_obj, 0, ledmatrix_##name##_module);
+
+MODULE_FUN(set_brightness)
+MODULE_FUN(fade)
+MODULE_FUN(fading)
+MODULE_FUN(set_power_limit)
+MODULE_FUN(set_gamma)
+MODULE_FUN(set_lut)
+MODULE_FUN(set_palette)
+MODULE_FUN(show)
+MODULE_FUN(show_async)
+MODULE_FUN(busy)
+MODULE_FUN(wait)
+MODULE_FUN(pixel)
+MODULE_FUN(fill_rect)
+MODULE_FUN(hline)
+MODULE_FUN(vline)
+MODULE_FUN(blit)
+MODULE_FUN(scroll)
+MODULE_FUN(present)
+MODULE_FUN(wait_vsync)
+MODULE_FUN(stats)
+MODULE_FUN(vsync_callback)
+MODULE_FUN(listen)
+MODULE_FUN(play)
+MODULE_FUN(playing)
+MODULE_FUN(stop)
+MODULE_FUN(resume)
+MODULE_FUN(reconfigure)
+MODULE_FUN(plan)
+MODULE_FUN(deinitialize)
 
 STATIC const mp_rom_map_elem_t ledmatrix_module_globals_table[] = {
 		{ MP_OBJ_NEW_QSTR(MP_QSTR___name__), MP_OBJ_NEW_QSTR(MP_QSTR_ledmatrix) },
 		{ MP_OBJ_NEW_QSTR(MP_QSTR_init), (mp_obj_t)&ledmatrix_init_obj },
-		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_brightness), (mp_obj_t)&ledmatrix_set_brightness_obj },
-		{ MP_OBJ_NEW_QSTR(MP_QSTR_show), (mp_obj_t)&ledmatrix_show_obj },
-		{ MP_OBJ_NEW_QSTR(MP_QSTR_stop), (mp_obj_t)&ledmatrix_stop_obj },
-		{ MP_OBJ_NEW_QSTR(MP_QSTR_resume), (mp_obj_t)&ledmatrix_resume_obj },
-		{ MP_OBJ_NEW_QSTR(MP_QSTR_deinitialize), (mp_obj_t)&ledmatrix_deinitialize_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_Matrix), (mp_obj_t)&ledmatrix_matrix_type },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_brightness), (mp_obj_t)&ledmatrix_set_brightness_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fade), (mp_obj_t)&ledmatrix_fade_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fading), (mp_obj_t)&ledmatrix_fading_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_power_limit), (mp_obj_t)&ledmatrix_set_power_limit_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_gamma), (mp_obj_t)&ledmatrix_set_gamma_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_lut), (mp_obj_t)&ledmatrix_set_lut_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_set_palette), (mp_obj_t)&ledmatrix_set_palette_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_show), (mp_obj_t)&ledmatrix_show_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_show_async), (mp_obj_t)&ledmatrix_show_async_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_busy), (mp_obj_t)&ledmatrix_busy_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_wait), (mp_obj_t)&ledmatrix_wait_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_pixel), (mp_obj_t)&ledmatrix_pixel_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_fill_rect), (mp_obj_t)&ledmatrix_fill_rect_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_hline), (mp_obj_t)&ledmatrix_hline_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_vline), (mp_obj_t)&ledmatrix_vline_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_blit), (mp_obj_t)&ledmatrix_blit_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_scroll), (mp_obj_t)&ledmatrix_scroll_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_present), (mp_obj_t)&ledmatrix_present_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_wait_vsync), (mp_obj_t)&ledmatrix_wait_vsync_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_stats), (mp_obj_t)&ledmatrix_stats_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_vsync_callback), (mp_obj_t)&ledmatrix_vsync_callback_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_listen), (mp_obj_t)&ledmatrix_listen_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_play), (mp_obj_t)&ledmatrix_play_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_playing), (mp_obj_t)&ledmatrix_playing_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_stop), (mp_obj_t)&ledmatrix_stop_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_resume), (mp_obj_t)&ledmatrix_resume_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_reconfigure), (mp_obj_t)&ledmatrix_reconfigure_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_plan), (mp_obj_t)&ledmatrix_plan_module_obj },
+		{ MP_OBJ_NEW_QSTR(MP_QSTR_deinitialize), (mp_obj_t)&ledmatrix_deinitialize_module_obj },
 		{ MP_ROM_QSTR(MP_QSTR_FB_RGB565), MP_ROM_INT(COLOR_RGB565) },
 		{ MP_ROM_QSTR(MP_QSTR_FB_GS8), MP_ROM_INT(COLOR_GS8) },
 		{ MP_ROM_QSTR(MP_QSTR_FB_MONO), MP_ROM_INT(COLOR_MONO) },
+		{ MP_ROM_QSTR(MP_QSTR_FB_RGB888), MP_ROM_INT(COLOR_RGB888) },
+		{ MP_ROM_QSTR(MP_QSTR_FB_RGB444), MP_ROM_INT(COLOR_RGB444) },
+		{ MP_ROM_QSTR(MP_QSTR_FB_PAL8), MP_ROM_INT(COLOR_PAL8) },
+		{ MP_ROM_QSTR(MP_QSTR_FB_PAL4), MP_ROM_INT(COLOR_PAL4) },
+		{ MP_ROM_QSTR(MP_QSTR_FB_PLANES), MP_ROM_INT(COLOR_PLANES) },
+		{ MP_ROM_QSTR(MP_QSTR_ENC_NONE), MP_ROM_INT(ENC_NONE) },
+		{ MP_ROM_QSTR(MP_QSTR_ENC_RLE), MP_ROM_INT(ENC_RLE) },
+		{ MP_ROM_QSTR(MP_QSTR_ENC_DELTA), MP_ROM_INT(ENC_DELTA) },
+		{ MP_ROM_QSTR(MP_QSTR_DITHER_NONE), MP_ROM_INT(DITHER_NONE) },
+		{ MP_ROM_QSTR(MP_QSTR_DITHER_ORDERED), MP_ROM_INT(DITHER_ORDERED) },
+		{ MP_ROM_QSTR(MP_QSTR_DITHER_TEMPORAL), MP_ROM_INT(DITHER_TEMPORAL) },
+		{ MP_ROM_QSTR(MP_QSTR_GAMMA_CIE), MP_ROM_INT(GAMMA_CIE) },
+		{ MP_ROM_QSTR(MP_QSTR_NET_NONE), MP_ROM_INT(NET_NONE) },
+		{ MP_ROM_QSTR(MP_QSTR_NET_DDP), MP_ROM_INT(NET_DDP) },
+		{ MP_ROM_QSTR(MP_QSTR_NET_E131), MP_ROM_INT(NET_E131) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(ledmatrix_module_globals, ledmatrix_module_globals_table);
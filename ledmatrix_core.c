@@ -0,0 +1,2372 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_heap_caps.h>
+#include <xtensa/hal.h>
+
+#include "ledmatrix_core.h"
+
+typedef void (*update_func_t)(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, const update_window_t *win);
+
+/*
+ * Last pixel of a row with the output enabled for the given brightness.
+ * Planes that are output only once get a shorter on time to keep the binary weighting
+ */
+static inline uint16_t IRAM_ATTR plane_last_on(matrix_t *m, uint8_t lvl, uint16_t brightness)
+{
+	if (lvl < m->bam_planes)
+	{
+		uint32_t on = (uint32_t)(brightness - 1) << lvl;
+		return 1 + ((on + (1 << (m->bam_planes - 1))) >> m->bam_planes);
+	}
+	return brightness;
+}
+
+/*
+ * Writes changes of the stream back from the cache, so the DMA sees them.
+ * Only required for planes in PSRAM, the internal memory is not cached.
+ */
+static inline void IRAM_ATTR stream_writeback(matrix_t *m, const void *ptr, size_t size)
+{
+#if CONFIG_IDF_TARGET_ESP32S3
+	if (m->ext_mem)
+	{
+		Cache_WriteBack_Addr((uint32_t)ptr, size);
+	}
+#else
+	(void)m;
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+/*
+ * Moves the output enable cutoff of line (a row of a plane) of a buffer from brightness old_b to new_b.
+ * Only the control bytes of the pixels between the old and the new cutoff change, everything else stays as is.
+ * Returns the number of bytes changed.
+ */
+static uint32_t IRAM_ATTR oe_line_update(matrix_t *m, stream_buffer_t *buf, uint16_t line, uint16_t old_b, uint16_t new_b)
+{
+	bool narrow = m->sample_size == 1;
+	uint8_t oe = 1 << (narrow ? BITSTREAM8_OE_BIT : BITSTREAM_CTRL_OE_BIT);
+	uint8_t lvl = line / m->rows;
+	uint8_t row = line % m->rows;
+
+	uint16_t old_last = plane_last_on(m, lvl, old_b);
+	uint16_t new_last = plane_last_on(m, lvl, new_b);
+
+	// Pixels first to last change, the first two always stay blanked
+	uint16_t first = ((old_last < new_last) ? old_last : new_last) + 1;
+	uint16_t last = (old_last < new_last) ? new_last : old_last;
+	if (first < 2) first = 2;
+	if (last > m->width - 1) last = m->width - 1;
+	if (first > last)
+	{
+		return 0;
+	}
+
+	// OE is active low, so the bit is set if the pixels are now beyond the cutoff
+	bool set = new_last < old_last;
+	if (m->invert) set = !set;
+
+	uint8_t *r = buf->planes[lvl] + m->sample_size * m->width * row + (narrow ? 0 : BITSTREAM_CTRL_BYTE);
+	for (uint16_t pixel = first; pixel <= last; pixel++)
+	{
+		uint8_t *ctrl = r + m->sample_size * pixel;
+		*ctrl = set ? (*ctrl | oe) : (*ctrl & ~oe);
+	}
+	stream_writeback(m, r + m->sample_size * first, m->sample_size * (last + 1 - first));
+	return last + 1 - first;
+}
+
+/*
+ * Brightness the output enable pattern of a buffer should have: the global one, within the power cap of its frame.
+ */
+uint16_t IRAM_ATTR buffer_brightness(const matrix_t *m, const stream_buffer_t *buf)
+{
+	return (m->brightness < buf->power_cap) ? m->brightness : buf->power_cap;
+}
+
+/*
+ * Moves the output enable cutoff of a buffer toward brightness b, one line at a time, until about budget control
+ * bytes are changed. A move that was started goes on to its own target first, so b may change in between.
+ * Every call makes progress, budget is lowered by the bytes changed. Returns true once the pattern is at b.
+ * The caller must own the buffer: the EOF interrupt for the displayed ones, the converting task for the backbuffer.
+ */
+bool IRAM_ATTR buffer_move_brightness(matrix_t *m, stream_buffer_t *buf, uint16_t b, uint32_t *budget)
+{
+	uint16_t lines = m->color_depth * m->rows;
+	for (;;)
+	{
+		if (buf->brightness == buf->brightness_to)
+		{
+			if (buf->brightness == b)
+			{
+				return true;
+			}
+			buf->brightness_to = b;
+			buf->oe_line = 0;
+		}
+
+		while (buf->oe_line < lines)
+		{
+			if (!*budget)
+			{
+				return false;
+			}
+			// A line without changes still counts, so the budget also bounds the number of lines
+			uint32_t n = 1 + oe_line_update(m, buf, buf->oe_line, buf->brightness, buf->brightness_to);
+			*budget = (n < *budget) ? *budget - n : 0;
+			buf->oe_line++;
+		}
+		buf->brightness = buf->brightness_to;
+	}
+}
+
+/*
+ * Moves the output enable cutoff of a buffer to brightness b at once, see buffer_move_brightness.
+ */
+void IRAM_ATTR buffer_set_brightness(matrix_t *m, stream_buffer_t *buf, uint16_t b)
+{
+	uint32_t budget = UINT32_MAX;
+	buffer_move_brightness(m, buf, b, &budget);
+}
+
+/*
+ * Advances a running fade by one refresh cycle.
+ * Must be called with swap_lock held.
+ */
+void IRAM_ATTR fade_step(matrix_t *m)
+{
+	m->fade_frame++;
+	int32_t delta = (int32_t)m->fade_to - m->fade_from;
+	uint16_t b = m->fade_from + ((int64_t)delta * m->fade_frame) / m->fade_frames;
+	if (m->fade_frame >= m->fade_frames)
+	{
+		b = m->fade_to;
+		m->fade_frames = 0;
+	}
+	m->brightness = b;
+}
+
+/*
+ * Number of times a plane is output per refresh cycle
+ */
+size_t plane_repeats(matrix_t *m, uint8_t lvl)
+{
+	if (lvl < m->bam_planes)
+	{
+		return 1;
+	}
+	return 1 << (lvl - m->bam_planes);
+}
+
+/*
+ * Number of subimages output per refresh cycle
+ */
+size_t subimage_count(matrix_t *m)
+{
+	return ((1 << (m->color_depth - m->bam_planes)) - 1) + m->bam_planes;
+}
+
+/*
+ * Largest block of a single descriptor.
+ * With the 8 bit bus, every row is a descriptor of its own, so the EOF interrupt can switch the row lines.
+ * Blocks in PSRAM must also end on a block of the external memory, the init parameters make sure the rows do.
+ */
+static size_t dma_max_block(matrix_t *m)
+{
+	size_t max_block = (m->sample_size == 1) ? m->width : DMA_MAX_XFER_SIZE;
+	if (m->ext_mem && m->sample_size != 1)
+	{
+		max_block &= ~(DMA_EXT_MEM_ALIGN - 1);
+	}
+	return max_block;
+}
+
+/*
+ * Number of descriptors of a ring for the given color depth and BAM planes.
+ */
+static size_t ring_length(matrix_t *m, uint8_t depth, uint8_t bam)
+{
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	size_t dma_entries_per_subimage = ((subimage_stride - 1) / dma_max_block(m)) + 1;
+	return (((1 << (depth - bam)) - 1) + bam) * dma_entries_per_subimage;
+}
+
+/*
+ * Refresh cycle and memory of all buffers for the given color depth and BAM planes, with the same math as
+ * initialize_buffer. Only the geometry, the bus width, ext_mem and buffer_count of the display are used.
+ */
+void plan_depth(matrix_t *m, uint8_t depth, uint8_t bam, refresh_plan_t *plan)
+{
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	plan->color_depth = depth;
+	plan->bam_planes = bam;
+	plan->subimages = ((1 << (depth - bam)) - 1) + bam;
+	plan->cycle_samples = (uint32_t)m->width * m->rows * plan->subimages;
+	plan->desc_count = ring_length(m, depth, bam);
+	plan->stream_bytes = subimage_stride * depth * m->buffer_count;
+	plan->desc_bytes = plan->desc_count * sizeof(lldesc_t) * m->buffer_count;
+	plan->plane_bytes = subimage_stride;
+}
+
+/*
+ * Allocates one plane of a buffer, filled with the color bits off and without a control pattern.
+ */
+static uint8_t *alloc_plane(matrix_t *m)
+{
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	uint8_t *plane;
+	if (m->ext_mem)
+	{
+		plane = heap_caps_aligned_alloc(DMA_EXT_MEM_ALIGN, subimage_stride, MALLOC_CAP_SPIRAM);
+	}
+	else
+	{
+		plane = heap_caps_malloc(subimage_stride, MALLOC_CAP_DMA);
+	}
+	if (plane)
+	{
+		memset(plane, m->invert ? 0xff : 0, subimage_stride);
+	}
+	return plane;
+}
+
+/*
+ * Fills the descriptor ring of a buffer for the current color depth, the descriptors must be allocated.
+ */
+static void build_ring(matrix_t *m, stream_buffer_t *buf)
+{
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	size_t max_block = dma_max_block(m);
+	size_t dma_entries_per_subimage = ((subimage_stride - 1) / max_block) + 1;
+
+	memset(buf->dma_desc, 0, m->dma_desc_count * sizeof(buf->dma_desc[0]));
+
+
+	/*
+	 * Spread the subimages evenly across the buffer to avoid flickering at lower framerates
+	 * so instead of
+	 * 1 2 2 3 3 3 3 4 4 4 4 4 4 4 4
+	 * we want something like
+	 * 4 2 4 3 4 3 1 4 2 4 3 4 3 4 4
+
+	 * We first fill all but the last level.
+	 * All remaining elements will later on be filled with the longest subimage
+	 * The whole process gets a bit more complicated, since the max dma transfer size per block is limited.
+	 * So to begin with, we just fill the first blocks. The sizes and other blocks are filled later.
+	 */
+	for (size_t i = 0; i < m->color_depth - 1; i++)
+	{
+		size_t n = plane_repeats(m, i);
+		for (size_t k = 0; k < n; k++)
+		{
+			size_t pos = (m->dma_desc_count * k) / n + (m->dma_desc_count / n / 2);
+
+			// in case we need more than one dma desc per image, we fill only the first element
+			pos /= dma_entries_per_subimage;
+			pos *= dma_entries_per_subimage;
+
+#ifdef DEBUG_DMA
+			printf("level=%u n=%u k=%u pos=%u\n", i, n, k, pos);
+#endif
+
+			// Find next free entry, wrap around if required
+			while (buf->dma_desc[pos].buf)
+			{
+				pos += dma_entries_per_subimage;
+				if (pos >= m->dma_desc_count)
+				{
+					pos = 0;
+				}
+			}
+
+			buf->dma_desc[pos].buf = buf->planes[i];
+#ifdef DEBUG_DMA
+			printf("  -> %u=%08X\n", pos, (uint32_t)buf->dma_desc[pos].buf);
+#endif
+		}
+	}
+
+	// Fill remaining elements and create links + fill common data
+	for (size_t i = 0; i < m->dma_desc_count; i++)
+	{
+		if (!buf->dma_desc[i].buf)
+		{
+			buf->dma_desc[i].buf = buf->planes[m->color_depth - 1];
+		}
+
+		size_t remaining = subimage_stride;
+		volatile uint8_t *ptr = buf->dma_desc[i].buf;
+		--i;
+		while (remaining)
+		{
+			++i;
+
+			size_t block = remaining;
+			if (block > max_block)
+			{
+				block = max_block;
+			}
+
+#ifdef DEBUG_DMA
+			printf("dma %u=%08X length=%u\n", i, (uint32_t)ptr, block);
+#endif
+			buf->dma_desc[i].buf = ptr;
+			buf->dma_desc[i].length = block;
+			buf->dma_desc[i].size = block;
+			buf->dma_desc[i].owner = 1;
+			buf->dma_desc[i].eof = m->sample_size == 1;
+			ptr += block;
+			remaining -= block;
+		}
+	}
+
+	for (size_t i = 0; i < m->dma_desc_count - 1; i++)
+	{
+		// link to next
+		buf->dma_desc[i].qe.stqe_next = &buf->dma_desc[i + 1];
+	}
+
+	//close the loop
+	buf->dma_desc[m->dma_desc_count - 1].qe.stqe_next = &buf->dma_desc[0];
+
+	// Interrupt at the end of every refresh cycle (and every row with the 8 bit bus)
+	buf->dma_desc[m->dma_desc_count - 1].eof = 1;
+}
+
+esp_err_t initialize_buffer(matrix_t *m, stream_buffer_t *buf)
+{
+	// One or two bytes per pixel
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	m->dma_desc_count = ring_length(m, m->color_depth, m->bam_planes);
+
+	// The descriptors only need to point to the right planes, so the planes don't have to be contiguous.
+	// With WiFi running, the DMA capable heap rarely has a single free block for the whole buffer.
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		buf->planes[lvl] = alloc_plane(m);
+		if (!buf->planes[lvl])
+		{
+			return ESP_ERR_NO_MEM;
+		}
+		m->stats.stream_bytes += subimage_stride;
+#ifdef DEBUG
+		printf("plane %u: %u bytes @%08X\n", lvl, subimage_stride, (uint32_t)buf->planes[lvl]);
+#endif
+	}
+
+	buf->dma_desc = heap_caps_malloc(m->dma_desc_count * sizeof(buf->dma_desc[0]), MALLOC_CAP_DMA);
+	if (!buf->dma_desc)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	m->dma_desc_alloc = m->dma_desc_count;
+	m->stats.desc_bytes += m->dma_desc_count * sizeof(buf->dma_desc[0]);
+	buf->power_cap = POWER_CAP_NONE;
+
+	buf->row_lum = malloc(m->rows * sizeof(buf->row_lum[0]));
+	if (!buf->row_lum)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	buf->lum_stale = UINT64_MAX;
+
+#ifdef DEBUG
+	printf("dma desc %u bytes @%08X\n", m->dma_desc_count * sizeof(buf->dma_desc[0]), (uint32_t)buf->dma_desc);
+#endif
+
+	build_ring(m, buf);
+	return ESP_OK;
+}
+
+
+
+/*
+ * Creates the control sequence for selecting the display lines and the latching.
+ * This also handles the global brightness setting
+ */
+void create_control_pattern(matrix_t *m, stream_buffer_t *buf)
+{
+	size_t row_stride = m->sample_size * m->width;
+	bool narrow = m->sample_size == 1;
+	uint8_t oe = 1 << (narrow ? BITSTREAM8_OE_BIT : BITSTREAM_CTRL_OE_BIT);
+	uint8_t lat = 1 << (narrow ? BITSTREAM8_LAT_BIT : BITSTREAM_CTRL_LAT_BIT);
+	buf->brightness = buffer_brightness(m, buf);
+	buf->brightness_to = buf->brightness;
+	buf->oe_line = 0;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		uint16_t last_on = plane_last_on(m, lvl, buf->brightness);
+
+		uint8_t *si = buf->planes[lvl];
+		for (uint8_t row = 0; row < m->rows; row++)
+		{
+			uint8_t *r = si + row_stride * row;
+
+			// The row lines control the currently shown row.
+			// this is always the last row as the current row is being filled with new data
+			uint8_t display_row = row - 1; // the possible underflow IS expected and desired!
+
+			for (uint16_t pixel = 0; pixel < m->width; pixel++)
+			{
+				uint8_t *px = r + m->sample_size * pixel;
+
+				// With the 8 bit bus, the row lines are switched by the EOF interrupt of the row instead
+				uint8_t ctrl = narrow ? 0 : (display_row << BITSTREAM_CTRL_ROW_START_BIT);
+
+				if (pixel < 2 || pixel > last_on)
+				{
+					// Disable the led drivers while switching rows. We also use this to control
+					// the global brightness by blanking the screen after transmitting n pixels.
+					// NOTE: The OE line is active low, BLANK would be a more suiting name...
+					ctrl |= oe;
+				}
+
+				if (pixel == m->width - 2)
+				{
+					// Latch when transmitting the last pixel
+					// NOTE: This is somewhat problematic, since we are latching while the clock is
+					//       still running and we are still loading fresh data into the shift registers.
+					//       Asserting the latch with the second last pixel (and thus having the falling edge on the last) seems to work reliable though.
+					ctrl |= lat;
+				}
+
+				if (m->invert)    ctrl = ~ctrl;
+				if (narrow)
+				{
+					px[0] = (px[0] & BITSTREAM8_COLOR_MASK) | (ctrl & BITSTREAM8_CTRL_MASK);
+				}
+				else
+				{
+					px[BITSTREAM_CTRL_BYTE] = ctrl;
+				}
+			}
+		}
+	}
+}
+
+static inline uint8_t get_rgb888_bits(uint8_t r, uint8_t g, uint8_t b, uint8_t bit)
+{
+	return (
+		((r >> (7 - bit)) & 1) |
+		(((g >> (7 - bit)) & 1) << 1) |
+		(((b >> (7 - bit)) & 1) << 2)
+		);
+}
+
+/*
+ * Cell of the dither pattern for a pixel
+ */
+static inline uint8_t dither_cell(matrix_t *m, uint16_t x, uint16_t y)
+{
+	return ((((y & 1) << 1) | (x & 1)) ^ m->dither_phase);
+}
+
+static inline uint8_t dither_channel(uint8_t v, uint8_t offset)
+{
+	uint16_t d = v + offset;
+	return d > 0xff ? 0xff : d;
+}
+
+static inline uint8_t get_dithered_bits(matrix_t *m, uint8_t r, uint8_t g, uint8_t b, uint8_t cell, uint8_t bit)
+{
+	uint8_t offset = m->dither_offset[cell];
+	return get_rgb888_bits(
+		dither_channel(m->channel_lut[0][r], offset),
+		dither_channel(m->channel_lut[1][g], offset),
+		dither_channel(m->channel_lut[2][b], offset), bit);
+}
+
+/*
+ * Stores the color bits c of a pixel.
+ * With the 8 bit bus, the colors share the byte with the control bits, which are kept as they are.
+ */
+static inline __attribute__((always_inline)) void store_color(uint8_t *px, uint8_t c, const bool narrow)
+{
+	if (narrow)
+	{
+		px[0] = (px[0] & BITSTREAM8_CTRL_MASK) | (c & BITSTREAM8_COLOR_MASK);
+	}
+	else
+	{
+		px[BITSTREAM_COLOR_BYTE] = c;
+	}
+}
+
+/*
+ * Collects the bits of all planes for one 24 bit color 0xRRGGBB in the given dither cell.
+ */
+plane_bits_t get_rgb888_plane_bits(matrix_t *m, uint32_t color, uint8_t cell)
+{
+	plane_bits_t bits = 0;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		bits |= (plane_bits_t)get_dithered_bits(m, color >> 16, color >> 8, color, cell, m->color_depth - lvl - 1) << (8 * lvl);
+	}
+	return bits;
+}
+
+/*
+ * Collects the bits of all planes for one RGB565 color.
+ * Only used to build the lookup tables, the conversion itself never extracts single bits.
+ */
+static plane_bits_t get_rgb565_plane_bits(matrix_t *m, uint16_t color, uint8_t cell)
+{
+	// expand to 3x8 bits
+	uint32_t r = (color >> 8) & 0xf8;
+	uint32_t g = (color >> 3) & 0xfc;
+	uint32_t b = (color << 3) & 0xf8;
+
+	return get_rgb888_plane_bits(m, (r << 16) | (g << 8) | b, cell);
+}
+
+/*
+ * Sets up the offsets for the ordered dithering.
+ * The 2x2 pattern adds up to 3/4 of the smallest step of the color depth.
+ */
+static void init_dither(matrix_t *m)
+{
+	static const uint8_t pattern[DITHER_CELLS] = { 0, 2, 3, 1 };
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		uint8_t offset = 0;
+		if (m->dither != DITHER_NONE)
+		{
+			offset = (pattern[cell] << (8 - m->color_depth)) >> 2;
+		}
+		m->dither_offset[cell] = offset;
+	}
+	m->dither_phase = 0;
+}
+
+static void init_rgb565_lut(matrix_t *m)
+{
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		rgb565_lut_t *lut = &m->rgb565_lut[cell];
+		for (uint16_t v = 0; v < 64; v++)
+		{
+			if (v < 32)
+			{
+				lut->r[v] = get_rgb565_plane_bits(m, v << 11, cell);
+				lut->b[v] = get_rgb565_plane_bits(m, v, cell);
+			}
+			lut->g[v] = get_rgb565_plane_bits(m, v << 5, cell);
+		}
+	}
+}
+
+/*
+ * Builds a channel correction from a gamma curve, GAMMA_CIE for the CIE 1931 lightness curve.
+ * white is the 0xRRGGBB color of full white, which scales the channels for white balance.
+ */
+void build_channel_lut(uint8_t (*lut)[256], float gamma, uint32_t white)
+{
+	for (uint8_t c = 0; c < 3; c++)
+	{
+		float scale = (white >> (16 - 8 * c)) & 0xff;
+		for (uint16_t v = 0; v < 256; v++)
+		{
+			float y;
+			if (gamma == GAMMA_CIE)
+			{
+				float l = v * 100.0f / 255.0f;
+				y = (l <= 8.0f) ? l / 903.3f : powf((l + 16.0f) / 116.0f, 3.0f);
+			}
+			else
+			{
+				y = powf(v / 255.0f, gamma);
+			}
+			lut[c][v] = (uint8_t)(y * scale + 0.5f);
+		}
+	}
+}
+
+/*
+ * Sets the channel correction of the display, see build_channel_lut.
+ */
+void init_channel_lut(matrix_t *m, float gamma, uint32_t white)
+{
+	build_channel_lut(m->channel_lut, gamma, white);
+}
+
+/*
+ * Makes sure the index_lut matches the current mono color for GS8 images.
+ * Building the table takes a moment, so it is only done when the color changes.
+ */
+static void update_index_lut_gs8(matrix_t *m)
+{
+	uint32_t mono = (m->mono_color[0] << 16) | (m->mono_color[1] << 8) | m->mono_color[2];
+	if (m->index_lut_color == mono)
+	{
+		return;
+	}
+
+	for (uint16_t v = 0; v < INDEX_LUT_SIZE; v++)
+	{
+		uint32_t color =
+			(((v * m->mono_color[0]) / 255) << 16) |
+			(((v * m->mono_color[1]) / 255) << 8) |
+			((v * m->mono_color[2]) / 255);
+		for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+		{
+			m->index_lut[cell * INDEX_LUT_SIZE + v] = get_rgb888_plane_bits(m, color, cell);
+		}
+	}
+	m->index_lut_color = mono;
+}
+
+/*
+ * Makes sure the index_lut holds the palette.
+ */
+static void update_index_lut_palette(matrix_t *m)
+{
+	if (m->index_lut_color == INDEX_LUT_PALETTE)
+	{
+		return;
+	}
+
+	for (uint16_t v = 0; v < INDEX_LUT_SIZE; v++)
+	{
+		for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+		{
+			m->index_lut[cell * INDEX_LUT_SIZE + v] = get_rgb888_plane_bits(m, m->palette[v], cell);
+		}
+	}
+	m->index_lut_color = INDEX_LUT_PALETTE;
+}
+
+static void init_rgb444_lut(matrix_t *m)
+{
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		rgb444_lut_t *lut = &m->rgb444_lut[cell];
+		for (uint8_t v = 0; v < 16; v++)
+		{
+			// Replicate the bits, so 0xf is full intensity
+			uint32_t c = (v << 4) | v;
+			lut->r[v] = get_rgb888_plane_bits(m, c << 16, cell);
+			lut->g[v] = get_rgb888_plane_bits(m, c << 8, cell);
+			lut->b[v] = get_rgb888_plane_bits(m, c, cell);
+		}
+	}
+}
+
+/*
+ * Makes sure the RGB888 tables exist and match the current channel correction.
+ */
+static esp_err_t update_rgb888_lut(matrix_t *m)
+{
+	if (!m->rgb888_lut)
+	{
+		m->rgb888_lut = malloc(sizeof(rgb888_lut_t) * DITHER_CELLS);
+		if (!m->rgb888_lut)
+		{
+			return ESP_ERR_NO_MEM;
+		}
+		m->rgb888_lut_valid = false;
+	}
+
+	if (m->rgb888_lut_valid)
+	{
+		return ESP_OK;
+	}
+
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		rgb888_lut_t *lut = &m->rgb888_lut[cell];
+		for (uint16_t v = 0; v < 256; v++)
+		{
+			lut->r[v] = get_rgb888_plane_bits(m, v << 16, cell);
+			lut->g[v] = get_rgb888_plane_bits(m, v << 8, cell);
+			lut->b[v] = get_rgb888_plane_bits(m, v, cell);
+		}
+	}
+	m->rgb888_lut_valid = true;
+	return ESP_OK;
+}
+
+/*
+ * Brings the lookup tables used by a format up to date.
+ * Must be called before converting or drawing an image of that format, and not while a conversion is running.
+ */
+esp_err_t prepare_format(matrix_t *m, uint8_t format)
+{
+	switch (format)
+	{
+		case COLOR_GS8:
+			update_index_lut_gs8(m);
+			break;
+		case COLOR_PAL8:
+		case COLOR_PAL4:
+			update_index_lut_palette(m);
+			break;
+		case COLOR_RGB888:
+			return update_rgb888_lut(m);
+	}
+	return ESP_OK;
+}
+
+static inline __attribute__((always_inline)) plane_bits_t rgb565_plane_bits(const rgb565_lut_t *lut, uint16_t color)
+{
+	return
+		lut->r[color >> 11] |
+		lut->g[(color >> 5) & 0x3f] |
+		lut->b[color & 0x1f];
+}
+
+static inline __attribute__((always_inline)) plane_bits_t rgb444_plane_bits(const rgb444_lut_t *lut, uint16_t color)
+{
+	return
+		lut->r[(color >> 8) & 0x0f] |
+		lut->g[(color >> 4) & 0x0f] |
+		lut->b[color & 0x0f];
+}
+
+static inline __attribute__((always_inline)) plane_bits_t rgb888_plane_bits(const rgb888_lut_t *lut, const uint8_t *px)
+{
+	return lut->r[px[0]] | lut->g[px[1]] | lut->b[px[2]];
+}
+
+// Size of one line of an image in bytes
+size_t format_line_size(uint8_t format, uint16_t width)
+{
+	switch (format)
+	{
+		case COLOR_RGB565:
+		case COLOR_RGB444:
+			return width * 2;
+		case COLOR_RGB888:
+			return width * 3;
+		case COLOR_GS8:
+		case COLOR_PAL8:
+			return width;
+		case COLOR_PAL4:
+			return (width + 1) >> 1;
+		case COLOR_MONO:
+			return (width + 7) >> 3;
+	}
+	return 0;
+}
+
+/*
+ * Writes the plane bits of a pair of pixels into all subimages.
+ * Both halves of the color byte are written, so c0 and c1 must already contain the bottom half.
+ */
+static inline __attribute__((always_inline)) void store_pixel_pair(matrix_t *m, uint8_t *const *planes, size_t offset, plane_bits_t c0, plane_bits_t c1, uint8_t inv, const bool column_swap, const bool narrow)
+{
+	const size_t sample = narrow ? 1 : sizeof(uint16_t);
+	if (column_swap)
+	{
+		plane_bits_t t = c0;
+		c0 = c1;
+		c1 = t;
+	}
+
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		uint8_t *px = planes[lvl] + offset;
+		store_color(px, (uint8_t)c0 ^ inv, narrow);
+		store_color(px + sample, (uint8_t)c1 ^ inv, narrow);
+		c0 >>= 8;
+		c1 >>= 8;
+	}
+}
+
+/*
+ * Pixel-major conversion for RGB565
+ * Each pair of source pixels is read only once (with a single 32 bit load if the buffer is aligned).
+ * The bits for all planes are looked up at once and then scattered into the subimages.
+ * Since the width is always even, a column swap is just a swap within the pair.
+ */
+static inline __attribute__((always_inline)) void update_framebuffer_rgb565_tmpl(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, const update_window_t *win, const bool column_swap, const bool single_chn, const bool invert, const bool narrow)
+{
+	const size_t sample = narrow ? 1 : sizeof(uint16_t);
+	size_t row_stride = sample * m->width;
+	uint8_t inv = invert ? 0xff : 0;
+
+	// The planes are written through uint8_t pointers, which could alias the buffer, so keep a local copy
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	memcpy(planes, buf->planes, sizeof(planes));
+
+	// Pairs start on an even column, so if the first pair of every row is aligned, all of them are.
+	bool aligned = (((uintptr_t)data | stride) & 3) == 0;
+
+	for (uint8_t row = win->row0; row < win->row1; row++)
+	{
+		size_t r = row_stride * row;
+		const uint16_t *top = (const uint16_t *)(data + stride * row);
+		const uint16_t *bottom = (const uint16_t *)(data + stride * (row + m->rows));
+
+		// Pairs always start on an even column, so the dither cells are the same for all pairs of the row
+		const rgb565_lut_t *top_lut0 = &m->rgb565_lut[dither_cell(m, 0, row)];
+		const rgb565_lut_t *top_lut1 = &m->rgb565_lut[dither_cell(m, 1, row)];
+		const rgb565_lut_t *bottom_lut0 = &m->rgb565_lut[dither_cell(m, 0, row + m->rows)];
+		const rgb565_lut_t *bottom_lut1 = &m->rgb565_lut[dither_cell(m, 1, row + m->rows)];
+
+		for (uint16_t pixel = win->x0; pixel < win->x1; pixel += 2)
+		{
+			// The ESP32 is little endian, the first pixel is in the lower half
+			uint32_t pair = aligned ? *(const uint32_t *)&top[pixel] : (top[pixel] | ((uint32_t)top[pixel + 1] << 16));
+			plane_bits_t c0 = rgb565_plane_bits(top_lut0, pair & 0xffff);
+			plane_bits_t c1 = rgb565_plane_bits(top_lut1, pair >> 16);
+
+			if (!single_chn)
+			{
+				pair = aligned ? *(const uint32_t *)&bottom[pixel] : (bottom[pixel] | ((uint32_t)bottom[pixel + 1] << 16));
+				c0 |= rgb565_plane_bits(bottom_lut0, pair & 0xffff) << 3;
+				c1 |= rgb565_plane_bits(bottom_lut1, pair >> 16) << 3;
+			}
+
+			store_pixel_pair(m, planes, r + sample * pixel, c0, c1, inv, column_swap, narrow);
+		}
+	}
+}
+
+/*
+ * Plane bits of the pixel pair starting at the even column pixel, for the formats using lookup tables.
+ */
+static inline __attribute__((always_inline)) void lut_pair_bits(matrix_t *m, const uint8_t format, const uint8_t *line, uint16_t pixel, uint8_t cell0, uint8_t cell1, plane_bits_t *c0, plane_bits_t *c1)
+{
+	switch (format)
+	{
+		case COLOR_GS8:
+		case COLOR_PAL8:
+			*c0 = m->index_lut[INDEX_LUT_SIZE * cell0 + line[pixel]];
+			*c1 = m->index_lut[INDEX_LUT_SIZE * cell1 + line[pixel + 1]];
+			break;
+		case COLOR_PAL4:
+		{
+			// The first pixel is in the high nibble
+			uint8_t v = line[pixel >> 1];
+			*c0 = m->index_lut[INDEX_LUT_SIZE * cell0 + (v >> 4)];
+			*c1 = m->index_lut[INDEX_LUT_SIZE * cell1 + (v & 0x0f)];
+			break;
+		}
+		case COLOR_RGB444:
+			*c0 = rgb444_plane_bits(&m->rgb444_lut[cell0], ((const uint16_t *)line)[pixel]);
+			*c1 = rgb444_plane_bits(&m->rgb444_lut[cell1], ((const uint16_t *)line)[pixel + 1]);
+			break;
+		case COLOR_RGB888:
+			*c0 = rgb888_plane_bits(&m->rgb888_lut[cell0], line + 3 * pixel);
+			*c1 = rgb888_plane_bits(&m->rgb888_lut[cell1], line + 3 * pixel + 3);
+			break;
+	}
+}
+
+/*
+ * Pixel-major conversion for the formats using lookup tables, every pixel is one lookup per table.
+ * This is only ever called with a constant format, like the generic loop.
+ * The tables must have been prepared with prepare_format.
+ */
+static inline __attribute__((always_inline)) void update_framebuffer_lut_tmpl(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, const update_window_t *win, const uint8_t format, const bool column_swap, const bool single_chn, const bool invert, const bool narrow)
+{
+	const size_t sample = narrow ? 1 : sizeof(uint16_t);
+	size_t row_stride = sample * m->width;
+	uint8_t inv = invert ? 0xff : 0;
+
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	memcpy(planes, buf->planes, sizeof(planes));
+
+	for (uint8_t row = win->row0; row < win->row1; row++)
+	{
+		size_t r = row_stride * row;
+		const uint8_t *top = data + stride * row;
+		const uint8_t *bottom = top + stride * m->rows;
+
+		uint8_t top_cell0 = dither_cell(m, 0, row);
+		uint8_t top_cell1 = dither_cell(m, 1, row);
+		uint8_t bottom_cell0 = dither_cell(m, 0, row + m->rows);
+		uint8_t bottom_cell1 = dither_cell(m, 1, row + m->rows);
+
+		for (uint16_t pixel = win->x0; pixel < win->x1; pixel += 2)
+		{
+			plane_bits_t c0, c1;
+			lut_pair_bits(m, format, top, pixel, top_cell0, top_cell1, &c0, &c1);
+
+			if (!single_chn)
+			{
+				plane_bits_t b0, b1;
+				lut_pair_bits(m, format, bottom, pixel, bottom_cell0, bottom_cell1, &b0, &b1);
+				c0 |= b0 << 3;
+				c1 |= b1 << 3;
+			}
+
+			store_pixel_pair(m, planes, r + sample * pixel, c0, c1, inv, column_swap, narrow);
+		}
+	}
+}
+
+/*
+ * Pixel-major conversion for monochrome images.
+ * The bits of a pixel pair in the top and the bottom half form a 4 bit index into a table with the plane bits
+ * of both pixels, so there is no per pixel color computation. The tables for both row parities of the dither
+ * pattern are built once per call.
+ */
+static inline __attribute__((always_inline)) void update_framebuffer_mono_tmpl(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, const update_window_t *win, const bool column_swap, const bool single_chn, const bool invert, const bool narrow)
+{
+	const size_t sample = narrow ? 1 : sizeof(uint16_t);
+	size_t row_stride = sample * m->width;
+	uint8_t inv = invert ? 0xff : 0;
+
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	memcpy(planes, buf->planes, sizeof(planes));
+
+	plane_bits_t mono_bits[DITHER_CELLS];
+	get_mono_plane_bits(m, mono_bits);
+
+	// Index bit 1 is the first pixel of the top half, bit 0 the second one, bits 3 and 2 the same for the bottom half
+	plane_bits_t pair_bits[2][16][2];
+	for (uint8_t parity = 0; parity < 2; parity++)
+	for (uint8_t i = 0; i < 16; i++)
+	for (uint8_t px = 0; px < 2; px++)
+	{
+		plane_bits_t c = ((i >> (1 - px)) & 1) ? mono_bits[dither_cell(m, px, parity)] : 0;
+		if (!single_chn && ((i >> (3 - px)) & 1))
+		{
+			c |= mono_bits[dither_cell(m, px, parity + m->rows)] << 3;
+		}
+		pair_bits[parity][i][px] = c;
+	}
+
+	for (uint8_t row = win->row0; row < win->row1; row++)
+	{
+		size_t r = row_stride * row;
+		const uint8_t *top = data + stride * row;
+		const uint8_t *bottom = top + stride * m->rows;
+		const plane_bits_t (*bits)[2] = pair_bits[row & 1];
+
+		for (uint16_t pixel = win->x0; pixel < win->x1; pixel += 2)
+		{
+			// The first pixel is in the most significant bit, pairs never cross a byte
+			uint8_t shift = 6 - (pixel & 6);
+			uint8_t i = (top[pixel >> 3] >> shift) & 3;
+			if (!single_chn)
+			{
+				i |= ((bottom[pixel >> 3] >> shift) & 3) << 2;
+			}
+			store_pixel_pair(m, planes, r + sample * pixel, bits[i][0], bits[i][1], inv, column_swap, narrow);
+		}
+	}
+}
+
+#define UPDATE_TMPL_RGB565(m, buf, data, stride, win, swap, single, invert, narrow) update_framebuffer_rgb565_tmpl(m, buf, data, stride, win, swap, single, invert, narrow)
+#define UPDATE_TMPL_GS8(m, buf, data, stride, win, swap, single, invert, narrow)    update_framebuffer_lut_tmpl(m, buf, data, stride, win, COLOR_GS8, swap, single, invert, narrow)
+#define UPDATE_TMPL_MONO(m, buf, data, stride, win, swap, single, invert, narrow)   update_framebuffer_mono_tmpl(m, buf, data, stride, win, swap, single, invert, narrow)
+#define UPDATE_TMPL_RGB888(m, buf, data, stride, win, swap, single, invert, narrow) update_framebuffer_lut_tmpl(m, buf, data, stride, win, COLOR_RGB888, swap, single, invert, narrow)
+#define UPDATE_TMPL_RGB444(m, buf, data, stride, win, swap, single, invert, narrow) update_framebuffer_lut_tmpl(m, buf, data, stride, win, COLOR_RGB444, swap, single, invert, narrow)
+#define UPDATE_TMPL_PAL8(m, buf, data, stride, win, swap, single, invert, narrow)   update_framebuffer_lut_tmpl(m, buf, data, stride, win, COLOR_PAL8, swap, single, invert, narrow)
+#define UPDATE_TMPL_PAL4(m, buf, data, stride, win, swap, single, invert, narrow)   update_framebuffer_lut_tmpl(m, buf, data, stride, win, COLOR_PAL4, swap, single, invert, narrow)
+
+#define UPDATE_KERNEL(fmt, flags) \
+	static void update_framebuffer_##fmt##_##flags(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, const update_window_t *win) \
+	{ \
+		UPDATE_TMPL_##fmt(m, buf, data, stride, win, \
+			((flags) & KERNEL_FLAG_SWAP) != 0, ((flags) & KERNEL_FLAG_SINGLE) != 0, ((flags) & KERNEL_FLAG_INVERT) != 0, \
+			((flags) & KERNEL_FLAG_NARROW) != 0); \
+	}
+
+#define UPDATE_KERNELS(fmt) \
+	UPDATE_KERNEL(fmt, 0)  UPDATE_KERNEL(fmt, 1)  UPDATE_KERNEL(fmt, 2)  UPDATE_KERNEL(fmt, 3) \
+	UPDATE_KERNEL(fmt, 4)  UPDATE_KERNEL(fmt, 5)  UPDATE_KERNEL(fmt, 6)  UPDATE_KERNEL(fmt, 7) \
+	UPDATE_KERNEL(fmt, 8)  UPDATE_KERNEL(fmt, 9)  UPDATE_KERNEL(fmt, 10) UPDATE_KERNEL(fmt, 11) \
+	UPDATE_KERNEL(fmt, 12) UPDATE_KERNEL(fmt, 13) UPDATE_KERNEL(fmt, 14) UPDATE_KERNEL(fmt, 15)
+
+#define UPDATE_KERNEL_TABLE_ROW(fmt) \
+	[COLOR_##fmt] = { \
+		update_framebuffer_##fmt##_0, update_framebuffer_##fmt##_1, update_framebuffer_##fmt##_2, update_framebuffer_##fmt##_3, \
+		update_framebuffer_##fmt##_4, update_framebuffer_##fmt##_5, update_framebuffer_##fmt##_6, update_framebuffer_##fmt##_7, \
+		update_framebuffer_##fmt##_8, update_framebuffer_##fmt##_9, update_framebuffer_##fmt##_10, update_framebuffer_##fmt##_11, \
+		update_framebuffer_##fmt##_12, update_framebuffer_##fmt##_13, update_framebuffer_##fmt##_14, update_framebuffer_##fmt##_15 }
+
+UPDATE_KERNELS(RGB565)
+UPDATE_KERNELS(GS8)
+UPDATE_KERNELS(MONO)
+UPDATE_KERNELS(RGB888)
+UPDATE_KERNELS(RGB444)
+UPDATE_KERNELS(PAL8)
+UPDATE_KERNELS(PAL4)
+
+// Kernels indexed by input format and KERNEL_FLAG_* combination
+static const update_func_t update_kernels[COLOR_COUNT][KERNEL_FLAG_COUNT] = {
+	UPDATE_KERNEL_TABLE_ROW(RGB565),
+	UPDATE_KERNEL_TABLE_ROW(GS8),
+	UPDATE_KERNEL_TABLE_ROW(MONO),
+	UPDATE_KERNEL_TABLE_ROW(RGB888),
+	UPDATE_KERNEL_TABLE_ROW(RGB444),
+	UPDATE_KERNEL_TABLE_ROW(PAL8),
+	UPDATE_KERNEL_TABLE_ROW(PAL4),
+};
+
+// Size of one line of the source image in bytes
+size_t source_line_size(matrix_t *m, uint8_t format)
+{
+	return format_line_size(format, m->image_width);
+}
+
+/*
+ * Plane bits of pixel sx of a line of the source image.
+ * The raw pixel value is returned in value, mono_bits are the plane bits for set pixels of monochrome images.
+ * The lookup tables of the format must have been prepared with prepare_format.
+ */
+static inline plane_bits_t source_plane_bits(matrix_t *m, uint8_t format, const uint8_t *line, uint16_t sx, uint8_t cell, const plane_bits_t *mono_bits, int32_t *value)
+{
+	switch (format)
+	{
+		case COLOR_RGB565:
+			*value = ((const uint16_t *)line)[sx];
+			return rgb565_plane_bits(&m->rgb565_lut[cell], *value);
+		case COLOR_GS8:
+		case COLOR_PAL8:
+			*value = line[sx];
+			return m->index_lut[INDEX_LUT_SIZE * cell + *value];
+		case COLOR_PAL4:
+			*value = (sx & 1) ? (line[sx >> 1] & 0x0f) : (line[sx >> 1] >> 4);
+			return m->index_lut[INDEX_LUT_SIZE * cell + *value];
+		case COLOR_RGB444:
+			*value = ((const uint16_t *)line)[sx];
+			return rgb444_plane_bits(&m->rgb444_lut[cell], *value);
+		case COLOR_RGB888:
+			line += 3 * sx;
+			*value = (line[0] << 16) | (line[1] << 8) | line[2];
+			return rgb888_plane_bits(&m->rgb888_lut[cell], line);
+		default:
+			*value = (line[sx >> 3] & (0x80 >> (sx & 7))) ? 1 : 0;
+			return *value ? mono_bits[cell] : 0;
+	}
+}
+
+void get_mono_plane_bits(matrix_t *m, plane_bits_t *bits)
+{
+	uint32_t mono = (m->mono_color[0] << 16) | (m->mono_color[1] << 8) | m->mono_color[2];
+	for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+	{
+		bits[cell] = get_rgb888_plane_bits(m, mono, cell);
+	}
+}
+
+// First run of display row y that contains column x
+static inline const map_run_t *map_find(matrix_t *m, uint16_t y, uint16_t x)
+{
+	const map_run_t *run = m->map_runs + m->map_row[y];
+	while (x >= run->x1) run++;
+	return run;
+}
+
+/*
+ * Plane bits of display pixel (x, y) with a panel mapping.
+ * run is advanced to the run containing x, so x must not decrease between calls for the same row.
+ */
+static inline plane_bits_t map_pixel_bits(matrix_t *m, const map_run_t **run, uint16_t x, uint16_t y, uint8_t format, const uint8_t *data, size_t stride, uint8_t shift, const plane_bits_t *mono_bits)
+{
+	const map_run_t *r = *run;
+	while (x >= r->x1) r++;
+	*run = r;
+
+	if (r->ix == MAP_NONE)
+	{
+		return 0;
+	}
+
+	int32_t value;
+	uint16_t k = x - r->x0;
+	uint16_t iy = (r->iy + k * r->dy) >> shift;
+	uint16_t ix = (r->ix + k * r->dx) >> shift;
+	return source_plane_bits(m, format, data + stride * iy, ix, dither_cell(m, x, y), mono_bits, &value);
+}
+
+/*
+ * Conversion kernel for displays with a panel mapping, used for all formats and flags.
+ * The image position of every display pixel comes from the run table, so there is no per pixel mapping arithmetic
+ * beyond following the runs. Pairs of columns are converted together to handle the column swap.
+ * The source image is scaled up by 1 << shift.
+ */
+static void update_framebuffer_mapped(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, uint8_t shift, const update_window_t *win)
+{
+	size_t row_stride = m->sample_size * m->width;
+	bool narrow = m->sample_size == 1;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	memcpy(planes, buf->planes, sizeof(planes));
+
+	plane_bits_t mono_bits[DITHER_CELLS];
+	get_mono_plane_bits(m, mono_bits);
+
+	for (uint8_t row = win->row0; row < win->row1; row++)
+	{
+		const map_run_t *top = map_find(m, row, win->x0);
+		const map_run_t *bottom = m->single_chn ? NULL : map_find(m, row + m->rows, win->x0);
+		size_t line = row_stride * row;
+
+		for (uint16_t x = win->x0; x < win->x1; x += 2)
+		{
+			plane_bits_t c0 = map_pixel_bits(m, &top, x, row, format, data, stride, shift, mono_bits);
+			plane_bits_t c1 = map_pixel_bits(m, &top, x + 1, row, format, data, stride, shift, mono_bits);
+			if (bottom)
+			{
+				c0 |= map_pixel_bits(m, &bottom, x, row + m->rows, format, data, stride, shift, mono_bits) << 3;
+				c1 |= map_pixel_bits(m, &bottom, x + 1, row + m->rows, format, data, stride, shift, mono_bits) << 3;
+			}
+
+			store_pixel_pair(m, planes, line + m->sample_size * x, c0, c1, inv, m->column_swap, narrow);
+		}
+	}
+}
+
+/*
+ * Conversion kernel for scaled source images without a panel mapping, used for all formats and flags.
+ * Every source pixel covers a block of 2x2 or 4x4 display pixels, so both pixels of a pair come from the same
+ * source pixel, which is only looked up once for all pairs of the block in the row.
+ */
+static void update_framebuffer_scaled(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, uint8_t shift, const update_window_t *win)
+{
+	size_t row_stride = m->sample_size * m->width;
+	bool narrow = m->sample_size == 1;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	memcpy(planes, buf->planes, sizeof(planes));
+
+	plane_bits_t mono_bits[DITHER_CELLS];
+	get_mono_plane_bits(m, mono_bits);
+
+	for (uint8_t row = win->row0; row < win->row1; row++)
+	{
+		const uint8_t *top = data + stride * (row >> shift);
+		const uint8_t *bottom = data + stride * ((row + m->rows) >> shift);
+		uint8_t top_cell0 = dither_cell(m, 0, row);
+		uint8_t top_cell1 = dither_cell(m, 1, row);
+		uint8_t bottom_cell0 = dither_cell(m, 0, row + m->rows);
+		uint8_t bottom_cell1 = dither_cell(m, 1, row + m->rows);
+		size_t line = row_stride * row;
+
+		int32_t value;
+		plane_bits_t c0 = 0;
+		plane_bits_t c1 = 0;
+		int32_t last = -1;
+		for (uint16_t x = win->x0; x < win->x1; x += 2)
+		{
+			uint16_t sx = x >> shift;
+			if (sx != last)
+			{
+				c0 = source_plane_bits(m, format, top, sx, top_cell0, mono_bits, &value);
+				c1 = source_plane_bits(m, format, top, sx, top_cell1, mono_bits, &value);
+				if (!m->single_chn)
+				{
+					c0 |= source_plane_bits(m, format, bottom, sx, bottom_cell0, mono_bits, &value) << 3;
+					c1 |= source_plane_bits(m, format, bottom, sx, bottom_cell1, mono_bits, &value) << 3;
+				}
+				last = sx;
+			}
+
+			store_pixel_pair(m, planes, line + m->sample_size * x, c0, c1, inv, m->column_swap, narrow);
+		}
+	}
+}
+
+/*
+ * Converts the dirty part of a buffer.
+ * Each run of consecutive dirty rows is converted by a single kernel call.
+ */
+void update_framebuffer(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, const dirty_t *dirty)
+{
+	update_framebuffer_scaled_by(m, buf, data, stride, format, 0, dirty);
+}
+
+/*
+ * Same as update_framebuffer for a source image scaled up by 1 << shift, shift is 0, 1 or 2.
+ */
+void update_framebuffer_scaled_by(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, uint8_t shift, const dirty_t *dirty)
+{
+	update_func_t kernel = update_kernels[format][m->kernel_flags];
+	update_window_t win = { .x0 = dirty->x0, .x1 = dirty->x1 };
+	buf->lum_stale |= dirty->rows;
+
+	if (win.x0 >= win.x1)
+	{
+		return;
+	}
+
+#if LEDMATRIX_STATS
+	uint32_t start = xthal_get_ccount();
+#endif
+
+	uint8_t row = 0;
+	while (row < m->rows)
+	{
+		if (!(dirty->rows & (1ULL << row)))
+		{
+			row++;
+			continue;
+		}
+
+		win.row0 = row;
+		while (row < m->rows && (dirty->rows & (1ULL << row)))
+		{
+			row++;
+		}
+		win.row1 = row;
+
+		if (m->map_runs)
+		{
+			update_framebuffer_mapped(m, buf, data, stride, format, shift, &win);
+		}
+		else if (shift)
+		{
+			update_framebuffer_scaled(m, buf, data, stride, format, shift, &win);
+		}
+		else
+		{
+			kernel(m, buf, data, stride, &win);
+		}
+	}
+
+#if LEDMATRIX_STATS
+	uint32_t cycles = xthal_get_ccount() - start;
+	m->stats.update_cycles_last = cycles;
+	m->stats.update_cycles_total += cycles;
+	m->stats.update_count++;
+#endif
+}
+
+static uint64_t dirty_all_rows(matrix_t *m)
+{
+	return (m->rows >= 64) ? ~0ULL : ((1ULL << m->rows) - 1);
+}
+
+void dirty_clear(dirty_t *dirty)
+{
+	dirty->rows = 0;
+	dirty->x0 = 0;
+	dirty->x1 = 0;
+}
+
+void dirty_set_all(matrix_t *m, dirty_t *dirty)
+{
+	dirty->rows = dirty_all_rows(m);
+	dirty->x0 = 0;
+	dirty->x1 = m->width;
+}
+
+void dirty_add_columns(dirty_t *dirty, uint16_t x0, uint16_t x1)
+{
+	if (dirty->x0 >= dirty->x1)
+	{
+		dirty->x0 = x0;
+		dirty->x1 = x1;
+	}
+	else
+	{
+		if (x0 < dirty->x0) dirty->x0 = x0;
+		if (x1 > dirty->x1) dirty->x1 = x1;
+	}
+}
+
+void dirty_add(dirty_t *dirty, const dirty_t *other)
+{
+	if (!other->rows || other->x0 >= other->x1)
+	{
+		return;
+	}
+
+	dirty->rows |= other->rows;
+	dirty_add_columns(dirty, other->x0, other->x1);
+}
+
+/*
+ * Marks a rectangle of the display as changed.
+ * A display line y is part of stream row y % rows, either in the upper or the lower half of the color bits.
+ * Both halves of a row are always converted together, so marking the stream row is enough.
+ * The rectangle is in image coordinates.
+ */
+void dirty_add_rect(matrix_t *m, dirty_t *dirty, const rect_t *rect)
+{
+	if (rect->x0 >= rect->x1 || rect->y0 >= rect->y1)
+	{
+		return;
+	}
+
+	if (m->map_runs)
+	{
+		// Image lines can end up anywhere on the display, so use the precomputed set for each line
+		for (uint16_t y = rect->y0; y < rect->y1; y++)
+		{
+			dirty_add(dirty, &m->map_lines[y]);
+		}
+		return;
+	}
+
+	if (rect->y1 - rect->y0 >= m->rows)
+	{
+		dirty->rows = dirty_all_rows(m);
+	}
+	else
+	{
+		for (uint16_t y = rect->y0; y < rect->y1; y++)
+		{
+			dirty->rows |= 1ULL << (y % m->rows);
+		}
+	}
+
+	// Columns are swapped in pairs, so extend to full pairs
+	dirty_add_columns(dirty, rect->x0 & ~1, (rect->x1 + 1) & ~1);
+}
+
+/*
+ * Hash of one line of the source image.
+ * This only has to detect changes, so a simple multiplicative hash is good enough.
+ * The whole frame is hashed, so whole words are used where possible.
+ */
+static uint32_t hash_line(const uint8_t *data, size_t len, uint32_t h)
+{
+	if (((uintptr_t)data & 3) == 0)
+	{
+		for (; len >= 4; len -= 4, data += 4)
+		{
+			h = (h ^ *(const uint32_t *)data) * 0x5bd1e995;
+			h ^= h >> 15;
+		}
+	}
+
+	for (; len; len--, data++)
+	{
+		h = (h ^ *data) * 0x5bd1e995;
+		h ^= h >> 15;
+	}
+	return h;
+}
+
+/*
+ * Compares every line of the frame with the previous one and marks the changed stream rows.
+ * The mono color is part of the hash, since changing it changes the output of the same data.
+ */
+void diff_lines(matrix_t *m, const show_job_t *job, dirty_t *changes)
+{
+	uint8_t shift = job->scale_shift;
+	size_t line_size = format_line_size(job->format, m->image_width >> shift);
+	uint32_t seed = (job->format | (shift << 5)) ^ ((m->mono_color[0] << 8) | (m->mono_color[1] << 16) | (m->mono_color[2] << 24));
+	const uint8_t *line = job->data;
+
+	// With scale, every source line covers several display lines
+	for (uint16_t y = 0; y < m->image_height >> shift; y++, line += job->stride)
+	{
+		uint32_t h = hash_line(line, line_size, seed);
+		if (!m->line_hash_valid || h != m->line_hash[y])
+		{
+			rect_t changed = { .x0 = 0, .y0 = y << shift, .x1 = m->image_width, .y1 = (y + 1) << shift };
+			dirty_add_rect(m, changes, &changed);
+		}
+		m->line_hash[y] = h;
+	}
+	m->line_hash_valid = true;
+}
+
+/*
+ * Marks a drawn rectangle as changed in all other buffers, and its luminance in the backbuffer as out of date.
+ */
+void draw_mark(matrix_t *m, const rect_t *rect)
+{
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		if (i != m->backbuffer)
+		{
+			dirty_add_rect(m, &m->stale[i], rect);
+		}
+	}
+
+	dirty_t drawn;
+	dirty_clear(&drawn);
+	dirty_add_rect(m, &drawn, rect);
+	m->buffer[m->backbuffer].lum_stale |= drawn.rows;
+}
+
+/*
+ * Clips a rectangle given as position and size to the image shown on the display.
+ * Returns false if nothing is left.
+ */
+bool clip_rect(matrix_t *m, int32_t x, int32_t y, int32_t w, int32_t h, rect_t *rect)
+{
+	int32_t x1 = x + w;
+	int32_t y1 = y + h;
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x1 > m->image_width) x1 = m->image_width;
+	if (y1 > m->image_height) y1 = m->image_height;
+	if (x1 < x) x1 = x;
+	if (y1 < y) y1 = y;
+
+	rect->x0 = x;
+	rect->y0 = y;
+	rect->x1 = x1;
+	rect->y1 = y1;
+	return x < x1 && y < y1;
+}
+
+/*
+ * Sets the color bits of a single display pixel in all planes.
+ * Only the half of the color byte belonging to the line is touched.
+ */
+static inline void draw_pixel_bits(matrix_t *m, stream_buffer_t *buf, uint16_t x, uint16_t y, plane_bits_t bits)
+{
+	uint8_t mask = 0x07;
+	uint8_t inv = m->invert ? 0xff : 0;
+
+	if (y >= m->rows)
+	{
+		y -= m->rows;
+		bits <<= 3;
+		mask = 0x38;
+	}
+
+	if (m->column_swap) x ^= 0x01;
+
+	size_t offset = m->sample_size * (y * m->width + x) + BITSTREAM_COLOR_BYTE;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		uint8_t *px = buf->planes[lvl] + offset;
+		*px = (*px & ~mask) | (((uint8_t)bits ^ inv) & mask);
+		bits >>= 8;
+	}
+}
+
+/*
+ * Range of steps k of a run coordinate p + k * d within lo to hi - 1, steps are -1, 0 or 1.
+ * The range is intersected with the existing range k0 to k1 - 1.
+ */
+static void map_clip_steps(int32_t p, int8_t d, int32_t lo, int32_t hi, int32_t *k0, int32_t *k1)
+{
+	int32_t first, last;
+	if (d == 0)
+	{
+		if (p >= lo && p < hi)
+		{
+			return;
+		}
+		first = 0;
+		last = 0;
+	}
+	else if (d > 0)
+	{
+		first = lo - p;
+		last = hi - p;
+	}
+	else
+	{
+		first = p - hi + 1;
+		last = p - lo + 1;
+	}
+
+	if (first > *k0) *k0 = first;
+	if (last < *k1) *k1 = last;
+}
+
+/*
+ * Calls func for every display pixel showing a part of the rectangle of the image.
+ * With a panel mapping, the runs are clipped to the rectangle, so this doesn't have to visit every pixel.
+ */
+void draw_each(matrix_t *m, stream_buffer_t *buf, const rect_t *rect, draw_func_t func, void *ctx)
+{
+	if (!m->map_runs)
+	{
+		for (uint16_t y = rect->y0; y < rect->y1; y++)
+		{
+			for (uint16_t x = rect->x0; x < rect->x1; x++)
+			{
+				func(m, buf, x, y, x, y, ctx);
+			}
+		}
+		return;
+	}
+
+	for (uint16_t y = 0; y < m->height; y++)
+	{
+		for (uint32_t i = m->map_row[y]; i < m->map_row[y + 1]; i++)
+		{
+			const map_run_t *run = &m->map_runs[i];
+			if (run->ix == MAP_NONE)
+			{
+				continue;
+			}
+
+			int32_t k0 = 0;
+			int32_t k1 = run->x1 - run->x0;
+			map_clip_steps(run->ix, run->dx, rect->x0, rect->x1, &k0, &k1);
+			map_clip_steps(run->iy, run->dy, rect->y0, rect->y1, &k0, &k1);
+			for (int32_t k = k0; k < k1; k++)
+			{
+				func(m, buf, run->x0 + k, y, run->ix + k * run->dx, run->iy + k * run->dy, ctx);
+			}
+		}
+	}
+}
+
+static void draw_fill_pixel(matrix_t *m, stream_buffer_t *buf, uint16_t x, uint16_t y, uint16_t ix, uint16_t iy, void *ctx)
+{
+	const plane_bits_t *bits = (const plane_bits_t *)ctx;
+	draw_pixel_bits(m, buf, x, y, bits[dither_cell(m, x, y)]);
+}
+
+/*
+ * Fills columns x0 to x1 - 1 of display line y, one plane at a time.
+ * Within a line, only the column decides between the two dither cells.
+ */
+static void fill_span(matrix_t *m, stream_buffer_t *buf, uint16_t x0, uint16_t x1, uint16_t y, const plane_bits_t *bits)
+{
+	uint8_t mask = 0x07;
+	uint8_t shift = 0;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint16_t swap = m->column_swap ? 0x01 : 0;
+
+	plane_bits_t even = bits[dither_cell(m, 0, y)];
+	plane_bits_t odd = bits[dither_cell(m, 1, y)];
+	if (y >= m->rows)
+	{
+		y -= m->rows;
+		shift = 3;
+		mask = 0x38;
+	}
+
+	size_t line = m->sample_size * m->width * y + BITSTREAM_COLOR_BYTE;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		uint8_t c[2] = {
+			(((uint8_t)(even >> (8 * lvl)) << shift) ^ inv) & mask,
+			(((uint8_t)(odd >> (8 * lvl)) << shift) ^ inv) & mask,
+		};
+		uint8_t *px = buf->planes[lvl] + line;
+		for (uint16_t x = x0; x < x1; x++)
+		{
+			uint8_t *p = px + m->sample_size * (x ^ swap);
+			*p = (*p & ~mask) | c[x & 1];
+		}
+	}
+}
+
+/*
+ * Fills a rectangle of the image with a solid color, bits holds the plane bits for every dither cell.
+ */
+void draw_fill_rect(matrix_t *m, stream_buffer_t *buf, const rect_t *rect, const plane_bits_t *bits)
+{
+	if (m->map_runs)
+	{
+		draw_each(m, buf, rect, draw_fill_pixel, (void *)bits);
+		return;
+	}
+
+	for (uint16_t y = rect->y0; y < rect->y1; y++)
+	{
+		fill_span(m, buf, rect->x0, rect->x1, y, bits);
+	}
+}
+
+void draw_blit_pixel(matrix_t *m, stream_buffer_t *buf, uint16_t x, uint16_t y, uint16_t ix, uint16_t iy, void *ctx)
+{
+	const blit_src_t *src = (const blit_src_t *)ctx;
+	int32_t value;
+	plane_bits_t bits = source_plane_bits(m, src->format, src->data + src->line_size * (iy - src->y), ix - src->x, dither_cell(m, x, y), src->mono_bits, &value);
+
+	if (value != src->key)
+	{
+		draw_pixel_bits(m, buf, x, y, bits);
+	}
+}
+
+// Single pixel at the odd ends of a span, like draw_pixel_bits
+static inline void blit_span_pixel(uint8_t *const *planes, uint8_t color_depth, uint16_t x, plane_bits_t bits, uint8_t mask, uint8_t inv, uint16_t swap, uint8_t sample_size)
+{
+	size_t px = sample_size * (x ^ swap) + BITSTREAM_COLOR_BYTE;
+	for (uint8_t lvl = 0; lvl < color_depth; lvl++)
+	{
+		uint8_t *p = planes[lvl] + px;
+		*p = (*p & ~mask) | (((uint8_t)bits ^ inv) & mask);
+		bits >>= 8;
+	}
+}
+
+/*
+ * Converts columns x0 to x1 - 1 of display line y from a line of the source image starting at column x0.
+ * This is the conversion kernel for a single line: like fill_span, only the half of the color byte belonging
+ * to the line is written, so the other line of the row doesn't have to be part of the source.
+ */
+static inline __attribute__((always_inline)) void blit_span_tmpl(matrix_t *m, stream_buffer_t *buf, const uint8_t *line, uint16_t x0, uint16_t x1, uint16_t y, const uint8_t format)
+{
+	uint8_t mask = 0x07;
+	uint8_t shift = 0;
+	uint8_t inv = m->invert ? 0xff : 0;
+	uint16_t swap = m->column_swap ? 0x01 : 0;
+	uint8_t color_depth = m->color_depth;
+	uint8_t sample_size = m->sample_size;
+	bool narrow = sample_size == 1;
+
+	uint8_t cells[2] = { dither_cell(m, 0, y), dither_cell(m, 1, y) };
+	if (y >= m->rows)
+	{
+		y -= m->rows;
+		shift = 3;
+		mask = 0x38;
+	}
+
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	size_t offset = sample_size * m->width * y;
+	for (uint8_t lvl = 0; lvl < color_depth; lvl++)
+	{
+		planes[lvl] = buf->planes[lvl] + offset;
+	}
+
+	uint16_t x = x0;
+	int32_t value;
+	if (x & 1)
+	{
+		blit_span_pixel(planes, color_depth, x, source_plane_bits(m, format, line, 0, cells[1], NULL, &value) << shift, mask, inv, swap, sample_size);
+		x++;
+	}
+
+	// Whole pairs are written with a single access per plane, like in scroll_columns (color byte first)
+	plane_bits_t plane_inv = inv ? mask * 0x0101010101010101ull : 0;
+	uint32_t pair_mask = narrow ? (mask | (mask << 8)) : (mask | (mask << 16));
+	for (; x + 1 < x1; x += 2)
+	{
+		plane_bits_t c0 = (source_plane_bits(m, format, line, x - x0, cells[0], NULL, &value) << shift) ^ plane_inv;
+		plane_bits_t c1 = (source_plane_bits(m, format, line, x + 1 - x0, cells[1], NULL, &value) << shift) ^ plane_inv;
+		if (swap)
+		{
+			plane_bits_t t = c0;
+			c0 = c1;
+			c1 = t;
+		}
+
+		for (uint8_t lvl = 0; lvl < color_depth; lvl++)
+		{
+			if (narrow)
+			{
+				uint16_t *w = (uint16_t *)(planes[lvl] + x);
+				*w = (*w & ~pair_mask) | (uint8_t)c0 | ((uint16_t)(uint8_t)c1 << 8);
+			}
+			else
+			{
+				uint32_t *w = (uint32_t *)(planes[lvl] + sizeof(uint16_t) * x);
+				*w = (*w & ~pair_mask) | (uint8_t)c0 | ((uint32_t)(uint8_t)c1 << 16);
+			}
+			c0 >>= 8;
+			c1 >>= 8;
+		}
+	}
+
+	if (x < x1)
+	{
+		blit_span_pixel(planes, color_depth, x, source_plane_bits(m, format, line, x - x0, cells[0], NULL, &value) << shift, mask, inv, swap, sample_size);
+	}
+}
+
+static void blit_span(matrix_t *m, stream_buffer_t *buf, const uint8_t *line, uint16_t x0, uint16_t x1, uint16_t y, uint8_t format)
+{
+	switch (format)
+	{
+		case COLOR_RGB565:
+			blit_span_tmpl(m, buf, line, x0, x1, y, COLOR_RGB565);
+			break;
+		case COLOR_RGB444:
+			blit_span_tmpl(m, buf, line, x0, x1, y, COLOR_RGB444);
+			break;
+		case COLOR_RGB888:
+			blit_span_tmpl(m, buf, line, x0, x1, y, COLOR_RGB888);
+			break;
+		default:
+			// COLOR_GS8 and COLOR_PAL8 share the index lookup table
+			blit_span_tmpl(m, buf, line, x0, x1, y, COLOR_PAL8);
+			break;
+	}
+}
+
+/*
+ * Converts the pixels x0 to x1 - 1 of line y of the image, data holds pixel x0 first.
+ * With a panel mapping, the pixels are drawn like blit.
+ */
+void draw_span(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, uint16_t x0, uint16_t x1, uint16_t y, uint8_t format)
+{
+	if (!m->map_runs)
+	{
+		blit_span(m, buf, data, x0, x1, y, format);
+		return;
+	}
+
+	rect_t rect = { x0, y, x1, y + 1 };
+	blit_src_t src = { .data = data, .x = x0, .y = y, .format = format, .key = -1 };
+	draw_each(m, buf, &rect, draw_blit_pixel, &src);
+}
+
+/*
+ * Checks that an encoded frame of the framebuffer (image_width x fb_height) is complete and doesn't end in the
+ * middle of a packet. ENC_RLE frames must cover every pixel, ENC_DELTA frames may end early.
+ */
+esp_err_t encoded_frame_check(matrix_t *m, const uint8_t *data, size_t len, uint8_t format, uint8_t encoding)
+{
+	size_t pixel_size = format_line_size(format, 1);
+	size_t total = (size_t)m->image_width * m->fb_height;
+	size_t pixels = 0;
+	size_t pos = 0;
+
+	while (pos < len)
+	{
+		uint8_t header = data[pos++];
+		size_t count = (header & ENC_RUN) ? (header & ENC_COUNT_MASK) + 1 : header + 1;
+		size_t bytes = pixel_size;
+		if ((header & ENC_SKIP) == ENC_SKIP)
+		{
+			if (encoding != ENC_DELTA)
+			{
+				return ESP_ERR_INVALID_ARG;
+			}
+			bytes = 0;
+		}
+		else if (!(header & ENC_RUN))
+		{
+			bytes = pixel_size * count;
+		}
+
+		pos += bytes;
+		pixels += count;
+		if (pos > len || pixels > total)
+		{
+			return ESP_ERR_INVALID_SIZE;
+		}
+	}
+
+	if (encoding == ENC_RLE && pixels != total)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return ESP_OK;
+}
+
+/*
+ * Decodes a frame checked with encoded_frame_check straight into a buffer, there is no uncompressed copy.
+ * Packets are split at the end of every line, runs are filled like draw_fill_rect and literals with draw_span.
+ * Lines outside of the display (see fb_y) are skipped. changed is the bounding box of all pixels written.
+ */
+void decode_frame(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t len, uint8_t format, rect_t *changed)
+{
+#if LEDMATRIX_STATS
+	uint32_t start = xthal_get_ccount();
+#endif
+
+	size_t pixel_size = format_line_size(format, 1);
+	uint16_t width = m->image_width;
+	size_t first = (size_t)width * m->fb_y;
+	size_t end = first + (size_t)width * m->image_height;
+	size_t pixel = 0;
+	size_t pos = 0;
+
+	changed->x0 = width;
+	changed->y0 = m->image_height;
+	changed->x1 = 0;
+	changed->y1 = 0;
+
+	while (pos < len && pixel < end)
+	{
+		uint8_t header = data[pos++];
+		bool skip = (header & ENC_SKIP) == ENC_SKIP;
+		bool run = !skip && (header & ENC_RUN);
+		size_t count = (header & ENC_RUN) ? (header & ENC_COUNT_MASK) + 1 : header + 1;
+		const uint8_t *values = data + pos;
+		pos += skip ? 0 : (run ? pixel_size : pixel_size * count);
+
+		plane_bits_t bits[DITHER_CELLS];
+		if (run && pixel + count > first)
+		{
+			int32_t value;
+			for (uint8_t cell = 0; cell < DITHER_CELLS; cell++)
+			{
+				bits[cell] = source_plane_bits(m, format, values, 0, cell, NULL, &value);
+			}
+		}
+
+		size_t packet_end = pixel + count;
+		for (size_t i = pixel; i < packet_end && i < end; )
+		{
+			// Part of the packet in the current line
+			size_t line = i / width;
+			uint16_t x0 = i - line * width;
+			uint16_t x1 = (packet_end - line * width < width) ? packet_end - line * width : width;
+			size_t next = line * width + x1;
+
+			if (!skip && i >= first)
+			{
+				uint16_t y = line - m->fb_y;
+				rect_t rect = { x0, y, x1, y + 1 };
+				if (run)
+				{
+					draw_fill_rect(m, buf, &rect, bits);
+				}
+				else
+				{
+					draw_span(m, buf, values + pixel_size * (i - pixel), x0, x1, y, format);
+				}
+
+				if (x0 < changed->x0) changed->x0 = x0;
+				if (x1 > changed->x1) changed->x1 = x1;
+				if (y < changed->y0) changed->y0 = y;
+				if (y + 1 > changed->y1) changed->y1 = y + 1;
+			}
+			i = next;
+		}
+		pixel = packet_end;
+	}
+
+	if (changed->x0 >= changed->x1)
+	{
+		changed->x0 = changed->x1 = changed->y0 = changed->y1 = 0;
+	}
+
+#if LEDMATRIX_STATS
+	uint32_t cycles = xthal_get_ccount() - start;
+	m->stats.update_cycles_last = cycles;
+	m->stats.update_cycles_total += cycles;
+	m->stats.update_count++;
+#endif
+}
+
+size_t planes_frame_size(matrix_t *m)
+{
+	return PLANES_HEADER_SIZE + (size_t)m->color_depth * m->rows * m->width;
+}
+
+void planes_frame_header(matrix_t *m, uint8_t *header)
+{
+	header[0] = 'L';
+	header[1] = 'P';
+	header[2] = m->color_depth;
+	header[3] = (m->single_chn ? PLANES_FLAG_SINGLE : 0) | (m->column_swap ? PLANES_FLAG_SWAP : 0);
+	header[4] = m->width & 0xff;
+	header[5] = m->width >> 8;
+	header[6] = m->rows & 0xff;
+	header[7] = m->rows >> 8;
+}
+
+/*
+ * The color bytes only make sense for the exact stream they were made for.
+ */
+esp_err_t planes_frame_check(matrix_t *m, const uint8_t *data, size_t len)
+{
+	uint8_t header[PLANES_HEADER_SIZE];
+	planes_frame_header(m, header);
+	if (len != planes_frame_size(m) || memcmp(data, header, PLANES_HEADER_SIZE))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+	return ESP_OK;
+}
+
+/*
+ * Copies a COLOR_PLANES frame into a buffer, there is nothing to convert.
+ * Only the inversion is applied here, the control bits stay as they are.
+ */
+void copy_planes(matrix_t *m, stream_buffer_t *buf, const uint8_t *data)
+{
+#if LEDMATRIX_STATS
+	uint32_t start = xthal_get_ccount();
+#endif
+
+	size_t count = (size_t)m->rows * m->width;
+	uint8_t inv = m->invert ? 0xff : 0;
+	data += PLANES_HEADER_SIZE;
+
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		uint8_t *px = buf->planes[lvl];
+		if (m->sample_size == 1)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				px[i] = (px[i] & BITSTREAM8_CTRL_MASK) | ((data[i] ^ inv) & BITSTREAM8_COLOR_MASK);
+			}
+		}
+		else
+		{
+			px += BITSTREAM_COLOR_BYTE;
+			for (size_t i = 0; i < count; i++)
+			{
+				px[2 * i] = data[i] ^ inv;
+			}
+		}
+		data += count;
+	}
+
+#if LEDMATRIX_STATS
+	uint32_t cycles = xthal_get_ccount() - start;
+	m->stats.update_cycles_last = cycles;
+	m->stats.update_cycles_total += cycles;
+	m->stats.update_count++;
+#endif
+}
+
+// Color byte of the stored pixel, or black for pixels outside of the row
+static inline uint32_t scroll_color(const uint32_t *row, int32_t pixel, uint16_t width, uint32_t black)
+{
+	if (pixel < 0 || pixel >= width)
+	{
+		return black;
+	}
+	return (row[pixel >> 1] >> (16 * (pixel & 1))) & 0xff;
+}
+
+// Same for the 8 bit bus, where the control bits share the byte
+static inline uint8_t scroll_color8(const uint8_t *row, int32_t pixel, uint16_t width, uint8_t black)
+{
+	if (pixel < 0 || pixel >= width)
+	{
+		return black;
+	}
+	return row[pixel] & BITSTREAM8_COLOR_MASK;
+}
+
+/*
+ * Moves the color bytes of all planes by dx columns, the control bytes stay in place.
+ * Both halves of a row move together. Pixels moved in at the edge are black.
+ * The rows are processed a pixel pair (one 32 bit word) at a time, against the direction of the move, so it works in place.
+ */
+void scroll_columns(matrix_t *m, stream_buffer_t *buf, int32_t dx)
+{
+	size_t row_stride = m->sample_size * m->width;
+	uint16_t words = m->width / 2;
+	uint32_t black = m->invert ? 0xff : 0;
+	bool narrow = m->sample_size == 1;
+
+	// Offset of the stored source pixel for the first and the second pixel of a pair
+	// With swapped columns and an odd distance, the pixels of a pair come from different pairs.
+	int32_t a = dx;
+	int32_t b = dx;
+	if (m->column_swap && (dx & 1))
+	{
+		a = dx - 2;
+		b = dx + 2;
+	}
+
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		for (uint8_t row = 0; row < m->rows; row++)
+		{
+			if (narrow)
+			{
+				// Still a pair at a time, but one byte per pixel
+				uint8_t *p = buf->planes[lvl] + row_stride * row;
+				for (uint16_t i = 0; i < words; i++)
+				{
+					int32_t k = (dx > 0) ? words - 1 - i : i;
+					uint8_t c0 = scroll_color8(p, 2 * k - a, m->width, black & BITSTREAM8_COLOR_MASK);
+					uint8_t c1 = scroll_color8(p, 2 * k + 1 - b, m->width, black & BITSTREAM8_COLOR_MASK);
+					p[2 * k] = (p[2 * k] & BITSTREAM8_CTRL_MASK) | c0;
+					p[2 * k + 1] = (p[2 * k + 1] & BITSTREAM8_CTRL_MASK) | c1;
+				}
+				continue;
+			}
+
+			uint32_t *w = (uint32_t *)(buf->planes[lvl] + row_stride * row);
+			for (uint16_t i = 0; i < words; i++)
+			{
+				int32_t k = (dx > 0) ? words - 1 - i : i;
+				uint32_t c0 = scroll_color(w, 2 * k - a, m->width, black);
+				uint32_t c1 = scroll_color(w, 2 * k + 1 - b, m->width, black);
+				w[k] = (w[k] & 0xff00ff00) | c0 | (c1 << 16);
+			}
+		}
+	}
+}
+
+/*
+ * Moves the image by dy lines, the control bytes stay in place.
+ * Line y is kept in the upper or lower half of the color bits of row y % rows,
+ * so lines are moved one at a time and may change the half on the way. Lines moved in at the edge are black.
+ */
+void scroll_lines(matrix_t *m, stream_buffer_t *buf, int32_t dy)
+{
+	size_t row_stride = m->sample_size * m->width;
+	uint16_t words = row_stride / sizeof(uint32_t);
+
+	// Color bits 0 - 2 of every pixel in a word, two pixels with the 16 bit bus or four with the 8 bit bus
+	uint32_t lanes = (m->sample_size == 1) ? 0x07070707 : 0x00070007;
+	uint32_t black = m->invert ? lanes | (lanes << 3) : 0;
+
+	for (uint16_t i = 0; i < m->height; i++)
+	{
+		int32_t y = (dy > 0) ? m->height - 1 - i : i;
+		int32_t sy = y - dy;
+		uint8_t dst_shift = (y >= m->rows) ? 3 : 0;
+		uint32_t mask = lanes << dst_shift;
+
+		for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+		{
+			uint8_t *si = buf->planes[lvl];
+			uint32_t *dst = (uint32_t *)(si + row_stride * (y % m->rows));
+			if (sy < 0 || sy >= m->height)
+			{
+				for (uint16_t k = 0; k < words; k++)
+				{
+					dst[k] = (dst[k] & ~mask) | (black & mask);
+				}
+				continue;
+			}
+
+			const uint32_t *src = (const uint32_t *)(si + row_stride * (sy % m->rows));
+			uint8_t src_shift = (sy >= m->rows) ? 3 : 0;
+			for (uint16_t k = 0; k < words; k++)
+			{
+				dst[k] = (dst[k] & ~mask) | (((src[k] >> src_shift) & lanes) << dst_shift);
+			}
+		}
+	}
+}
+
+/*
+ * Rebuilds everything derived from the channel correction.
+ * The displayed image is not changed, the correction applies to the next show or drawing call.
+ */
+void channel_lut_changed(matrix_t *m)
+{
+	init_rgb565_lut(m);
+	init_rgb444_lut(m);
+	m->index_lut_color = INDEX_LUT_INVALID;
+	m->rgb888_lut_valid = false;
+
+	// Unchanged lines must be converted again
+	m->line_hash_valid = false;
+}
+
+/*
+ * Allocates the buffers and lookup tables for the configured display and sets up the output without an image.
+ * The geometry, the color settings and the image size (see map_runs) must be set before.
+ */
+esp_err_t matrix_alloc(matrix_t *m)
+{
+	m->line_hash = malloc(sizeof(uint32_t) * m->image_height);
+	m->index_lut = malloc(sizeof(plane_bits_t) * DITHER_CELLS * INDEX_LUT_SIZE);
+	m->rgb565_lut = malloc(sizeof(rgb565_lut_t) * DITHER_CELLS);
+	m->rgb444_lut = malloc(sizeof(rgb444_lut_t) * DITHER_CELLS);
+	m->channel_lut = malloc(3 * sizeof(*m->channel_lut));
+	// Black until set_palette is called
+	m->palette = calloc(INDEX_LUT_SIZE, sizeof(uint32_t));
+	if (!m->line_hash || !m->index_lut || !m->rgb565_lut || !m->rgb444_lut || !m->channel_lut || !m->palette)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	m->index_lut_color = INDEX_LUT_INVALID;
+
+	init_dither(m);
+	init_channel_lut(m, 1.0f, 0xffffff);
+	init_rgb565_lut(m);
+	init_rgb444_lut(m);
+
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		esp_err_t err = initialize_buffer(m, &m->buffer[i]);
+		if (err != ESP_OK)
+		{
+			return err;
+		}
+		create_control_pattern(m, &m->buffer[i]);
+		buffer_writeback(m, &m->buffer[i]);
+
+		// Nothing was converted yet
+		dirty_set_all(m, &m->stale[i]);
+	}
+	return ESP_OK;
+}
+
+/*
+ * Changes the color depth and the BAM planes of all buffers, keeping the image.
+ * Plane lvl holds bit 8 - color_depth + lvl of the colors, so the planes only move: with less depth, the least
+ * significant planes are freed, with more, new dark planes are added below. The image lacks the new low bits until
+ * it is converted again. The descriptor rings are rebuilt in place as long as they are large enough.
+ * The DMA must be stopped. On an error, nothing was changed.
+ */
+esp_err_t matrix_set_depth(matrix_t *m, uint8_t depth, uint8_t bam)
+{
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	size_t desc_count = ring_length(m, depth, bam);
+	uint8_t added = (depth > m->color_depth) ? depth - m->color_depth : 0;
+	uint8_t removed = (depth < m->color_depth) ? m->color_depth - depth : 0;
+
+	// Everything new is allocated first, so a failure leaves the display as it is
+	uint8_t *planes[BUFFER_COUNT_MAX][COLOR_DEPTH_MAX] = { { NULL } };
+	lldesc_t *desc[BUFFER_COUNT_MAX] = { NULL };
+	bool failed = false;
+	for (uint8_t i = 0; i < m->buffer_count && !failed; i++)
+	{
+		for (uint8_t lvl = 0; lvl < added && !failed; lvl++)
+		{
+			planes[i][lvl] = alloc_plane(m);
+			failed = !planes[i][lvl];
+		}
+		if (desc_count > m->dma_desc_alloc && !failed)
+		{
+			desc[i] = heap_caps_malloc(desc_count * sizeof(lldesc_t), MALLOC_CAP_DMA);
+			failed = !desc[i];
+		}
+	}
+	if (failed)
+	{
+		for (uint8_t i = 0; i < m->buffer_count; i++)
+		{
+			for (uint8_t lvl = 0; lvl < added; lvl++)
+			{
+				if (planes[i][lvl]) free(planes[i][lvl]);
+			}
+			if (desc[i]) free(desc[i]);
+		}
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		stream_buffer_t *buf = &m->buffer[i];
+		if (removed)
+		{
+			for (uint8_t lvl = 0; lvl < removed; lvl++)
+			{
+				free(buf->planes[lvl]);
+			}
+			memmove(&buf->planes[0], &buf->planes[removed], sizeof(buf->planes[0]) * depth);
+			memset(&buf->planes[depth], 0, sizeof(buf->planes[0]) * removed);
+		}
+		else if (added)
+		{
+			memmove(&buf->planes[added], &buf->planes[0], sizeof(buf->planes[0]) * m->color_depth);
+			memcpy(&buf->planes[0], planes[i], sizeof(buf->planes[0]) * added);
+		}
+		if (desc[i])
+		{
+			free(buf->dma_desc);
+			buf->dma_desc = desc[i];
+		}
+	}
+
+	m->stats.stream_bytes += subimage_stride * m->buffer_count * added;
+	m->stats.stream_bytes -= subimage_stride * m->buffer_count * removed;
+	if (desc_count > m->dma_desc_alloc)
+	{
+		m->stats.desc_bytes += (desc_count - m->dma_desc_alloc) * sizeof(lldesc_t) * m->buffer_count;
+		m->dma_desc_alloc = desc_count;
+	}
+	m->color_depth = depth;
+	m->bam_planes = bam;
+	m->dma_desc_count = desc_count;
+
+	for (uint8_t i = 0; i < m->buffer_count; i++)
+	{
+		build_ring(m, &m->buffer[i]);
+		create_control_pattern(m, &m->buffer[i]);
+		buffer_writeback(m, &m->buffer[i]);
+		// The weights of the planes changed
+		m->buffer[i].lum_stale = dirty_all_rows(m);
+	}
+
+	// The lookup tables and the dither offsets depend on the color depth
+	init_dither(m);
+	channel_lut_changed(m);
+	return ESP_OK;
+}
+
+/*
+ * Sums up the lit color bits of one row of all planes for each channel r, g, b, weighted like the planes.
+ */
+static void row_luminance(matrix_t *m, const stream_buffer_t *buf, uint8_t row, uint32_t *lum)
+{
+	uint8_t inv = m->invert ? 0xff : 0;
+	lum[0] = lum[1] = lum[2] = 0;
+
+	// Only the weighted color values are counted in the loop, the bits of each value are added up afterwards
+	uint32_t hist[1 << 6] = { 0 };
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		const uint8_t *px = buf->planes[lvl] + m->sample_size * m->width * row + BITSTREAM_COLOR_BYTE;
+		for (uint16_t i = 0; i < m->width; i++)
+		{
+			hist[(px[m->sample_size * i] ^ inv) & BITSTREAM8_COLOR_MASK] += 1u << lvl;
+		}
+	}
+
+	for (uint8_t v = 1; v < (1 << 6); v++)
+	{
+		for (uint8_t c = 0; c < 3; c++)
+		{
+			uint32_t lit = ((v >> (BITSTREAM_COLOR_R1_POS + c)) & 1) + ((v >> (BITSTREAM_COLOR_R2_POS + c)) & 1);
+			lum[c] += hist[v] * lit;
+		}
+	}
+}
+
+/*
+ * Counts the rows of a buffer that were written since the last call again, so buffer_luminance gets cheap.
+ * Must only be called by the task that converts into the buffer.
+ */
+void buffer_update_luminance(matrix_t *m, stream_buffer_t *buf)
+{
+	for (uint8_t row = 0; row < m->rows; row++)
+	{
+		if (buf->lum_stale & (1ULL << row))
+		{
+			row_luminance(m, buf, row, buf->row_lum[row]);
+		}
+	}
+	buf->lum_stale = 0;
+}
+
+/*
+ * Sums up the lit color bits of all planes of a buffer for each channel r, g, b, weighted like the planes.
+ * Full white on every pixel gives width * height * (2 ^ color_depth - 1) per channel.
+ * Rows written since buffer_update_luminance are counted, the others come from the counts of that call.
+ */
+void buffer_luminance(matrix_t *m, const stream_buffer_t *buf, uint32_t *lum)
+{
+	lum[0] = lum[1] = lum[2] = 0;
+	for (uint8_t row = 0; row < m->rows; row++)
+	{
+		uint32_t counted[3];
+		const uint32_t *row_lum = buf->row_lum[row];
+		if (buf->lum_stale & (1ULL << row))
+		{
+			row_luminance(m, buf, row, counted);
+			row_lum = counted;
+		}
+		for (uint8_t c = 0; c < 3; c++)
+		{
+			lum[c] += row_lum[c];
+		}
+	}
+}
+
+/*
+ * Estimated average current of the LEDs in mA for a luminance of buffer_luminance at the given brightness.
+ * Every LED draws led_ma while it is on: in one of rows rows, for the weight of its planes and for
+ * brightness - 1 of the width pixels of the output enable time.
+ */
+uint32_t luminance_current(matrix_t *m, const uint32_t *lum, uint16_t brightness)
+{
+	uint64_t lit = (uint64_t)lum[0] + lum[1] + lum[2];
+	uint64_t full = (uint64_t)((1 << m->color_depth) - 1) * m->rows * m->width;
+	return (lit * m->led_ma * (brightness - 1)) / full;
+}
+
+/*
+ * Highest brightness up to max_b for which luminance_current stays within limit_ma.
+ * Brightness values are the ones of matrix_t, 1 is off.
+ */
+uint16_t power_limited_brightness(matrix_t *m, const uint32_t *lum, uint16_t max_b, uint32_t limit_ma)
+{
+	uint64_t lit = ((uint64_t)lum[0] + lum[1] + lum[2]) * m->led_ma;
+	if (!lit)
+	{
+		return max_b;
+	}
+	uint64_t full = (uint64_t)((1 << m->color_depth) - 1) * m->rows * m->width;
+	uint64_t on = ((uint64_t)limit_ma * full) / lit;
+	return (on + 1 < max_b) ? on + 1 : max_b;
+}
+
+/*
+ * Makes everything written to a buffer visible to the DMA, see stream_writeback.
+ */
+void buffer_writeback(matrix_t *m, stream_buffer_t *buf)
+{
+	if (!m->ext_mem)
+	{
+		return;
+	}
+
+	size_t subimage_stride = m->sample_size * m->width * m->rows;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		stream_writeback(m, buf->planes[lvl], subimage_stride);
+	}
+}
+
+/*
+ * Frees everything allocated for the display, including the panel mapping.
+ * The pointers are left as they are.
+ */
+void matrix_free(matrix_t *m)
+{
+	for (uint8_t i = 0; i < BUFFER_COUNT_MAX; i++)
+	{
+		for (uint8_t lvl = 0; lvl < COLOR_DEPTH_MAX; lvl++)
+		{
+			if (m->buffer[i].planes[lvl]) free(m->buffer[i].planes[lvl]);
+		}
+		if (m->buffer[i].dma_desc) free(m->buffer[i].dma_desc);
+		if (m->buffer[i].row_lum) free(m->buffer[i].row_lum);
+	}
+	if (m->map_runs) free(m->map_runs);
+	if (m->map_row) free(m->map_row);
+	if (m->map_lines) free(m->map_lines);
+	if (m->line_hash) free(m->line_hash);
+	if (m->index_lut) free(m->index_lut);
+	if (m->rgb888_lut) free(m->rgb888_lut);
+	if (m->rgb565_lut) free(m->rgb565_lut);
+	if (m->rgb444_lut) free(m->rgb444_lut);
+	if (m->channel_lut) free(m->channel_lut);
+	if (m->palette) free(m->palette);
+	if (m->channel_lut_next) free(m->channel_lut_next);
+	if (m->palette_next) free(m->palette_next);
+}
+
+#ifdef DEBUG_TEST_ON_INIT
+static uint8_t test_pattern_bits(uint16_t x, uint16_t y)
+{
+	if ((x + y) % 4 == 3) return 0;
+	return 9 << ((x + y) % 4);
+}
+
+/*
+ * Diagonal color stripes, the same in all planes.
+ */
+void draw_test_pattern(matrix_t *m, stream_buffer_t *buf)
+{
+	bool narrow = m->sample_size == 1;
+	for (uint8_t lvl = 0; lvl < m->color_depth; lvl++)
+	{
+		for (uint8_t row = 0; row < m->rows; row++)
+		{
+			uint8_t *r = buf->planes[lvl] + m->sample_size * m->width * row;
+			for (uint16_t pixel = 0; pixel < m->width; pixel++)
+			{
+				uint16_t x = m->column_swap ? pixel ^ 0x01 : pixel;
+				uint8_t c = test_pattern_bits(x, row);
+				if (!m->single_chn)
+				{
+					c |= test_pattern_bits(x, row + m->rows) << 3;
+				}
+				if (m->invert) c = ~c;
+				store_color(r + m->sample_size * pixel, c, narrow);
+			}
+		}
+	}
+	buf->lum_stale = UINT64_MAX;
+}
+#endif
@@ -0,0 +1,641 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Core of the driver: the layout of the bitstreams and everything that converts or draws into them.
+ * This part doesn't call any micropython or I2S / LCD functions, so it also builds on the host, see host/.
+ */
+
+#ifndef LEDMATRIX_CORE_H
+#define LEDMATRIX_CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_attr.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "ledmatrix_net.h"
+#if CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/cache.h"
+#include "lcd_parallel.h"
+#else
+#include "i2s_parallel.h"
+#endif
+
+/*
+ * The internal positions of the bits in the data stream buffer are always fixed.
+ * Mapping is done through the GPIO matrix
+ * The color values are all packed into the first byte.
+ * Since these values are the only thing that changes when the images is updated, this saves some time
+*/
+#define BITSTREAM_COLOR_START_IO 0
+#define BITSTREAM_COLOR_BYTE     0
+#define BITSTREAM_COLOR_R1_POS   0
+#define BITSTREAM_COLOR_G1_POS   1
+#define BITSTREAM_COLOR_B1_POS   2
+#define BITSTREAM_COLOR_R2_POS   3
+#define BITSTREAM_COLOR_G2_POS   4
+#define BITSTREAM_COLOR_B2_POS   5
+
+#define BITSTREAM_CTRL_BYTE          1
+#define BITSTREAM_CTRL_OE_BIT        0
+#define BITSTREAM_CTRL_LAT_BIT       1
+#define BITSTREAM_CTRL_ROW_START_BIT 2
+
+#define BITSTREAM_CTRL_OE_IO         8
+#define BITSTREAM_CTRL_LAT_IO        9
+#define BITSTREAM_CTRL_ROW_START_IO  10
+
+#define BITSTREAM_ROWS_MAX 6
+
+/*
+ * With an 8 bit bus, every pixel is a single byte with the colors at the same positions and OE and LAT on top.
+ * The row lines are not part of the stream, they are switched by the EOF interrupt at the end of every row.
+ */
+#define BITSTREAM8_OE_BIT     6
+#define BITSTREAM8_LAT_BIT    7
+#define BITSTREAM8_CTRL_MASK  ((1 << BITSTREAM8_OE_BIT) | (1 << BITSTREAM8_LAT_BIT))
+#define BITSTREAM8_COLOR_MASK ((uint8_t)~BITSTREAM8_CTRL_MASK)
+
+#define BITSTREAM8_OE_IO      6
+#define BITSTREAM8_LAT_IO     7
+
+// Limited by the width of plane_bits_t
+#define COLOR_DEPTH_MAX 8
+
+// The DMA length filed is 12 bit long and transfers must be word aligned
+#define DMA_MAX_XFER_SIZE ((1<<12) - 4)
+
+// Up to triple buffering
+#define BUFFER_COUNT_MAX 3
+#define NO_BUFFER        0xff
+
+// ESP32-S3: buffers in PSRAM must start and end on a block of the external memory
+#define DMA_EXT_MEM_ALIGN 64
+
+// The DMA only reports the lower 20 bits of descriptor addresses, all DMA capable memory is in the same 1MB block
+#define DMA_DESC_ADDR_MASK 0xfffff
+
+// Worker task for show_async
+#define ASYNC_TASK_STACK_SIZE 2048
+#define ASYNC_TASK_PRIORITY   1
+
+// Receiver task of listen, above micropython so it keeps up with the packets
+#define NET_TASK_STACK_SIZE 3072
+#define NET_TASK_PRIORITY   5
+// Time after which the receiver checks if it should stop
+#define NET_POLL_MS         100
+
+// Animation task of play, above micropython so garbage collection doesn't delay the frames
+#define PLAY_TASK_STACK_SIZE 2048
+#define PLAY_TASK_PRIORITY   2
+
+#define COLOR_RGB565 0
+#define COLOR_GS8    1
+#define COLOR_MONO   2
+#define COLOR_RGB888 3
+#define COLOR_RGB444 4
+#define COLOR_PAL8   5
+#define COLOR_PAL4   6
+#define COLOR_COUNT  7
+
+// Typical current of one LED channel of the constant current drivers on HUB75 panels, in mA
+#define LED_MA_DEFAULT 20
+#define POWER_CAP_NONE UINT16_MAX
+
+// Control bytes the EOF interrupt rewrites at most per call for brightness changes, so the critical section stays short.
+// With the 8 bit bus, the interrupt comes at the end of every row and has to switch the next row lines in time.
+#define BRIGHTNESS_WORK_BYTES  2048
+#define BRIGHTNESS_WORK_BYTES8 64
+
+// Color bytes of the stream, encoded in advance (see host/encode_planes.c), not part of the kernel table
+#define COLOR_PLANES (COLOR_COUNT + 1)
+
+// COLOR_PLANES frames start with a header describing the stream they were made for:
+// 'L' 'P' color_depth PLANES_FLAG_* width (16 bit LE) rows (16 bit LE)
+// followed by color_depth planes of rows * width color bytes each, in stream order (so with the column swap applied)
+#define PLANES_HEADER_SIZE 8
+#define PLANES_FLAG_SINGLE (1 << 0)
+#define PLANES_FLAG_SWAP   (1 << 1)
+
+// Encodings of show, the pixel values use one of the formats with whole bytes per pixel
+#define ENC_NONE  0
+#define ENC_RLE   1
+#define ENC_DELTA 2
+
+// Packets of an encoded frame, a header byte followed by the pixel values
+// 0x00 - 0x7f: literal, header + 1 pixel values
+// 0x80 - 0xbf: run, one pixel value repeated (header & ENC_COUNT_MASK) + 1 times
+// 0xc0 - 0xff: skip, (header & ENC_COUNT_MASK) + 1 pixels stay as they are, ENC_DELTA only
+#define ENC_RUN        0x80
+#define ENC_SKIP       0xc0
+#define ENC_COUNT_MASK 0x3f
+
+#define DITHER_NONE     0
+#define DITHER_ORDERED  1
+#define DITHER_TEMPORAL 2
+
+// Size of the ordered dither pattern, 2x2 pixels
+#define DITHER_CELLS 4
+
+// Special value for set_gamma, selects the CIE 1931 lightness curve
+#define GAMMA_CIE 0
+
+// Number of entries of the lookup tables for formats with 8 bit pixel values
+#define INDEX_LUT_SIZE 256
+// index_lut_color if the table doesn't match any color
+#define INDEX_LUT_INVALID 0xffffffff
+// index_lut_color if the table holds the palette
+#define INDEX_LUT_PALETTE 0x01000000
+
+// Image position of display pixels that are not mapped
+#define MAP_NONE 0xffff
+
+// Maximum number of tiles for the tiles init parameter
+#define MAP_TILES_MAX 64
+
+// Flags selecting the specialized conversion kernel
+#define KERNEL_FLAG_SWAP   (1 << 0)
+#define KERNEL_FLAG_SINGLE (1 << 1)
+#define KERNEL_FLAG_INVERT (1 << 2)
+#define KERNEL_FLAG_NARROW (1 << 3)
+#define KERNEL_FLAG_COUNT  (1 << 4)
+
+
+//#define DEBUG
+//#define DEBUG_DMA
+//#define DEBUG_TEST_ON_INIT
+
+// Cycle counter timestamps for ledmatrix.stats(), build with -DLEDMATRIX_STATS=0 to leave them out
+#ifndef LEDMATRIX_STATS
+#define LEDMATRIX_STATS 1
+#endif
+
+typedef struct
+{
+	// Every plane is a separate allocation of 2 * width * rows bytes, so a buffer still fits into a fragmented heap
+	uint8_t *planes[COLOR_DEPTH_MAX];
+	lldesc_t *dma_desc;
+	// Brightness of the output enable pattern, it follows matrix_t.brightness, see buffer_move_brightness.
+	// While a move is in progress, the lines (rows of a plane) before oe_line have brightness_to already.
+	uint16_t brightness;
+	uint16_t brightness_to;
+	uint16_t oe_line;
+
+	// Highest brightness within the power limit for the frame in this buffer, POWER_CAP_NONE without a limit.
+	// Set by the converting task when the frame is presented, for the displayed buffers by set_power_limit under swap_lock.
+	uint16_t power_cap;
+
+	// Luminance of every row for buffer_luminance, and the rows written since they were counted.
+	// Only the task that converts into the buffer updates them, see buffer_update_luminance.
+	uint32_t (*row_lum)[3];
+	uint64_t lum_stale;
+} stream_buffer_t;
+
+// Counters for ledmatrix.stats()
+typedef struct
+{
+	// Number of frames converted by show and show_async
+	uint32_t frames_shown;
+	// Pending buffers that missed the end of a refresh cycle and had to wait for the next one
+	volatile uint32_t missed_swaps;
+	// Memory of all buffers
+	size_t stream_bytes;
+	size_t desc_bytes;
+	// Frames shown with less than the set brightness because of the power limit
+	uint32_t power_limited;
+#if LEDMATRIX_STATS
+	// CPU cycles of update_framebuffer
+	uint32_t update_cycles_last;
+	uint64_t update_cycles_total;
+	uint32_t update_count;
+	// Refresh cycles and their total length since the last call of stats, measured by the EOF interrupt
+	uint32_t eof_last;
+	uint32_t eof_frames;
+	uint64_t eof_cycles;
+#endif
+} stats_t;
+
+// Color bits of a pixel for all planes, byte n holds the BITSTREAM_COLOR_BYTE bits for plane n
+typedef uint64_t plane_bits_t;
+
+// Plane bits for every value of the RGB565 channels at the current color depth
+typedef struct
+{
+	plane_bits_t r[32];
+	plane_bits_t g[64];
+	plane_bits_t b[32];
+} rgb565_lut_t;
+
+// Plane bits for every value of the RGB444 channels
+typedef struct
+{
+	plane_bits_t r[16];
+	plane_bits_t g[16];
+	plane_bits_t b[16];
+} rgb444_lut_t;
+
+// Plane bits for every value of the RGB888 channels
+typedef struct
+{
+	plane_bits_t r[256];
+	plane_bits_t g[256];
+	plane_bits_t b[256];
+} rgb888_lut_t;
+
+// Rectangle in display coordinates, x1 and y1 are exclusive
+typedef struct
+{
+	uint16_t x0;
+	uint16_t y0;
+	uint16_t x1;
+	uint16_t y1;
+} rect_t;
+
+// Part of a stream buffer that is out of date: a set of rows and a column range for all of them
+// Columns are always aligned to pairs, since column swapping works on pairs.
+typedef struct
+{
+	uint64_t rows;
+	uint16_t x0;
+	uint16_t x1;
+} dirty_t;
+
+// Run of display pixels in one row that map to a straight line of image pixels
+// Display columns x0 to x1 - 1 show the image pixels (ix + k * dx, iy + k * dy)
+typedef struct
+{
+	uint16_t x0;
+	uint16_t x1;
+	// MAP_NONE for display pixels without an image pixel, these stay black
+	uint16_t ix;
+	uint16_t iy;
+	int8_t dx;
+	int8_t dy;
+} map_run_t;
+
+// Parameters of a single show / show_async call
+typedef struct
+{
+	const uint8_t *data;
+	// Distance between the lines of the source image in bytes
+	size_t stride;
+	rect_t region;
+	uint8_t format;
+	// Find the changed lines by comparing with the hashes of the previous frame, region is ignored
+	bool diff;
+	// ENC_* of data, encoded frames are length bytes long and stride and region are not used
+	uint8_t encoding;
+	size_t length;
+	// The source image is scaled up by 1 << scale_shift
+	uint8_t scale_shift;
+} show_job_t;
+
+// Frame of play, data and length are the same as for show
+typedef struct
+{
+	const uint8_t *data;
+	size_t length;
+} play_frame_t;
+
+// Refresh cycle and memory for one color depth, see plan_depth
+typedef struct
+{
+	uint8_t color_depth;
+	uint8_t bam_planes;
+	size_t subimages;
+	// Samples output per refresh cycle, the refresh rate is the clock divided by this
+	uint32_t cycle_samples;
+	// Descriptors of one ring
+	size_t desc_count;
+	// Memory of all buffers
+	size_t stream_bytes;
+	size_t desc_bytes;
+	// Every plane is a block of its own
+	size_t plane_bytes;
+} refresh_plan_t;
+
+// Block of pixels for a single run of a conversion kernel, in stream coordinates
+typedef struct
+{
+	uint16_t x0;
+	uint16_t x1;
+	uint8_t row0;
+	uint8_t row1;
+} update_window_t;
+
+// lwIP connection of the network receiver
+struct netconn;
+
+typedef struct
+{
+	// I2S peripheral used for the output, always 0 for the LCD_CAM peripheral of the ESP32-S3
+	uint8_t port;
+
+	// Buffers for the bitstreams, only the first buffer_count are used
+	stream_buffer_t buffer[BUFFER_COUNT_MAX];
+
+	// Number of dma descriptors, equal for all buffers
+	size_t dma_desc_count;
+	// Number of dma descriptors allocated per buffer, can be more than dma_desc_count after matrix_set_depth
+	size_t dma_desc_alloc;
+
+	uint16_t width;
+	uint16_t height;
+
+	// Size of the image shown on the display, only differs from width and height with a panel mapping
+	uint16_t image_width;
+	uint16_t image_height;
+
+	// Panel mapping compiled at init, NULL if the image is shown as is
+	// Display row y consists of the runs map_row[y] to map_row[y + 1] - 1
+	map_run_t *map_runs;
+	uint32_t *map_row;
+	// Stream rows and columns showing each line of the image
+	dirty_t *map_lines;
+
+	// Position of the display in the framebuffer passed to show, so multiple displays can share one framebuffer
+	uint16_t fb_y;
+	uint16_t fb_height;
+
+	// Global brightness
+	// For every line, the driver output is only kept on as long as the current pixel < brightness
+	// Changed by the EOF interrupt while a fade is running, protected by swap_lock.
+	// The buffers follow it up to their power cap, see buffer_brightness, the displayed ones by the EOF interrupt
+	// and the backbuffer when it is presented.
+	volatile uint16_t brightness;
+
+	// Brightness set by init, set_brightness or fade, a running fade ends there
+	uint16_t user_brightness;
+
+	// Limit of the estimated LED current in mA, 0 if off, and the current of one LED channel while it is on
+	uint32_t power_limit_ma;
+	uint16_t led_ma;
+
+	// Brightness fade run by the EOF interrupt, fade_frames is 0 if no fade is running
+	uint16_t fade_from;
+	uint16_t fade_to;
+	uint32_t fade_frame;
+	volatile uint32_t fade_frames;
+
+	// Duration of one refresh cycle
+	uint32_t refresh_us;
+
+	// Color for monochrome images
+	uint8_t mono_color[3];
+
+	// RGB565 lookup tables, one for every cell of the dither pattern.
+	// Like all tables below, they are allocated by matrix_alloc, so an unused display costs no memory.
+	rgb565_lut_t *rgb565_lut;
+
+	// RGB444 lookup tables, one for every cell of the dither pattern
+	rgb444_lut_t *rgb444_lut;
+
+	// RGB888 lookup tables for every dither cell, allocated on first use since they are rather large
+	rgb888_lut_t *rgb888_lut;
+	bool rgb888_lut_valid;
+
+	// Plane bits for every pixel value of GS8 and palette images, INDEX_LUT_SIZE entries for every dither cell
+	plane_bits_t *index_lut;
+	// Mono color the index_lut was built for, or INDEX_LUT_PALETTE
+	uint32_t index_lut_color;
+
+	// Colors 0xRRGGBB for FB_PAL8 and FB_PAL4 images, INDEX_LUT_SIZE entries
+	uint32_t *palette;
+
+	// Correction of the 8 bit channel values (gamma and white balance), applied before dithering, 3 tables of 256 entries
+	uint8_t (*channel_lut)[256];
+	// Channel correction and palette set while listen or play are running, NULL if there is none.
+	// The background task takes them over between two frames, so it never converts from a half written table.
+	uint8_t (*channel_lut_next)[256];
+	uint32_t *palette_next;
+
+	// DITHER_* mode
+	uint8_t dither;
+	// Rotates the dither pattern between the cells, advanced by every show with DITHER_TEMPORAL
+	uint8_t dither_phase;
+	// Added to the 8 bit channel values before they are truncated to the color depth
+	uint8_t dither_offset[DITHER_CELLS];
+
+	// Effective number of rows, this is half of the height for displays that are split into two parts
+	uint8_t rows;
+
+	// Bytes per pixel in the stream, 2 for the 16 bit bus or 1 for the 8 bit bus
+	uint8_t sample_size;
+
+	// ESP32-S3: the planes are in PSRAM, every change has to be written back from the cache before the DMA sees it
+	bool ext_mem;
+
+	// 8 bit bus: pixels at the end of every row with the output disabled, so the row lines can be switched in that time
+	uint16_t row_blank;
+
+	// 8 bit bus: GPIO bit of every row line and all of them, switched by the EOF interrupt
+	uint64_t row_io_bits[BITSTREAM_ROWS_MAX];
+	uint64_t row_io_all;
+	uint8_t row_io_count;
+
+	// Number of bits per color
+	uint8_t color_depth;
+
+	// Number of low planes that are output only once with a shortened output enable time (bit angle modulation)
+	// All other planes are repeated as usual, but relative to the first one of them
+	uint8_t bam_planes;
+
+	// Number of buffers, more than one avoids tearing, but every buffer costs the full amount of RAM
+	// With three buffers, show never has to wait for the display
+	uint8_t buffer_count;
+
+	// index of the current backbuffer, this is the buffer being written
+	uint8_t backbuffer;
+
+	// The backbuffer is selected and in use, e.g. by the drawing functions
+	bool backbuffer_acquired;
+
+	// index of the buffer that is currently displayed, updated by the EOF interrupt
+	volatile uint8_t frontbuffer;
+
+	// index of the buffer that will be displayed after the current refresh cycle, or NO_BUFFER
+	volatile uint8_t pending;
+
+	// Parts of every buffer that changed since the buffer was last written
+	dirty_t stale[BUFFER_COUNT_MAX];
+
+	// Hash of every line of the last frame shown with diff enabled, image_height entries
+	uint32_t *line_hash;
+	// line_hash matches what was shown last
+	bool line_hash_valid;
+
+	// invert output signals
+	bool invert;
+
+	// swap every second column
+	// Some displays are wired that way
+	bool column_swap;
+
+	// Single channel display only uses a single color channel
+	// Number of rows is equal to the height for this type
+	bool single_chn;
+
+	// KERNEL_FLAG_* combination for the settings above and the bus width
+	uint8_t kernel_flags;
+
+	// Worker for asynchronous updates, created on the first call of show_async
+	TaskHandle_t async_task;
+	// Given by the worker every time a conversion is finished
+	SemaphoreHandle_t async_done;
+	// Job for the worker, only valid while async_busy is set
+	show_job_t async_job;
+	volatile bool async_busy;
+
+	// Network receiver of listen, the task is NULL if it is not running
+	TaskHandle_t net_task;
+	// Given by the receiver task right before it ends
+	SemaphoreHandle_t net_done;
+	volatile bool net_stop;
+	struct netconn *net_conn;
+	net_sink_t net;
+
+	// Animation of play, the task is NULL if nothing is playing
+	// The task is notified by the EOF interrupt after every refresh cycle, see swap_lock
+	TaskHandle_t play_task;
+	// Given by the player when it stops, either when asked to or after the last frame
+	SemaphoreHandle_t play_done;
+	volatile bool play_stop;
+	volatile bool play_running;
+	// play_count frames, shown every play_period_us with the settings of play_job
+	play_frame_t *play_frames;
+	size_t play_count;
+	show_job_t play_job;
+	uint32_t play_period_us;
+	bool play_loop;
+	// Frames shown and frames that were converted too late for their time
+	uint32_t play_shown;
+	uint32_t play_late;
+
+	// Number of completed refresh cycles, counted by the DMA EOF interrupt
+	volatile uint32_t frame_count;
+	stats_t stats;
+	// Given by the EOF interrupt after every refresh cycle
+	SemaphoreHandle_t vsync_sem;
+	// Python function (mp_obj_t) scheduled after every refresh cycle, NULL if not set
+	void *vsync_callback;
+	// Given by the EOF interrupt when the pending buffer made it to the display
+	SemaphoreHandle_t swap_sem;
+	// Maximum time to wait for a swap, a bit more than one refresh cycle
+	TickType_t swap_timeout;
+
+#if !CONFIG_IDF_TARGET_ESP32S3
+	// For reading the current DMA position and setting the clock
+	i2s_dev_t *i2s_dev;
+	// Value of the clkm_conf register written at the end of the current refresh cycle, 0 if none
+	uint32_t clkm_next;
+#endif
+
+	// Protects frontbuffer, pending, the ring links and play_task against the EOF interrupt
+	portMUX_TYPE swap_lock;
+
+	// DMA output is active
+	volatile bool running;
+
+	// DMA is running / initialized
+	bool initialized;
+} matrix_t;
+
+// Called for a display pixel (x, y) showing image pixel (ix, iy)
+typedef void (*draw_func_t)(matrix_t *m, stream_buffer_t *buf, uint16_t x, uint16_t y, uint16_t ix, uint16_t iy, void *ctx);
+
+// Source of ledmatrix.blit
+typedef struct
+{
+	const uint8_t *data;
+	size_t line_size;
+	int32_t x;
+	int32_t y;
+	uint8_t format;
+	int32_t key;
+	plane_bits_t mono_bits[DITHER_CELLS];
+} blit_src_t;
+
+// Buffers and lookup tables
+esp_err_t matrix_alloc(matrix_t *m);
+esp_err_t matrix_set_depth(matrix_t *m, uint8_t depth, uint8_t bam);
+void plan_depth(matrix_t *m, uint8_t depth, uint8_t bam, refresh_plan_t *plan);
+void buffer_update_luminance(matrix_t *m, stream_buffer_t *buf);
+void buffer_luminance(matrix_t *m, const stream_buffer_t *buf, uint32_t *lum);
+uint32_t luminance_current(matrix_t *m, const uint32_t *lum, uint16_t brightness);
+uint16_t power_limited_brightness(matrix_t *m, const uint32_t *lum, uint16_t max_b, uint32_t limit_ma);
+void matrix_free(matrix_t *m);
+size_t plane_repeats(matrix_t *m, uint8_t lvl);
+size_t subimage_count(matrix_t *m);
+esp_err_t initialize_buffer(matrix_t *m, stream_buffer_t *buf);
+void create_control_pattern(matrix_t *m, stream_buffer_t *buf);
+void buffer_writeback(matrix_t *m, stream_buffer_t *buf);
+uint16_t buffer_brightness(const matrix_t *m, const stream_buffer_t *buf);
+bool buffer_move_brightness(matrix_t *m, stream_buffer_t *buf, uint16_t b, uint32_t *budget);
+void buffer_set_brightness(matrix_t *m, stream_buffer_t *buf, uint16_t b);
+void fade_step(matrix_t *m);
+void build_channel_lut(uint8_t (*lut)[256], float gamma, uint32_t white);
+void init_channel_lut(matrix_t *m, float gamma, uint32_t white);
+void channel_lut_changed(matrix_t *m);
+esp_err_t prepare_format(matrix_t *m, uint8_t format);
+
+// Conversion of images
+size_t format_line_size(uint8_t format, uint16_t width);
+size_t source_line_size(matrix_t *m, uint8_t format);
+plane_bits_t get_rgb888_plane_bits(matrix_t *m, uint32_t color, uint8_t cell);
+void get_mono_plane_bits(matrix_t *m, plane_bits_t *bits);
+void update_framebuffer(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, const dirty_t *dirty);
+void update_framebuffer_scaled_by(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t stride, uint8_t format, uint8_t shift, const dirty_t *dirty);
+#ifdef DEBUG_TEST_ON_INIT
+void draw_test_pattern(matrix_t *m, stream_buffer_t *buf);
+#endif
+
+// Tracking of the changed parts
+void dirty_clear(dirty_t *dirty);
+void dirty_set_all(matrix_t *m, dirty_t *dirty);
+void dirty_add_columns(dirty_t *dirty, uint16_t x0, uint16_t x1);
+void dirty_add(dirty_t *dirty, const dirty_t *other);
+void dirty_add_rect(matrix_t *m, dirty_t *dirty, const rect_t *rect);
+void diff_lines(matrix_t *m, const show_job_t *job, dirty_t *changes);
+
+// Drawing into the buffers
+void draw_mark(matrix_t *m, const rect_t *rect);
+bool clip_rect(matrix_t *m, int32_t x, int32_t y, int32_t w, int32_t h, rect_t *rect);
+void draw_each(matrix_t *m, stream_buffer_t *buf, const rect_t *rect, draw_func_t func, void *ctx);
+void draw_fill_rect(matrix_t *m, stream_buffer_t *buf, const rect_t *rect, const plane_bits_t *bits);
+void draw_blit_pixel(matrix_t *m, stream_buffer_t *buf, uint16_t x, uint16_t y, uint16_t ix, uint16_t iy, void *ctx);
+void draw_span(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, uint16_t x0, uint16_t x1, uint16_t y, uint8_t format);
+esp_err_t encoded_frame_check(matrix_t *m, const uint8_t *data, size_t len, uint8_t format, uint8_t encoding);
+void decode_frame(matrix_t *m, stream_buffer_t *buf, const uint8_t *data, size_t len, uint8_t format, rect_t *changed);
+size_t planes_frame_size(matrix_t *m);
+void planes_frame_header(matrix_t *m, uint8_t *header);
+esp_err_t planes_frame_check(matrix_t *m, const uint8_t *data, size_t len);
+void copy_planes(matrix_t *m, stream_buffer_t *buf, const uint8_t *data);
+void scroll_columns(matrix_t *m, stream_buffer_t *buf, int32_t dx);
+void scroll_lines(matrix_t *m, stream_buffer_t *buf, int32_t dy);
+
+#endif
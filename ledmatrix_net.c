@@ -0,0 +1,265 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "ledmatrix_net.h"
+
+static inline uint16_t read_be16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t read_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Sets up the receiver for a display of height lines of stride bytes at line fb_y of a frame of fb_height lines.
+ */
+void net_sink_init(net_sink_t *sink, uint8_t protocol, uint16_t universe, size_t stride, uint16_t height, uint16_t fb_y, uint16_t fb_height)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->protocol = protocol;
+	sink->stride = stride;
+	sink->frame_size = stride * height;
+	sink->frame_offset = stride * fb_y;
+	sink->universe = universe;
+	sink->universe_count = (stride * fb_height + NET_E131_UNIVERSE_BYTES - 1) / NET_E131_UNIVERSE_BYTES;
+}
+
+/*
+ * DDP, see http://www.3waylabs.com/ddp/
+ * Every packet has the byte offset of its data in the frame, the last one of a frame has the push flag.
+ */
+static bool parse_ddp(net_sink_t *sink, const uint8_t *pkt, size_t len, size_t total, net_packet_t *out)
+{
+	(void)sink;
+	if (len < NET_DDP_HEADER_SIZE || (pkt[0] & 0xc0) != NET_DDP_FLAG_VERSION)
+	{
+		return false;
+	}
+
+	// Queries and replies of other devices, nothing to show
+	if (pkt[0] & (NET_DDP_FLAG_QUERY | NET_DDP_FLAG_REPLY))
+	{
+		return false;
+	}
+
+	if (pkt[3] != NET_DDP_ID_DISPLAY && pkt[3] != NET_DDP_ID_ALL)
+	{
+		return false;
+	}
+
+	size_t start = (pkt[0] & NET_DDP_FLAG_TIMECODE) ? NET_DDP_HEADER_SIZE_TC : NET_DDP_HEADER_SIZE;
+	if (len < start)
+	{
+		return false;
+	}
+
+	size_t length = read_be16(pkt + 8);
+	if (length > total - start)
+	{
+		length = total - start;
+	}
+
+	out->offset = read_be32(pkt + 4);
+	out->start = start;
+	out->length = length;
+	out->push = pkt[0] & NET_DDP_FLAG_PUSH;
+	return true;
+}
+
+/*
+ * E1.31 (sACN), every universe is a DMX frame of up to 512 channels.
+ * The universes of a frame are consecutive, starting at sink->universe.
+ */
+static bool parse_e131(net_sink_t *sink, const uint8_t *pkt, size_t len, size_t total, net_packet_t *out)
+{
+	static const uint8_t acn_id[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+	if (len < NET_E131_SYNC_SIZE || read_be16(pkt) != 0x0010 || memcmp(pkt + 4, acn_id, sizeof(acn_id)))
+	{
+		return false;
+	}
+
+	uint32_t root_vector = read_be32(pkt + 18);
+	uint32_t framing_vector = read_be32(pkt + 40);
+
+	// Universe synchronization, all universes received so far are shown
+	if (root_vector == 0x00000008 && framing_vector == 0x00000001)
+	{
+		if (!sink->synced)
+		{
+			return false;
+		}
+		out->offset = 0;
+		out->start = 0;
+		out->length = 0;
+		out->push = true;
+		return true;
+	}
+
+	if (len < NET_E131_HEADER_SIZE || root_vector != 0x00000004 || framing_vector != 0x00000002)
+	{
+		return false;
+	}
+
+	// DMP layer with the usual address type and a start code of 0, everything else is not pixel data
+	if (pkt[117] != 0x02 || pkt[118] != 0xa1 || pkt[125] != 0)
+	{
+		return false;
+	}
+
+	// Preview data is for visualizers, not for the display
+	if (pkt[112] & 0x80)
+	{
+		return false;
+	}
+
+	uint16_t universe = read_be16(pkt + 113);
+	if (universe < sink->universe || universe >= sink->universe + sink->universe_count)
+	{
+		return false;
+	}
+
+	size_t length = read_be16(pkt + 123);
+	length = length ? length - 1 : 0;
+	if (length > NET_E131_UNIVERSE_BYTES)
+	{
+		length = NET_E131_UNIVERSE_BYTES;
+	}
+	if (length > total - NET_E131_HEADER_SIZE)
+	{
+		length = total - NET_E131_HEADER_SIZE;
+	}
+
+	size_t offset = (size_t)(universe - sink->universe) * NET_E131_UNIVERSE_BYTES;
+	sink->synced = read_be16(pkt + 109) != 0;
+
+	out->offset = offset;
+	out->start = NET_E131_HEADER_SIZE;
+	out->length = length;
+	// Without synchronization, the frame is complete with the last universe of the display
+	size_t end = sink->frame_offset + sink->frame_size;
+	out->push = !sink->synced && offset < end && offset + NET_E131_UNIVERSE_BYTES >= end;
+	return true;
+}
+
+/*
+ * Parses the header of a packet of total bytes, the first len of them are in pkt.
+ * Returns false if the packet has nothing for the display.
+ */
+bool net_parse(net_sink_t *sink, const uint8_t *pkt, size_t len, size_t total, net_packet_t *out)
+{
+	sink->packets++;
+
+	bool ok = false;
+	if (sink->protocol == NET_DDP)
+	{
+		ok = parse_ddp(sink, pkt, len, total, out);
+	}
+	else if (sink->protocol == NET_E131)
+	{
+		ok = parse_e131(sink, pkt, len, total, out);
+	}
+
+	if (!ok)
+	{
+		sink->dropped++;
+	}
+	return ok;
+}
+
+/*
+ * Hands the part of the pixel data at offset of the frame of the sender that is shown on the display to func,
+ * split into spans of whole pixels within a line. Nothing is copied, except for a pixel split between two pieces
+ * of pixel data, e.g. at the end of a pbuf. Its first bytes are kept until the rest arrives with the next piece.
+ */
+void net_store(net_sink_t *sink, uint32_t offset, const uint8_t *data, size_t len, net_span_func_t func, void *ctx)
+{
+	size_t begin = offset;
+	size_t end = begin + len;
+	if (begin < sink->frame_offset)
+	{
+		data += sink->frame_offset - begin;
+		begin = sink->frame_offset;
+	}
+	if (end > sink->frame_offset + sink->frame_size)
+	{
+		end = sink->frame_offset + sink->frame_size;
+	}
+	if (begin >= end)
+	{
+		return;
+	}
+
+	size_t pos = begin - sink->frame_offset;
+	end -= sink->frame_offset;
+
+	// Rest of a split pixel, it can only be completed if the start was the piece right before
+	size_t part = pos % NET_PIXEL_SIZE;
+	if (part)
+	{
+		size_t pixel = pos - part;
+		size_t n = (end - pos < NET_PIXEL_SIZE - part) ? end - pos : NET_PIXEL_SIZE - part;
+		if (sink->carry_offset == pixel && sink->carry_len == part)
+		{
+			memcpy(sink->carry + part, data, n);
+			sink->carry_len += n;
+			if (sink->carry_len == NET_PIXEL_SIZE)
+			{
+				uint16_t x = (pixel % sink->stride) / NET_PIXEL_SIZE;
+				func(ctx, pixel / sink->stride, x, x + 1, sink->carry);
+			}
+		}
+		data += n;
+		pos += n;
+		if (pos == end)
+		{
+			return;
+		}
+	}
+
+	// Whole pixels go straight from the packet to func, one line at a time
+	while (end - pos >= NET_PIXEL_SIZE)
+	{
+		size_t line = pos / sink->stride;
+		size_t line_end = (line + 1) * sink->stride;
+		size_t n = ((line_end < end ? line_end : end) - pos) / NET_PIXEL_SIZE;
+		uint16_t x = (pos - line * sink->stride) / NET_PIXEL_SIZE;
+		func(ctx, line, x, x + n, data);
+		data += NET_PIXEL_SIZE * n;
+		pos += NET_PIXEL_SIZE * n;
+	}
+
+	sink->carry_len = 0;
+	if (pos < end)
+	{
+		sink->carry_offset = pos;
+		sink->carry_len = end - pos;
+		memcpy(sink->carry, data, end - pos);
+	}
+}
@@ -0,0 +1,114 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Daniel Frejek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Protocols of the network receiver, see ledmatrix.listen.
+ * Only the parsing and the frame assembly live here, the sockets are in ledmatrix.c,
+ * so this builds on the host like the core.
+ */
+
+#ifndef LEDMATRIX_NET_H
+#define LEDMATRIX_NET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NET_NONE 0
+#define NET_DDP  1
+#define NET_E131 2
+
+#define NET_DDP_PORT  4048
+#define NET_E131_PORT 5568
+
+// DDP: header without and with the optional time code
+#define NET_DDP_HEADER_SIZE    10
+#define NET_DDP_HEADER_SIZE_TC 14
+#define NET_DDP_FLAG_VERSION   0x40
+#define NET_DDP_FLAG_TIMECODE  0x10
+#define NET_DDP_FLAG_REPLY     0x04
+#define NET_DDP_FLAG_QUERY     0x02
+#define NET_DDP_FLAG_PUSH      0x01
+#define NET_DDP_ID_DISPLAY     1
+#define NET_DDP_ID_ALL         255
+
+// E1.31: data packets up to the DMX start code and the universe synchronization packet
+#define NET_E131_HEADER_SIZE 126
+#define NET_E131_SYNC_SIZE   49
+// Every universe carries 170 whole RGB pixels, the last two channels are unused
+#define NET_E131_UNIVERSE_BYTES 510
+#define NET_E131_UNIVERSE_MAX   63999
+
+// Pixel data of a packet, offsets are bytes of the RGB888 frame of the sender
+typedef struct
+{
+	uint32_t offset;
+	// Position of the data within the packet
+	uint16_t start;
+	uint16_t length;
+	// The frame is complete and can be shown
+	bool push;
+} net_packet_t;
+
+// Bytes of an RGB888 pixel
+#define NET_PIXEL_SIZE 3
+
+/*
+ * Receives the pixels x0 to x1 - 1 of line y of the display, pixels holds pixel x0 first.
+ */
+typedef void (*net_span_func_t)(void *ctx, uint16_t y, uint16_t x0, uint16_t x1, const uint8_t *pixels);
+
+typedef struct
+{
+	uint8_t protocol;
+
+	// E1.31: universe of the first pixel and number of universes of the frame
+	uint16_t universe;
+	uint16_t universe_count;
+	// E1.31: the sender uses synchronization packets, only these push the frame
+	bool synced;
+
+	// Size of the lines of the display in the RGB888 frame of the sender, the same layout as the framebuffer for show
+	size_t stride;
+	size_t frame_size;
+	// Position of the display in the frame of the sender, for displays sharing a framebuffer (fb_y)
+	size_t frame_offset;
+
+	// Start of a pixel split between two pieces of pixel data, at carry_offset of the display
+	uint8_t carry[NET_PIXEL_SIZE];
+	uint8_t carry_len;
+	size_t carry_offset;
+
+	// Counters for ledmatrix.stats()
+	uint32_t packets;
+	uint32_t dropped;
+	uint32_t frames;
+} net_sink_t;
+
+void net_sink_init(net_sink_t *sink, uint8_t protocol, uint16_t universe, size_t stride, uint16_t height, uint16_t fb_y, uint16_t fb_height);
+bool net_parse(net_sink_t *sink, const uint8_t *pkt, size_t len, size_t total, net_packet_t *out);
+void net_store(net_sink_t *sink, uint32_t offset, const uint8_t *data, size_t len, net_span_func_t func, void *ctx);
+
+#endif
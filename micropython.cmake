@@ -0,0 +1,32 @@
+# Build of the module for the CMake based esp32 port, e.g. for the ESP32-S3
+add_library(usermod_ledmatrix INTERFACE)
+
+target_sources(usermod_ledmatrix INTERFACE
+    ${CMAKE_CURRENT_LIST_DIR}/ledmatrix.c
+    ${CMAKE_CURRENT_LIST_DIR}/ledmatrix_core.c
+    ${CMAKE_CURRENT_LIST_DIR}/ledmatrix_net.c
+)
+
+target_include_directories(usermod_ledmatrix INTERFACE
+    ${CMAKE_CURRENT_LIST_DIR}
+)
+
+# The ESP32-S3 has no I2S parallel mode and uses the LCD_CAM peripheral instead
+if(IDF_TARGET STREQUAL "esp32s3")
+    target_sources(usermod_ledmatrix INTERFACE
+        ${CMAKE_CURRENT_LIST_DIR}/lcd_parallel.c
+    )
+else()
+    target_sources(usermod_ledmatrix INTERFACE
+        ${CMAKE_CURRENT_LIST_DIR}/esp_i2s_parallel/src/i2s_parallel.c
+    )
+    target_include_directories(usermod_ledmatrix INTERFACE
+        ${CMAKE_CURRENT_LIST_DIR}/esp_i2s_parallel/include
+    )
+endif()
+
+target_compile_definitions(usermod_ledmatrix INTERFACE
+    MODULE_LEDMATRIX_ENABLED=1
+)
+
+target_link_libraries(usermod INTERFACE usermod_ledmatrix)